@@ -45,6 +45,11 @@ typedef struct {
 	atomic_bool				transmit_aplay;
 	atomic_uint				video_orient;
 
+	// Оценки пропускной способности от получателя, под _g_video_lock
+	uint					video_remb_kbps;
+	uint					video_loss_kbps;
+	ldf						video_feedback_ts;
+
 	pthread_t				video_tid;
 	pthread_t				acap_tid;
 	pthread_t				aplay_tid;
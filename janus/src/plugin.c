@@ -87,6 +87,8 @@ static atomic_bool		_g_has_watchers = false;
 static atomic_bool		_g_has_listeners = false;
 static atomic_bool		_g_has_speakers = false;
 static atomic_bool		_g_key_required = false;
+static atomic_uint		_g_video_kbps = 0; // Actual bitrate of the stream
+static atomic_uint		_g_video_wanted_kbps = 0; // The worst receiver estimation, 0 - no wishes
 
 
 #define _LOCK_VIDEO		US_MUTEX_LOCK(_g_video_lock)
@@ -140,6 +142,9 @@ static void *_video_sink_thread(void *arg) {
 	us_frame_s *tmp = us_frame_init();
 	int once = 0;
 
+	uz rate_bytes = 0;
+	ldf rate_ts = us_get_now_monotonic();
+
 	while (!_STOP) {
 		if (!_HAS_WATCHERS) {
 			US_ONCE({ US_LOG_INFO("No active watchers, memsink disconnected"); });
@@ -156,9 +161,20 @@ static void *_video_sink_thread(void *arg) {
 
 		US_LOG_INFO("Memsink opened; reading frames ...");
 		while (!_STOP && _HAS_WATCHERS) {
-			const us_memsink_wants_s w_put = {.key = atomic_load(&_g_key_required)};
+			const us_memsink_wants_s w_put = {
+				.key = atomic_load(&_g_key_required),
+				.bitrate = atomic_load(&_g_video_wanted_kbps),
+			};
 			const int got = us_memsink_client_get(sink, tmp, NULL, &w_put);
 			if (got == 0) {
+				rate_bytes += tmp->used;
+				const ldf now_ts = us_get_now_monotonic();
+				if (rate_ts + 1 <= now_ts) {
+					atomic_store(&_g_video_kbps, rate_bytes * 8 / 1000 / (now_ts - rate_ts));
+					rate_bytes = 0;
+					rate_ts = now_ts;
+				}
+
 				const int ri = us_ring_producer_acquire(_g_video_ring, 0);
 				if (ri >= 0) {
 					us_frame_s *dest = _g_video_ring->items[ri];
@@ -685,6 +701,70 @@ static void _plugin_incoming_rtp(janus_plugin_session *session, janus_plugin_rtp
 	_UNLOCK_APLAY;
 }
 
+static int _rtcp_get_fraction_lost(const char *buf, int len) {
+	// Наибольшая доля потерь (x/256) по всем report blocks из SR и RR или -1
+	const u8 *ptr = (const u8*)buf;
+	int lost = -1;
+	while (len >= 4) {
+		const uint count = ptr[0] & 0x1F;
+		const uint type = ptr[1];
+		const int size = (((ptr[2] << 8) | ptr[3]) + 1) * 4;
+		if (size > len) {
+			break;
+		}
+		int offset = 0;
+		if (type == 200) { // SR: header, SSRC and sender info
+			offset = 28;
+		} else if (type == 201) { // RR: header and SSRC
+			offset = 8;
+		}
+		if (offset > 0) {
+			for (uint i = 0; i < count && offset + 24 <= size; ++i, offset += 24) {
+				lost = US_MAX(lost, (int)ptr[offset + 4]);
+			}
+		}
+		ptr += size;
+		len -= size;
+	}
+	return lost;
+}
+
+static void _update_video_feedback(janus_plugin_session *session, uint remb_kbps, int lost) {
+	const ldf now_ts = us_get_now_monotonic();
+	const uint sent_kbps = atomic_load(&_g_video_kbps);
+	uint wanted = 0;
+	_LOCK_VIDEO;
+	US_LIST_ITERATE(_g_clients, client, {
+		if (client->session == session) {
+			if (remb_kbps > 0) {
+				client->video_remb_kbps = remb_kbps;
+			}
+			if (lost >= 0 && sent_kbps > 0) {
+				// Контроллер по потерям как в GCC: больше 10% (25/256) - снижаем, меньше 2% - плавно растем
+				uint kbps = (client->video_loss_kbps > 0 ? client->video_loss_kbps : sent_kbps);
+				if (lost > 25) {
+					kbps = sent_kbps * (1 - 0.5 * lost / 256);
+				} else if (lost < 5) {
+					kbps = US_MIN(kbps * 1.05 + 1, sent_kbps * 1.5);
+				}
+				client->video_loss_kbps = US_MAX(kbps, (uint)1);
+			}
+			client->video_feedback_ts = now_ts;
+		}
+		if (atomic_load(&client->transmit) && client->video_feedback_ts + 5 > now_ts) {
+			uint kbps = client->video_remb_kbps;
+			if (client->video_loss_kbps > 0 && (kbps == 0 || client->video_loss_kbps < kbps)) {
+				kbps = client->video_loss_kbps;
+			}
+			if (kbps > 0 && (wanted == 0 || kbps < wanted)) {
+				wanted = kbps;
+			}
+		}
+	});
+	_UNLOCK_VIDEO;
+	atomic_store(&_g_video_wanted_kbps, wanted);
+}
+
 static void _plugin_incoming_rtcp(janus_plugin_session *session, janus_plugin_rtcp *packet) {
 	_IF_DISABLED({ return; });
 	if (session == NULL || packet == NULL || !packet->video) {
@@ -696,6 +776,11 @@ static void _plugin_incoming_rtcp(janus_plugin_session *session, janus_plugin_rt
 	) {
 		atomic_store(&_g_key_required, true);
 	}
+	const uint remb_kbps = janus_rtcp_get_remb(packet->buffer, packet->length) / 1000;
+	const int lost = _rtcp_get_fraction_lost(packet->buffer, packet->length);
+	if (remb_kbps > 0 || lost >= 0) {
+		_update_video_feedback(session, remb_kbps, lost);
+	}
 }
 
 
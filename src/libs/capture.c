@@ -106,6 +106,11 @@ static int _capture_open_io_method_userptr(us_capture_s *cap);
 static int _capture_open_queue_buffers(us_capture_s *cap);
 static int _capture_open_export_to_dma(us_capture_s *cap);
 static int _capture_apply_resolution(us_capture_s *cap, uint width, uint height, float hz);
+static int _capture_streamon(us_capture_s *cap);
+static int _capture_streamoff(us_capture_s *cap);
+static int _capture_free_buffers(us_capture_s *cap);
+static int _capture_alloc_buffers(us_capture_s *cap, uint n_bufs, bool dma);
+static void _capture_release_buffers(us_capture_s *cap);
 
 static const char *_format_to_string_nullable(uint format);
 static const char *_format_to_string_supported(uint format);
@@ -265,12 +270,9 @@ int us_capture_open(us_capture_s *cap) {
 	}
 	us_controls_apply(cap->ctl, cap->run->fd);
 
-	enum v4l2_buf_type type = run->capture_type;
-	if (us_xioctl(run->fd, VIDIOC_STREAMON, &type) < 0) {
-		_LOG_PERROR("Can't start capturing");
+	if (_capture_streamon(cap) < 0) {
 		goto error;
 	}
-	run->streamon = true;
 
 	run->open_error_once = 0;
 	_LOG_INFO("Capturing started");
@@ -322,28 +324,7 @@ void us_capture_close(us_capture_s *cap) {
 
 	if (run->bufs != NULL) {
 		say = true;
-		_LOG_DEBUG("Releasing HW buffers ...");
-		for (uint i = 0; i < run->n_bufs; ++i) {
-			us_capture_hwbuf_s *hw = &run->bufs[i];
-
-			US_CLOSE_FD(hw->dma_fd);
-
-			if (cap->io_method == V4L2_MEMORY_MMAP) {
-				if (hw->raw.allocated > 0 && hw->raw.data != NULL) {
-					if (munmap(hw->raw.data, hw->raw.allocated) < 0) {
-						_LOG_PERROR("Can't unmap HW buffer=%u", i);
-					}
-				}
-			} else { // V4L2_MEMORY_USERPTR
-				US_DELETE(hw->raw.data, free);
-			}
-
-			if (run->capture_mplane) {
-				free(hw->buf.m.planes);
-			}
-		}
-		US_DELETE(run->bufs, free);
-		run->n_bufs = 0;
+		_capture_release_buffers(cap);
 	}
 
 	US_ARRAY_ITERATE(run->media_pads, 0, pad, { US_CLOSE_FD(pad->fd); });
@@ -355,6 +336,112 @@ void us_capture_close(us_capture_s *cap) {
 	}
 }
 
+int us_capture_renegotiate(us_capture_s *cap) {
+	// Быстрый путь для V4L2_EVENT_SOURCE_CHANGE: устройство остается открытым,
+	// а заново согласуются только формат и буферы. Все буферы должны быть уже
+	// возвращены драйверу. Если их число или формат поменялись, то вызывающему
+	// нужен полный перезапуск, поэтому это считается ошибкой.
+	us_capture_runtime_s *const run = cap->run;
+
+	US_A(run->streamon);
+	const uint n_bufs = run->n_bufs;
+	const uint format = run->format;
+	const bool dma = run->dma;
+
+	_LOG_INFO("Renegotiating the format without reopening the device ...");
+
+	if (_capture_streamoff(cap) < 0) {
+		return -1;
+	}
+	if (_capture_free_buffers(cap) < 0) {
+		return -1;
+	}
+
+	if (_capture_apply_resolution(cap, cap->width, cap->height, run->hz) < 0) {
+		return -1;
+	}
+	if (cap->dv_timings) {
+		const int retval = _capture_open_dv_timings(cap, true);
+		if (retval < 0) {
+			return retval;
+		}
+		if (us_str_is_ok(cap->media_path)) {
+			US_ARRAY_ITERATE(run->media_pads, 0, pad, {
+				if (pad->fd >= -1 && _capture_open_media_format(cap, pad) < 0) {
+					return -1;
+				}
+			});
+		}
+	}
+	if (_capture_open_format(cap, true) < 0) {
+		return -1;
+	}
+	if (run->format != format) {
+		_LOG_INFO("The format has been changed, the full restart is required");
+		return -1;
+	}
+	if (cap->dv_timings && cap->persistent && us_chip_tc358743_check_lanes(run->fd) == US_ERROR_NO_LANES) {
+		return US_ERROR_NO_LANES;
+	}
+	_capture_open_hw_fps(cap);
+	_capture_open_jpeg_quality(cap);
+	if (_capture_alloc_buffers(cap, n_bufs, dma) < 0) {
+		return -1;
+	}
+	if (_capture_streamon(cap) < 0) {
+		return -1;
+	}
+	_LOG_INFO("Capturing renegotiated: %ux%u", run->width, run->height);
+	return 0;
+}
+
+int us_capture_pause(us_capture_s *cap, bool release) {
+	// Устройство остается открытым, а формат согласованным, поэтому продолжить
+	// захват можно без долгого us_capture_open(). Как и для renegotiate,
+	// все буферы должны быть уже возвращены драйверу.
+	us_capture_runtime_s *const run = cap->run;
+
+	if (run->streamon) {
+		if (_capture_streamoff(cap) < 0) {
+			return -1;
+		}
+		_LOG_INFO("Capturing paused");
+	}
+	if (release && run->bufs != NULL) {
+		run->paused_n_bufs = run->n_bufs;
+		run->paused_dma = run->dma;
+		if (_capture_free_buffers(cap) < 0) {
+			return -1;
+		}
+		_LOG_INFO("Device buffers released");
+	}
+	return 0;
+}
+
+int us_capture_resume(us_capture_s *cap) {
+	us_capture_runtime_s *const run = cap->run;
+
+	US_A(!run->streamon);
+	if (run->bufs == NULL) {
+		if (_capture_alloc_buffers(cap, run->paused_n_bufs, run->paused_dma) < 0) {
+			return -1;
+		}
+	} else {
+		for (uint i = 0; i < run->n_bufs; ++i) {
+			US_A(!run->bufs[i].grabbed);
+		}
+		// STREAMOFF забирает у драйвера все буферы, их надо поставить в очередь заново
+		if (_capture_open_queue_buffers(cap) < 0) {
+			return -1;
+		}
+	}
+	if (_capture_streamon(cap) < 0) {
+		return -1;
+	}
+	_LOG_INFO("Capturing resumed");
+	return 0;
+}
+
 int us_capture_hwbuf_grab(us_capture_s *cap, us_capture_hwbuf_s **hw) {
 	// Это сложная функция, которая делает сразу много всего, чтобы получить новый фрейм.
 	//   - Вызывается _capture_wait_buffer() с select() внутри, чтобы подождать новый фрейм
@@ -364,8 +451,11 @@ int us_capture_hwbuf_grab(us_capture_s *cap, us_capture_hwbuf_s **hw) {
 	//   - Если таковых не нашлось, вернуть US_ERROR_NO_DATA.
 	//   - Ошибка -1 возвращается при любых сбоях.
 
-	if (_capture_wait_buffer(cap) < 0) {
-		return -1;
+	{
+		const int retval = _capture_wait_buffer(cap);
+		if (retval < 0) {
+			return retval;
+		}
 	}
 
 	us_capture_runtime_s *const run = cap->run;
@@ -545,11 +635,13 @@ int _capture_wait_buffer(us_capture_s *cap) {
 		_LOG_ERROR("Device select() timeout");
 		return -1;
 	} else {
-		if (has_error && _v4l2_consume_event(run->fd) < 0) {
-			return -1; // Restart required
+		// Restart required on errors, US_ERROR_SOURCE_CHANGED allows the fast one
+		int retval = 0;
+		if (has_error && (retval = _v4l2_consume_event(run->fd)) < 0) {
+			return retval;
 		}
-		if (has_dv_error && _v4l2_consume_event(run->dv_timings_fd) < 0) {
-			return -1; // Restart required
+		if (has_dv_error && (retval = _v4l2_consume_event(run->dv_timings_fd)) < 0) {
+			return retval;
 		}
 	}
 	return 0;
@@ -564,7 +656,7 @@ static int _v4l2_consume_event(int fd) {
 	switch (event.type) {
 		case V4L2_EVENT_SOURCE_CHANGE:
 			_LOG_INFO("Got V4L2_EVENT_SOURCE_CHANGE: Source changed");
-			return -1;
+			return US_ERROR_SOURCE_CHANGED;
 		case V4L2_EVENT_EOS:
 			_LOG_INFO("Got V4L2_EVENT_EOS: End of stream");
 			return -1;
@@ -1342,6 +1434,96 @@ static int _capture_apply_resolution(us_capture_s *cap, uint width, uint height,
 	return 0;
 }
 
+static int _capture_streamon(us_capture_s *cap) {
+	us_capture_runtime_s *const run = cap->run;
+	enum v4l2_buf_type type = run->capture_type;
+	if (us_xioctl(run->fd, VIDIOC_STREAMON, &type) < 0) {
+		_LOG_PERROR("Can't start capturing");
+		return -1;
+	}
+	run->streamon = true;
+	return 0;
+}
+
+static int _capture_streamoff(us_capture_s *cap) {
+	us_capture_runtime_s *const run = cap->run;
+	enum v4l2_buf_type type = run->capture_type;
+	if (us_xioctl(run->fd, VIDIOC_STREAMOFF, &type) < 0) {
+		_LOG_PERROR("Can't stop capturing");
+		return -1;
+	}
+	run->streamon = false;
+	return 0;
+}
+
+static int _capture_free_buffers(us_capture_s *cap) {
+	us_capture_runtime_s *const run = cap->run;
+
+	_capture_release_buffers(cap);
+	struct v4l2_requestbuffers req = {
+		.count = 0,
+		.type = run->capture_type,
+		.memory = cap->io_method,
+	};
+	_LOG_DEBUG("Freeing device buffers ...");
+	if (us_xioctl(run->fd, VIDIOC_REQBUFS, &req) < 0) {
+		_LOG_PERROR("Can't free device buffers");
+		return -1;
+	}
+	return 0;
+}
+
+static int _capture_alloc_buffers(us_capture_s *cap, uint n_bufs, bool dma) {
+	// Потоки стрима рассчитаны на прежнее число буферов, поэтому оно не должно меняться
+	us_capture_runtime_s *const run = cap->run;
+
+	if (_capture_open_io_method(cap) < 0) {
+		return -1;
+	}
+	if (run->n_bufs != n_bufs) {
+		_LOG_INFO("The number of buffers has been changed, the full restart is required");
+		return -1;
+	}
+	if (_capture_open_queue_buffers(cap) < 0) {
+		return -1;
+	}
+	if (dma) {
+		if (_capture_open_export_to_dma(cap) < 0) {
+			return -1;
+		}
+		run->dma = true;
+	}
+	return 0;
+}
+
+static void _capture_release_buffers(us_capture_s *cap) {
+	us_capture_runtime_s *const run = cap->run;
+
+	_LOG_DEBUG("Releasing HW buffers ...");
+	for (uint i = 0; i < run->n_bufs; ++i) {
+		us_capture_hwbuf_s *hw = &run->bufs[i];
+
+		US_CLOSE_FD(hw->dma_fd);
+
+		if (cap->io_method == V4L2_MEMORY_MMAP) {
+			if (hw->raw.allocated > 0 && hw->raw.data != NULL) {
+				if (munmap(hw->raw.data, hw->raw.allocated) < 0) {
+					_LOG_PERROR("Can't unmap HW buffer=%u", i);
+				}
+			}
+		} else { // V4L2_MEMORY_USERPTR
+			US_DELETE(hw->raw.data, free);
+		}
+
+		if (run->capture_mplane) {
+			free(hw->buf.m.planes);
+		}
+	}
+	US_DELETE(run->bufs, free);
+	run->n_bufs = 0;
+	run->dma = false;
+}
+
 static const char *_format_to_string_nullable(uint format) {
 	US_ARRAY_ITERATE(_FORMATS, 0, item, {
 		if (item->format == format) {
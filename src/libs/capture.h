@@ -70,6 +70,8 @@ typedef struct {
 	enum v4l2_buf_type	capture_type;
 	bool				capture_mplane;
 	bool				streamon;
+	uint				paused_n_bufs; // Restored by us_capture_resume() after the release
+	bool				paused_dma;
 	int					open_error_once;
 } us_capture_runtime_s;
 
@@ -107,6 +109,9 @@ int us_capture_parse_standard(const char *str);
 int us_capture_parse_io_method(const char *str);
 
 int us_capture_open(us_capture_s *cap);
+int us_capture_renegotiate(us_capture_s *cap);
+int us_capture_pause(us_capture_s *cap, bool release);
+int us_capture_resume(us_capture_s *cap);
 void us_capture_close(us_capture_s *cap);
 
 int us_capture_hwbuf_grab(us_capture_s *cap, us_capture_hwbuf_s **hw);
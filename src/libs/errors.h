@@ -29,3 +29,4 @@
 #define US_ERROR_NO_SYNC	-5
 #define US_ERROR_NO_LANES	-6
 #define US_ERROR_NO_DATA	-7
+#define US_ERROR_SOURCE_CHANGED	-8
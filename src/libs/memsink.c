@@ -145,6 +145,10 @@ bool us_memsink_server_check(us_memsink_s *sink, const us_frame_s *frame) {
 	// Проверяем, есть ли у нас живой клиент по таймауту
 	const bool has_clients = (sink->mem->last_client_ts + sink->client_ttl > us_get_now_monotonic());
 	atomic_store(&sink->has_clients, has_clients);
+	if (!has_clients) {
+		// Пожелания ушедших клиентов не должны достаться следующим
+		memset(&sink->mem->wants, 0, sizeof(us_memsink_wants_s));
+	}
 
 	if (flock(sink->fd, LOCK_UN) < 0) {
 		US_LOG_PERROR("%s-sink: Can't unlock memory", sink->name);
@@ -27,7 +27,7 @@
 
 
 #define US_MEMSINK_MAGIC	((u64)0xCAFEBABECAFEBABE)
-#define US_MEMSINK_VERSION	((u32)10)
+#define US_MEMSINK_VERSION	((u32)11)
 
 
 typedef struct {
@@ -35,6 +35,7 @@ typedef struct {
 	uint	height;
 	uint	format;
 	uint	fps;
+	uint	bitrate; // Kbps, 0 - no wishes
 	bool	key;
 } us_memsink_wants_s;
 
@@ -0,0 +1,63 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "pacer.h"
+
+#include "types.h"
+#include "tools.h"
+
+
+bool us_pacer_check(us_pacer_s *pacer, uint fps, ldf ts) {
+	// Token bucket по времени захвата: каждый пропущенный кадр сдвигает
+	// расписание ровно на интервал, поэтому средняя частота получается точной
+	// для любого fps, а не только для целых делителей частоты захвата.
+
+	if (pacer->last_ts > 0 && ts > pacer->last_ts) {
+		const ldf delta = ts - pacer->last_ts;
+		pacer->period = (pacer->period > 0 ? pacer->period * 0.9 + delta * 0.1 : delta);
+	}
+	pacer->last_ts = ts;
+
+	if (fps == 0) {
+		pacer->next_ts = 0;
+		return true;
+	}
+
+	const ldf interval = (ldf)1 / fps;
+	if (
+		pacer->next_ts <= 0
+		|| ts >= pacer->next_ts + interval // Отстали больше чем на кадр: источник медленнее или был простой
+		|| ts + interval < pacer->next_ts // Время пошло назад, например после перезапуска захвата
+	) {
+		pacer->next_ts = ts + interval;
+		return true;
+	}
+
+	// Берем кадр, ближайший к сроку, а не первый после него, иначе джиттер
+	// захвата будет периодически сдвигать выборку на лишний кадр.
+	const ldf tolerance = (pacer->period > 0 ? US_MIN(pacer->period, interval) : interval) / 2;
+	if (ts >= pacer->next_ts - tolerance) {
+		pacer->next_ts += interval;
+		return true;
+	}
+	return false;
+}
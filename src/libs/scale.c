@@ -0,0 +1,209 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "scale.h"
+
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#include "types.h"
+#include "tools.h"
+#include "frame.h"
+#include "unjpeg.h"
+
+
+static bool _read_line_yuv444(const us_frame_s *src, uint y, u8 *line);
+
+
+int us_scale_yuv420(const us_frame_s *src, us_frame_s *dest, uint scale) {
+	// Уменьшение в целое число раз в I420 для энкодеров H264.
+	// JPEG масштабируется прямо в IDCT, остальное усредняется по площади.
+	US_A(scale == 1 || scale == 2 || scale == 4 || scale == 8);
+
+	if (us_is_jpeg(src->format)) {
+		return us_unjpeg_yuv420_scaled(src, dest, scale);
+	}
+
+	// Энкодеры H264 не принимают нечетных размеров, так что край просто обрезаем
+	const uint width = (src->width / scale) & ~1u;
+	const uint height = (src->height / scale) & ~1u;
+	if (width == 0 || height == 0) {
+		return -1;
+	}
+
+	const uz y_size = (uz)width * height;
+	const uz uv_size = y_size / 4;
+	us_frame_realloc_data(dest, y_size + uv_size * 2);
+	US_FRAME_COPY_META(src, dest);
+	dest->format = V4L2_PIX_FMT_YUV420;
+	dest->width = width;
+	dest->height = height;
+	dest->stride = width;
+	dest->used = y_size + uv_size * 2;
+
+	u8 *line;
+	US_CALLOC(line, (uz)src->width * 3);
+	uint *y_sums;
+	US_CALLOC(y_sums, width);
+	uint *uv_sums;
+	US_CALLOC(uv_sums, width); // Половина для U, половина для V
+
+	u8 *const y_plane = dest->data;
+	u8 *const u_plane = y_plane + y_size;
+	u8 *const v_plane = u_plane + uv_size;
+	const uint y_area = scale * scale;
+	const uint uv_area = y_area * 4;
+	const uint uv_width = width / 2;
+
+	int retval = 0;
+	for (uint out_y = 0; out_y < height; ++out_y) {
+		if (out_y % 2 == 0) {
+			memset(uv_sums, 0, sizeof(uint) * width);
+		}
+		memset(y_sums, 0, sizeof(uint) * width);
+
+		for (uint dy = 0; dy < scale; ++dy) {
+			if (!_read_line_yuv444(src, out_y * scale + dy, line)) {
+				retval = -1;
+				goto done;
+			}
+			for (uint out_x = 0; out_x < width; ++out_x) {
+				const u8 *px = line + (uz)out_x * scale * 3;
+				for (uint dx = 0; dx < scale; ++dx, px += 3) {
+					y_sums[out_x] += px[0];
+					uv_sums[out_x / 2] += px[1];
+					uv_sums[uv_width + out_x / 2] += px[2];
+				}
+			}
+		}
+
+		u8 *const y_out = y_plane + (uz)out_y * width;
+		for (uint out_x = 0; out_x < width; ++out_x) {
+			y_out[out_x] = y_sums[out_x] / y_area;
+		}
+		if (out_y % 2 == 1) {
+			u8 *const u_out = u_plane + (uz)(out_y / 2) * uv_width;
+			u8 *const v_out = v_plane + (uz)(out_y / 2) * uv_width;
+			for (uint x = 0; x < uv_width; ++x) {
+				u_out[x] = uv_sums[x] / uv_area;
+				v_out[x] = uv_sums[uv_width + x] / uv_area;
+			}
+		}
+	}
+
+done:
+	free(uv_sums);
+	free(y_sums);
+	free(line);
+	return retval;
+}
+
+static bool _read_line_yuv444(const us_frame_s *src, uint y, u8 *line) {
+	// Разворачивает строку в Y, U, V на каждый пиксель
+#	define PUT_RGB(x_r, x_g, x_b) { \
+			const int m_r = (x_r); \
+			const int m_g = (x_g); \
+			const int m_b = (x_b); \
+			/* BT.601 limited range, как у libjpeg при сжатии в YCbCr */ \
+			line[x * 3] = ((66 * m_r + 129 * m_g + 25 * m_b + 128) >> 8) + 16; \
+			line[x * 3 + 1] = ((-38 * m_r - 74 * m_g + 112 * m_b + 128) >> 8) + 128; \
+			line[x * 3 + 2] = ((112 * m_r - 94 * m_g - 18 * m_b + 128) >> 8) + 128; \
+		}
+
+	const uint stride = src->stride;
+	const u8 *const data = src->data + (uz)y * stride;
+
+	switch (src->format) {
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY: {
+			uint y_off = 0;
+			uint u_off = 1;
+			uint v_off = 3;
+			if (src->format == V4L2_PIX_FMT_YVYU) {
+				u_off = 3;
+				v_off = 1;
+			} else if (src->format == V4L2_PIX_FMT_UYVY) {
+				y_off = 1;
+				u_off = 0;
+				v_off = 2;
+			}
+			for (uint x = 0; x < src->width; ++x) {
+				const u8 *const pair = data + (x >> 1) * 4;
+				line[x * 3] = pair[y_off + (x & 1) * 2];
+				line[x * 3 + 1] = pair[u_off];
+				line[x * 3 + 2] = pair[v_off];
+			}
+			break;
+		}
+
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YVU420: {
+			const uz luma_size = (uz)stride * src->height;
+			const uz chroma_size = (uz)(stride >> 1) * (src->height >> 1);
+			const u8 *chroma1 = src->data + luma_size + (uz)(y >> 1) * (stride >> 1);
+			const u8 *chroma2 = chroma1 + chroma_size;
+			if (src->format == V4L2_PIX_FMT_YVU420) {
+				const u8 *const tmp = chroma1;
+				chroma1 = chroma2;
+				chroma2 = tmp;
+			}
+			for (uint x = 0; x < src->width; ++x) {
+				line[x * 3] = data[x];
+				line[x * 3 + 1] = chroma1[x >> 1];
+				line[x * 3 + 2] = chroma2[x >> 1];
+			}
+			break;
+		}
+
+		case V4L2_PIX_FMT_GREY:
+			for (uint x = 0; x < src->width; ++x) {
+				line[x * 3] = data[x];
+				line[x * 3 + 1] = line[x * 3 + 2] = 128;
+			}
+			break;
+
+		case V4L2_PIX_FMT_RGB565:
+			for (uint x = 0; x < src->width; ++x) {
+				const uint pix = data[x * 2] | (data[x * 2 + 1] << 8);
+				PUT_RGB(((pix >> 11) & 0x1F) << 3, ((pix >> 5) & 0x3F) << 2, (pix & 0x1F) << 3);
+			}
+			break;
+
+		case V4L2_PIX_FMT_RGB24:
+			for (uint x = 0; x < src->width; ++x) {
+				PUT_RGB(data[x * 3], data[x * 3 + 1], data[x * 3 + 2]);
+			}
+			break;
+
+		case V4L2_PIX_FMT_BGR24:
+			for (uint x = 0; x < src->width; ++x) {
+				PUT_RGB(data[x * 3 + 2], data[x * 3 + 1], data[x * 3]);
+			}
+			break;
+
+		default: return false;
+	}
+#	undef PUT_RGB
+	return true;
+}
@@ -23,6 +23,7 @@
 #include "unjpeg.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <setjmp.h>
 
 #include <jpeglib.h>
@@ -41,11 +42,20 @@ typedef struct {
 } _jpeg_error_manager_s;
 
 
+static void _jpeg_read_raw_yuv420(struct jpeg_decompress_struct *jpeg, us_frame_s *dest);
+static void _jpeg_read_scanlines_yuv420(struct jpeg_decompress_struct *jpeg, us_frame_s *dest);
+static bool _jpeg_is_raw_yuv420_compatible(const struct jpeg_decompress_struct *jpeg);
+
 static void _jpeg_error_handler(j_common_ptr jpeg);
 
 
 int us_unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode) {
+	return us_unjpeg_scaled(src, dest, decode, 1);
+}
+
+int us_unjpeg_scaled(const us_frame_s *src, us_frame_s *dest, bool decode, uint scale) {
 	US_A(us_is_jpeg(src->format));
+	US_A(scale == 1 || scale == 2 || scale == 4 || scale == 8);
 
 	volatile int retval = 0;
 
@@ -65,6 +75,14 @@ int us_unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode) {
 	jpeg_mem_src(&jpeg, src->data, src->used);
 	jpeg_read_header(&jpeg, TRUE);
 	jpeg.out_color_space = JCS_RGB;
+	if (scale > 1) {
+		// Масштабирование в DCT: для 1/8 от каждого блока берется только DC-коэффициент,
+		// так что такое декодирование стоит малую долю полного.
+		jpeg.scale_num = 1;
+		jpeg.scale_denom = scale;
+		jpeg.dct_method = JDCT_IFAST;
+		jpeg.do_fancy_upsampling = FALSE;
+	}
 
 	jpeg_start_decompress(&jpeg);
 
@@ -93,6 +111,213 @@ done:
 	return retval;
 }
 
+int us_unjpeg_yuv420(const us_frame_s *src, us_frame_s *dest) {
+	return us_unjpeg_yuv420_scaled(src, dest, 1);
+}
+
+int us_unjpeg_yuv420_scaled(const us_frame_s *src, us_frame_s *dest, uint scale) {
+	US_A(us_is_jpeg(src->format));
+	US_A(scale == 1 || scale == 2 || scale == 4 || scale == 8);
+
+	volatile int retval = 0;
+
+	struct jpeg_decompress_struct jpeg;
+	jpeg_create_decompress(&jpeg);
+
+	_jpeg_error_manager_s jpeg_error;
+	jpeg.err = jpeg_std_error((struct jpeg_error_mgr*)&jpeg_error);
+	jpeg_error.mgr.error_exit = _jpeg_error_handler;
+	jpeg_error.frame = src;
+	if (setjmp(jpeg_error.jmp) < 0) {
+		retval = -1;
+		goto done;
+	}
+
+	jpeg_mem_src(&jpeg, src->data, src->used);
+	jpeg_read_header(&jpeg, TRUE);
+
+	// Для типичных 4:2:0 и 4:2:2 забираем плоскости прямо из IDCT без цветовой
+	// конверсии и апсемплинга, иначе просим у libjpeg YCbCr построчно.
+	// Уменьшенный кадр всегда читается построчно: у масштабированного IDCT
+	// другой размер блока, а _jpeg_read_raw_yuv420() рассчитан на DCTSIZE.
+	const bool raw = (scale == 1 && _jpeg_is_raw_yuv420_compatible(&jpeg));
+	if (scale > 1) {
+		jpeg.scale_num = 1;
+		jpeg.scale_denom = scale;
+		jpeg.dct_method = JDCT_IFAST;
+		jpeg.do_fancy_upsampling = FALSE;
+	}
+	if (raw) {
+		jpeg.raw_data_out = TRUE;
+		jpeg.do_fancy_upsampling = FALSE;
+	} else if (jpeg.jpeg_color_space != JCS_GRAYSCALE) {
+		jpeg.out_color_space = JCS_YCbCr;
+	}
+
+	jpeg_start_decompress(&jpeg);
+
+	US_FRAME_COPY_META(src, dest); // cppcheck-suppress redundantAssignment
+	dest->format = V4L2_PIX_FMT_YUV420; // cppcheck-suppress redundantAssignment
+	dest->width = jpeg.output_width; // cppcheck-suppress redundantAssignment
+	dest->height = jpeg.output_height; // cppcheck-suppress redundantAssignment
+	dest->stride = jpeg.output_width; // cppcheck-suppress redundantAssignment
+	dest->used = 0; // cppcheck-suppress redundantAssignment
+
+	const uz y_size = (uz)dest->width * dest->height;
+	const uz uv_size = (uz)((dest->width + 1) / 2) * ((dest->height + 1) / 2);
+	us_frame_realloc_data(dest, y_size + uv_size * 2);
+
+	if (raw) {
+		_jpeg_read_raw_yuv420(&jpeg, dest);
+	} else {
+		_jpeg_read_scanlines_yuv420(&jpeg, dest);
+	}
+	dest->used = y_size + uv_size * 2;
+
+	jpeg_finish_decompress(&jpeg);
+
+done:
+	jpeg_destroy_decompress(&jpeg);
+	return retval;
+}
+
+static void _jpeg_read_raw_yuv420(struct jpeg_decompress_struct *jpeg, us_frame_s *dest) {
+	const uint width = dest->width;
+	const uint height = dest->height;
+	const uint uv_width = (width + 1) / 2;
+	const uint uv_height = (height + 1) / 2;
+
+	u8 *const y_plane = dest->data;
+	u8 *const uv_planes[2] = {
+		y_plane + (uz)width * height,
+		y_plane + (uz)width * height + (uz)uv_width * uv_height,
+	};
+
+	const uint mcu_rows = jpeg->max_v_samp_factor * DCTSIZE; // Luma rows per iMCU row
+	const jpeg_component_info *const comps = jpeg->comp_info;
+
+	JSAMPARRAY planes[3];
+	JSAMPARRAY planes_ptrs[3];
+	for (int ci = 0; ci < jpeg->num_components; ++ci) {
+		planes[ci] = (*jpeg->mem->alloc_sarray)(
+			(j_common_ptr)jpeg, JPOOL_IMAGE,
+			comps[ci].width_in_blocks * DCTSIZE,
+			comps[ci].v_samp_factor * DCTSIZE);
+		planes_ptrs[ci] = planes[ci];
+	}
+
+	while (jpeg->output_scanline < height) {
+		const uint y_base = jpeg->output_scanline;
+		if (jpeg_read_raw_data(jpeg, planes_ptrs, mcu_rows) == 0) {
+			break;
+		}
+
+		for (uint row = 0; row < mcu_rows && y_base + row < height; ++row) {
+			memcpy(y_plane + (uz)(y_base + row) * width, planes[0][row], width);
+		}
+
+		const uint uv_base = y_base / 2;
+		const uint uv_rows = mcu_rows / 2;
+		for (uint ci = 1; ci < 3; ++ci) {
+			// Шаг по исходной плоскости: 1 для 4:2:0, 2 для полного разрешения (усредняем)
+			const uint step_x = 2 * comps[ci].h_samp_factor / jpeg->max_h_samp_factor;
+			const uint step_y = 2 * comps[ci].v_samp_factor / jpeg->max_v_samp_factor;
+			for (uint row = 0; row < uv_rows && uv_base + row < uv_height; ++row) {
+				u8 *const out = uv_planes[ci - 1] + (uz)(uv_base + row) * uv_width;
+				const u8 *const in0 = planes[ci][row * step_y];
+				const u8 *const in1 = planes[ci][row * step_y + step_y - 1];
+				if (step_x == 1 && step_y == 1) {
+					memcpy(out, in0, uv_width);
+				} else {
+					for (uint x = 0; x < uv_width; ++x) {
+						const uint x0 = x * step_x;
+						const uint x1 = x0 + step_x - 1;
+						out[x] = (in0[x0] + in0[x1] + in1[x0] + in1[x1] + 2) >> 2;
+					}
+				}
+			}
+		}
+	}
+}
+
+static void _jpeg_read_scanlines_yuv420(struct jpeg_decompress_struct *jpeg, us_frame_s *dest) {
+	const uint width = dest->width;
+	const uint height = dest->height;
+	const uint uv_width = (width + 1) / 2;
+	const uint uv_height = (height + 1) / 2;
+
+	u8 *const y_plane = dest->data;
+	u8 *const u_plane = y_plane + (uz)width * height;
+	u8 *const v_plane = u_plane + (uz)uv_width * uv_height;
+
+	const uint comps = jpeg->output_components;
+	JSAMPARRAY scanlines = (*jpeg->mem->alloc_sarray)((j_common_ptr)jpeg, JPOOL_IMAGE, width * comps, 2);
+
+	if (comps == 1) { // Grayscale
+		memset(u_plane, 128, (uz)uv_width * uv_height * 2);
+	}
+
+	while (jpeg->output_scanline < height) {
+		const uint y = jpeg->output_scanline;
+		uint n_lines = 0;
+		while (n_lines < 2 && jpeg->output_scanline < height) {
+			if (jpeg_read_scanlines(jpeg, scanlines + n_lines, 1) == 0) {
+				break;
+			}
+			++n_lines;
+		}
+		if (n_lines == 0) {
+			break;
+		}
+		const u8 *const line0 = scanlines[0];
+		const u8 *const line1 = scanlines[n_lines - 1];
+
+		for (uint index = 0; index < n_lines; ++index) {
+			u8 *const out = y_plane + (uz)(y + index) * width;
+			for (uint x = 0; x < width; ++x) {
+				out[x] = scanlines[index][x * comps];
+			}
+		}
+		if (comps == 1) {
+			continue;
+		}
+
+		u8 *const u_out = u_plane + (uz)(y / 2) * uv_width;
+		u8 *const v_out = v_plane + (uz)(y / 2) * uv_width;
+		for (uint x = 0; x < uv_width; ++x) {
+			const uint x0 = x * 2 * 3;
+			const uint x1 = US_MIN(x * 2 + 1, width - 1) * 3;
+			u_out[x] = (line0[x0 + 1] + line0[x1 + 1] + line1[x0 + 1] + line1[x1 + 1] + 2) >> 2;
+			v_out[x] = (line0[x0 + 2] + line0[x1 + 2] + line1[x0 + 2] + line1[x1 + 2] + 2) >> 2;
+		}
+	}
+}
+
+static bool _jpeg_is_raw_yuv420_compatible(const struct jpeg_decompress_struct *jpeg) {
+	if (jpeg->jpeg_color_space != JCS_YCbCr || jpeg->num_components != 3) {
+		return false;
+	}
+	const jpeg_component_info *const comps = jpeg->comp_info;
+	if (
+		comps[0].h_samp_factor != jpeg->max_h_samp_factor
+		|| comps[0].v_samp_factor != jpeg->max_v_samp_factor
+	) {
+		return false;
+	}
+	for (uint ci = 1; ci < 3; ++ci) {
+		// Хрома должна быть той же или половинной относительно яркости
+		const int h = comps[ci].h_samp_factor * 2;
+		const int v = comps[ci].v_samp_factor * 2;
+		if (
+			(h != jpeg->max_h_samp_factor && h != jpeg->max_h_samp_factor * 2)
+			|| (v != jpeg->max_v_samp_factor && v != jpeg->max_v_samp_factor * 2)
+		) {
+			return false;
+		}
+	}
+	return true;
+}
+
 static void _jpeg_error_handler(j_common_ptr jpeg) {
 	_jpeg_error_manager_s *jpeg_error = (_jpeg_error_manager_s*)jpeg->err;
 	char msg[JMSG_LENGTH_MAX];
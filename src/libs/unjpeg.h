@@ -27,3 +27,6 @@
 
 
 int us_unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode);
+int us_unjpeg_scaled(const us_frame_s *src, us_frame_s *dest, bool decode, uint scale);
+int us_unjpeg_yuv420(const us_frame_s *src, us_frame_s *dest);
+int us_unjpeg_yuv420_scaled(const us_frame_s *src, us_frame_s *dest, uint scale);
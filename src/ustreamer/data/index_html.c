@@ -41,9 +41,44 @@ const char *const US_HTML_INDEX_PAGE = " \
 				Get JSON structure with the state of the server. \
 			</li> \
 			<br> \
+			<li> \
+				<a href=\"state/events\"><b>/state/events</b></a><br> \
+				Subscribe to the state using Server-Sent Events instead of polling <a href=\"state\">/state</a>.<br> \
+				The first event <i>state</i> contains the full state, then the <i>delta</i> events contain only changed<br> \
+				resolution, online status, encoder, number of clients and FPS (if it changed by 10% or more).<br> \
+				The <i>client</i> events are sent when the stream clients join or leave. \
+			</li> \
+			<br> \
 			<li> \
 				<a href=\"snapshot\"><b>/snapshot</b></a><br> \
-				Get a current actual image from the server. \
+				Get a current actual image from the server. Query params:<br> \
+				<br> \
+				<ul> \
+					<li> \
+						<b>max_age=5</b><br> \
+						Return the last exposed image immediately if it was captured no more than N seconds ago<br> \
+						instead of waiting for a new one. The reply has an <i>ETag</i>, so a request<br> \
+						with a matching <i>If-None-Match</i> gets <i>304 Not Modified</i> without a body. \
+					</li> \
+					<br> \
+					<li> \
+						<b>quality=95</b><br> \
+						Encode the image from the raw captured frame with this JPEG quality, regardless of the stream quality.<br> \
+						It is done by a low-priority background worker and the results are cached, so repeated requests<br> \
+						with <i>max_age</i> are served without encoding. \
+					</li> \
+					<br> \
+					<li> \
+						<b>width=320</b><br> \
+						Same as <i>quality</i>, but downscale the image to this width keeping the aspect ratio. \
+					</li> \
+					<br> \
+					<li> \
+						<b>thumb=4</b><br> \
+						Return the current image downscaled by 2, 4 or 8 times. The thumbnail is decoded<br> \
+						from the already encoded JPEG at the reduced scale, which is much cheaper than a full decoding. \
+					</li> \
+				</ul> \
 			</li> \
 			<br> \
 			<li> \
@@ -80,6 +115,51 @@ const char *const US_HTML_INDEX_PAGE = " \
 						<b>zero_data=1</b><br> \
 						Disables the actual sending of JPEG data and leaves only response headers. \
 					</li> \
+					<br> \
+					<li> \
+						<b>thumb=4</b><br> \
+						Stream thumbnails downscaled by 2, 4 or 8 times (like with the <a href=\"snapshot\">/snapshot</a>).<br> \
+						Each thumbnail is made once per frame and shared by all clients with the same scale. \
+					</li> \
+					<br> \
+					<li> \
+						<b>fps=2</b><br> \
+						Limit the frame rate for this client. Extra frames are skipped. \
+					</li> \
+					<br> \
+					<li> \
+						<b>maxrate=1000</b><br> \
+						Limit the bandwidth for this client in Kbps. Frames that don't fit into the limit are skipped.<br> \
+						The limits and the achieved rate are shown in <a href=\"state\">/state</a>. \
+					</li> \
+					<br> \
+					<li> \
+						<b>notsent_lowat=16384</b><br> \
+						Override <i>--tcp-notsent-lowat</i> for this client, 0 to disable. \
+					</li> \
+				</ul> \
+			</li> \
+			<br> \
+			<li> \
+				<b>/ws</b><br> \
+				Get a live stream over WebSocket. Each JPEG is sent as a single binary message<br> \
+				prefixed with a little-endian metadata header: <i>u8 version</i>, <i>u8 flags</i> (bit 0 is online),<br> \
+				<i>u16 header size</i>, <i>u16 width</i>, <i>u16 height</i>, <i>u32 seq</i>, <i>u32 skipped</i> \
+				and <i>f64 latency</i> in seconds.<br> \
+				The client should acknowledge each frame by sending its <i>seq</i> as a text message.<br> \
+				A new frame is sent only while the number of unacknowledged frames is below the window,<br> \
+				so the latency doesn't grow on slow links. Query params:<br> \
+				<br> \
+				<ul> \
+					<li> \
+						<b>window=2</b><br> \
+						The number of frames that can be sent without acknowledgement (1...8). \
+					</li> \
+					<br> \
+					<li> \
+						<b>thumb=4</b><br> \
+						Same as for the <a href=\"stream\">/stream</a>. \
+					</li> \
 				</ul> \
 			</li> \
 			<br> \
@@ -39,7 +39,6 @@
 #include "m2m.h"
 
 #include "encoders/cpu/encoder.h"
-#include "encoders/hw/encoder.h"
 
 
 static const struct {
@@ -58,7 +57,7 @@ static const struct {
 
 
 static void *_worker_job_init(void *v_enc);
-static void _worker_job_destroy(void *v_job);
+static void _worker_job_destroy(void *v_job, bool shrinking);
 static bool _worker_run_job(us_worker_s *wr);
 
 
@@ -73,6 +72,7 @@ us_encoder_s *us_encoder_init(void) {
 	US_CALLOC(enc, 1);
 	enc->type = run->type;
 	enc->n_workers = us_get_cores_available();
+	enc->aq_min_quality = 30;
 	enc->run = run;
 	return enc;
 }
@@ -117,6 +117,11 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap) {
 	us_encoder_type_e type = enc->type;
 	uint quality = cap->jpeg_quality;
 	uint n_workers = US_MIN(enc->n_workers, cr->n_bufs);
+	uint n_min_workers = (enc->n_min_workers > 0 ? enc->n_min_workers : n_workers);
+	if (enc->group != NULL && enc->n_min_workers == 0) {
+		// Пулы нескольких устройств делят общий лимит, поэтому растут по мере надобности
+		n_min_workers = 1;
+	}
 
 	if (us_is_jpeg(cr->format) && type != US_ENCODER_TYPE_HW) {
 		US_LOG_INFO("Switching to HW encoder: the input is (M)JPEG ...");
@@ -126,7 +131,6 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap) {
 	if (type == US_ENCODER_TYPE_HW) {
 		if (us_is_jpeg(cr->format)) {
 			quality = cr->jpeg_quality;
-			n_workers = 1;
 		} else {
 			US_LOG_INFO("Switching to CPU encoder: the input format is not (M)JPEG ...");
 			type = US_ENCODER_TYPE_CPU;
@@ -137,18 +141,13 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap) {
 		US_LOG_DEBUG("Preparing M2M-%s encoder ...",
 			(type == US_ENCODER_TYPE_M2M_VIDEO ? "VIDEO" : "IMAGE"));
 
-		if (run->m2ms == NULL) {
-			US_CALLOC(run->m2ms, n_workers);
-		}
-
-		for (; run->n_m2ms < n_workers; ++run->n_m2ms) {
-			// Начинаем с нуля и доинициализируем на следующих заходах при необходимости
-			char name[32];
-			US_SNPRINTF(name, 31, "JPEG-%u", run->n_m2ms);
-			if (type == US_ENCODER_TYPE_M2M_VIDEO) {
-				run->m2ms[run->n_m2ms] = us_m2m_mjpeg_encoder_init(name, enc->m2m_path, quality);
-			} else {
-				run->m2ms[run->n_m2ms] = us_m2m_jpeg_encoder_init(name, enc->m2m_path, quality);
+		// Контексты живут дольше пула, чтобы перезапуск стрима не закрывал устройство.
+		// Воркер создает контекст по своему номеру при первой работе, а остановленный
+		// автоскейлом воркер его освобождает, чтобы не держать буферы M2M.
+		if (run->n_m2ms < n_workers) {
+			US_REALLOC(run->m2ms, n_workers);
+			for (; run->n_m2ms < n_workers; ++run->n_m2ms) {
+				run->m2ms[run->n_m2ms] = NULL;
 			}
 		}
 	}
@@ -159,15 +158,38 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap) {
 		US_LOG_INFO("Using JPEG quality: %u%%", quality);
 	}
 
+	const bool adaptive = (enc->aq_kbps > 0 || enc->aq_fps > 0);
+	if (adaptive) {
+		if (type == US_ENCODER_TYPE_CPU) {
+			US_LOG_INFO("Using adaptive JPEG quality: %u%%...%u%%",
+				US_MIN(enc->aq_min_quality, quality), quality);
+		} else {
+			US_LOG_INFO("Adaptive JPEG quality is available only for CPU encoder");
+		}
+	}
+
 	US_MUTEX_LOCK(run->mutex);
 	run->type = type;
 	run->quality = quality;
 	US_MUTEX_UNLOCK(run->mutex);
 
+	run->aq_enabled = (adaptive && type == US_ENCODER_TYPE_CPU);
+	run->aq_max_quality = quality;
+	run->aq_size = 0;
+	run->aq_time = 0;
+	run->aq_interval = 0;
+	run->aq_last_ts = 0;
+
+	if (type == US_ENCODER_TYPE_HW) {
+		// Кадр копируется в кольцо прямо из потока JPEG, воркерам там делать нечего
+		return;
+	}
 	enc->run->pool = us_workers_pool_init(
 		"JPEG",
 		"jw",
 		n_workers,
+		n_min_workers,
+		enc->group,
 		_worker_job_init,
 		(void*)enc,
 		_worker_job_destroy,
@@ -175,8 +197,7 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap) {
 }
 
 void us_encoder_close(us_encoder_s *enc) {
-	US_A(enc->run->pool != NULL);
-	US_DELETE(enc->run->pool, us_workers_pool_destroy);
+	US_DELETE(enc->run->pool, us_workers_pool_destroy); // NULL for passthrough
 }
 
 void us_encoder_get_runtime_params(us_encoder_s *enc, us_encoder_type_e *type, uint *quality) {
@@ -187,16 +208,83 @@ void us_encoder_get_runtime_params(us_encoder_s *enc, us_encoder_type_e *type, u
 	US_MUTEX_UNLOCK(run->mutex);
 }
 
+void us_encoder_adapt_quality(us_encoder_s *enc, const us_frame_s *frame, uz backlog) {
+	us_encoder_runtime_s *const run = enc->run;
+
+	if (!run->aq_enabled || frame->used == 0) {
+		return;
+	}
+
+#	define UPDATE_AVG(x_avg, x_value) { \
+			x_avg = (x_avg == 0 ? (ldf)(x_value) : x_avg * 0.8 + (ldf)(x_value) * 0.2); \
+		}
+	if (run->aq_last_ts > 0 && frame->encode_end_ts > run->aq_last_ts) {
+		UPDATE_AVG(run->aq_interval, frame->encode_end_ts - run->aq_last_ts);
+	}
+	run->aq_last_ts = frame->encode_end_ts;
+	UPDATE_AVG(run->aq_size, frame->used);
+	UPDATE_AVG(run->aq_time, frame->encode_end_ts - frame->encode_begin_ts);
+#	undef UPDATE_AVG
+
+	// Качество снижаем быстрее, чем повышаем, чтобы не раскачивать поток
+	int delta = 1;
+
+	if (backlog > run->aq_size * 2) {
+		// Клиенты не успевают забирать то, что уже отправлено
+		delta = -2;
+	}
+
+	if (enc->aq_kbps > 0 && run->aq_interval > 0) {
+		const ldf kbps = run->aq_size * 8 / run->aq_interval / 1000;
+		if (kbps > enc->aq_kbps * 1.05) {
+			delta = -2;
+		} else if (kbps > enc->aq_kbps * 0.9) {
+			delta = US_MIN(delta, 0);
+		}
+	}
+
+	if (enc->aq_fps > 0) {
+		// Пул из N воркеров выдает не больше N/T кадров в секунду.
+		// Считаем по активным: автоскейл мог сократить пул. Он работает в том же потоке.
+		const ldf budget = (ldf)run->pool->n_active_workers / enc->aq_fps;
+		if (run->aq_time > budget) {
+			delta = -2;
+		} else if (run->aq_time > budget * 0.85) {
+			delta = US_MIN(delta, 0);
+		}
+	}
+
+	if (delta == 0) {
+		return;
+	}
+
+	US_MUTEX_LOCK(run->mutex);
+	const uint min_quality = US_MIN(enc->aq_min_quality, run->aq_max_quality);
+	const int quality = US_MAX(US_MIN((int)run->quality + delta, (int)run->aq_max_quality), (int)min_quality);
+	const bool changed = (run->quality != (uint)quality);
+	run->quality = quality;
+	US_MUTEX_UNLOCK(run->mutex);
+
+	if (changed) {
+		US_LOG_VERBOSE("JPEG: Adapted quality: %d%%; size=%.0Lf, time=%.3Lf, interval=%.3Lf, backlog=%zu",
+			quality, run->aq_size, run->aq_time, run->aq_interval, backlog);
+	}
+}
+
 static void *_worker_job_init(void *v_enc) {
 	us_encoder_job_s *job;
 	US_CALLOC(job, 1);
 	job->enc = (us_encoder_s*)v_enc;
 	job->dest = us_frame_init();
+	job->m2m_number = -1;
 	return (void*)job;
 }
 
-static void _worker_job_destroy(void *v_job) {
+static void _worker_job_destroy(void *v_job, bool shrinking) {
 	us_encoder_job_s *job = v_job;
+	if (shrinking && job->m2m_number >= 0) {
+		US_DELETE(job->enc->run->m2ms[job->m2m_number], us_m2m_encoder_destroy);
+	}
 	us_frame_destroy(job->dest);
 	free(job);
 }
@@ -209,18 +297,31 @@ static bool _worker_run_job(us_worker_s *wr) {
 	const uint i = job->hw->buf.index;
 
 	if (run->type == US_ENCODER_TYPE_CPU) {
-		US_LOG_VERBOSE("Compressing JPEG using CPU: worker=%s, buffer=%u", wr->name, i);
-		us_cpu_encoder_compress(src, dest, run->quality);
-
-	} else if (run->type == US_ENCODER_TYPE_HW) {
-		US_LOG_VERBOSE("Compressing JPEG using HW (just copying): worker=%s, buffer=%u", wr->name, i);
-		us_hw_encoder_compress(src, dest);
+		US_MUTEX_LOCK(run->mutex);
+		const uint quality = run->quality; // May be adapted on the fly
+		US_MUTEX_UNLOCK(run->mutex);
+		US_LOG_VERBOSE("Compressing JPEG using CPU: worker=%s, buffer=%u, quality=%u", wr->name, i, quality);
+		us_cpu_encoder_compress(src, dest, quality);
 
 	} else if (run->type == US_ENCODER_TYPE_M2M_VIDEO || run->type == US_ENCODER_TYPE_M2M_IMAGE) {
+		us_m2m_encoder_s **const m2m = &run->m2ms[wr->number];
+		if (*m2m == NULL) {
+			char name[32];
+			US_SNPRINTF(name, 31, "JPEG-%u", wr->number);
+			US_MUTEX_LOCK(run->mutex);
+			const uint quality = run->quality;
+			US_MUTEX_UNLOCK(run->mutex);
+			if (run->type == US_ENCODER_TYPE_M2M_VIDEO) {
+				*m2m = us_m2m_mjpeg_encoder_init(name, job->enc->m2m_path, quality);
+			} else {
+				*m2m = us_m2m_jpeg_encoder_init(name, job->enc->m2m_path, quality);
+			}
+		}
+		job->m2m_number = wr->number;
 		US_LOG_VERBOSE("Compressing JPEG using M2M-%s: worker=%s, buffer=%u",
 			(run->type == US_ENCODER_TYPE_M2M_VIDEO ? "VIDEO" : "IMAGE"),
 			wr->name, i);
-		if (us_m2m_encoder_compress(run->m2ms[wr->number], src, dest, false) < 0) {
+		if (us_m2m_encoder_compress(*m2m, src, dest, false) < 0) {
 			goto error;
 		}
 
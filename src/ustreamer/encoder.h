@@ -47,16 +47,28 @@ typedef struct {
 	uint				quality;
 	pthread_mutex_t		mutex;
 
-	uint				n_m2ms;
-	us_m2m_encoder_s	**m2ms;
-
 	us_workers_pool_s	*pool;
+
+	uint				n_m2ms;
+	us_m2m_encoder_s	**m2ms; // Indexed by worker number, survive the pool restart, but not the autoscale
+
+	bool				aq_enabled;
+	uint				aq_max_quality;
+	ldf					aq_size;
+	ldf					aq_time;
+	ldf					aq_interval;
+	ldf					aq_last_ts;
 } us_encoder_runtime_s;
 
 typedef struct {
 	us_encoder_type_e	type;
 	uint				n_workers;
+	uint				n_min_workers;
 	char				*m2m_path;
+	uint				aq_min_quality;
+	uint				aq_kbps;
+	uint				aq_fps;
+	us_workers_group_s	*group; // Shared workers limit for several devices, NULL for none
 
 	us_encoder_runtime_s *run;
 } us_encoder_s;
@@ -65,6 +77,7 @@ typedef struct {
 	us_encoder_s		*enc;
 	us_capture_hwbuf_s	*hw;
 	us_frame_s			*dest;
+	int					m2m_number; // Of the worker with M2M context, -1 for none yet
 } us_encoder_job_s;
 
 
@@ -78,3 +91,4 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap);
 void us_encoder_close(us_encoder_s *enc);
 
 void us_encoder_get_runtime_params(us_encoder_s *enc, us_encoder_type_e *type, uint *quality);
+void us_encoder_adapt_quality(us_encoder_s *enc, const us_frame_s *frame, uz backlog);
@@ -0,0 +1,400 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "encoder.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#include <x264.h>
+
+#include "../../../libs/types.h"
+#include "../../../libs/tools.h"
+#include "../../../libs/logging.h"
+#include "../../../libs/frame.h"
+
+
+static void _x264_encoder_ensure(us_x264_encoder_s *enc, const us_frame_s *frame);
+static void _x264_encoder_set_rc(us_x264_encoder_s *enc, x264_param_t *param);
+static void _x264_encoder_cleanup(us_x264_encoder_s *enc);
+static int _x264_encoder_prepare_picture(us_x264_encoder_s *enc, const us_frame_s *src);
+
+static void _convert_yuv_packed(const us_frame_s *src, u8 *y, u8 *u, u8 *v);
+static void _convert_grey(const us_frame_s *src, u8 *y, u8 *u, u8 *v);
+static void _convert_rgb(const us_frame_s *src, u8 *y, u8 *u, u8 *v);
+
+
+#define _LOG_ERROR(x_msg, ...)		US_LOG_ERROR("%s: " x_msg, enc->name, ##__VA_ARGS__)
+#define _LOG_INFO(x_msg, ...)		US_LOG_INFO("%s: " x_msg, enc->name, ##__VA_ARGS__)
+#define _LOG_VERBOSE(x_msg, ...)	US_LOG_VERBOSE("%s: " x_msg, enc->name, ##__VA_ARGS__)
+#define _LOG_DEBUG(x_msg, ...)		US_LOG_DEBUG("%s: " x_msg, enc->name, ##__VA_ARGS__)
+
+
+us_x264_encoder_s *us_x264_encoder_init(const char *name, uint bitrate, uint gop, uint fps, bool intra_refresh) {
+	US_LOG_INFO("%s: Initializing encoder ...", name);
+
+	us_x264_encoder_runtime_s *run;
+	US_CALLOC(run, 1);
+	run->tmp = us_frame_init();
+	run->last_online = -1;
+
+	us_x264_encoder_s *enc;
+	US_CALLOC(enc, 1);
+	enc->name = us_strdup(name);
+	enc->bitrate = bitrate; // Kbps
+	enc->gop = gop;
+	enc->fps = fps;
+	enc->intra_refresh = intra_refresh;
+	enc->run = run;
+	return enc;
+}
+
+void us_x264_encoder_destroy(us_x264_encoder_s *enc) {
+	_LOG_INFO("Destroying encoder ...");
+	_x264_encoder_cleanup(enc);
+	us_frame_destroy(enc->run->tmp);
+	free(enc->run);
+	free(enc->name);
+	free(enc);
+}
+
+int us_x264_encoder_compress(us_x264_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key) {
+	us_x264_encoder_runtime_s *const run = enc->run;
+
+	// С intra refresh картинка обновляется и после паузы, так что IDR
+	// по перерыву в кадрах не нужен и дал бы тот самый всплеск битрейта
+	force_key = (
+		force_key
+		|| run->last_online != src->online
+		|| (!enc->intra_refresh && run->last_encode_ts + 0.5 < us_get_now_monotonic())
+	);
+
+	us_frame_encoding_begin(src, dest, V4L2_PIX_FMT_H264);
+
+	_x264_encoder_ensure(enc, src);
+	if (!run->ready) { // Already prepared but failed
+		return -1;
+	}
+
+	if (_x264_encoder_prepare_picture(enc, src) < 0) {
+		return -1;
+	}
+
+	_LOG_DEBUG("Compressing new frame; force_key=%d ...", force_key);
+
+	run->pic.i_type = (force_key ? X264_TYPE_IDR : X264_TYPE_AUTO);
+	// Реальное время захвата в микросекундах, чтобы ABR делил битрейт по времени,
+	// а не по номинальному FPS. Метки должны строго возрастать.
+	const s64 pts = src->grab_begin_ts * 1000000;
+	run->pts = (pts > run->pts ? pts : run->pts + 1);
+	run->pic.i_pts = run->pts;
+
+	x264_nal_t *nals;
+	int n_nals;
+	x264_picture_t pic_out;
+	const int size = x264_encoder_encode(run->handle, &nals, &n_nals, &run->pic, &pic_out);
+	if (size <= 0) {
+		// В режиме zerolatency нет задержки кадров, так что пустой выход - это ошибка
+		_x264_encoder_cleanup(enc);
+		_LOG_ERROR("Encoder destroyed due an error (compress)");
+		return -1;
+	}
+
+	// Все NAL-юниты лежат в памяти подряд, и с b_annexb это готовый поток
+	us_frame_set_data(dest, nals[0].p_payload, size);
+	dest->key = pic_out.b_keyframe;
+	dest->gop = enc->gop;
+
+	us_frame_encoding_end(dest);
+
+	_LOG_VERBOSE("Compressed new frame: size=%zu, time=%0.3Lf, force_key=%d",
+		dest->used, dest->encode_end_ts - dest->encode_begin_ts, force_key);
+
+	run->last_online = src->online;
+	run->last_encode_ts = dest->encode_end_ts;
+	return 0;
+}
+
+void us_x264_encoder_set_bitrate(us_x264_encoder_s *enc, uint bitrate) {
+	us_x264_encoder_runtime_s *const run = enc->run;
+	enc->bitrate = bitrate; // Kbps
+	if (run->ready) {
+		x264_param_t param;
+		x264_encoder_parameters(run->handle, &param);
+		_x264_encoder_set_rc(enc, &param);
+		_LOG_DEBUG("Changing bitrate to %u ...", bitrate);
+		if (x264_encoder_reconfig(run->handle, &param) < 0) {
+			_LOG_ERROR("Can't change bitrate");
+		}
+	}
+}
+
+static void _x264_encoder_ensure(us_x264_encoder_s *enc, const us_frame_s *frame) {
+	us_x264_encoder_runtime_s *const run = enc->run;
+
+	if (
+		run->p_width == frame->width
+		&& run->p_height == frame->height
+		&& run->handle != NULL
+	) {
+		return; // Configured already
+	}
+
+	_LOG_INFO("Configuring encoder: %ux%u, bitrate=%u, gop=%u, intra_refresh=%d ...",
+		frame->width, frame->height, enc->bitrate, enc->gop, enc->intra_refresh);
+
+	_x264_encoder_cleanup(enc);
+
+	run->p_width = frame->width;
+	run->p_height = frame->height;
+
+	if (frame->width % 2 != 0 || frame->height % 2 != 0) {
+		_LOG_ERROR("Odd resolution isn't supported: %ux%u", frame->width, frame->height);
+		goto error;
+	}
+
+	x264_param_t param;
+	if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0) {
+		_LOG_ERROR("Can't apply encoder preset");
+		goto error;
+	}
+
+	// zerolatency уже включает sliced threads и выключает lookahead и B-кадры
+	param.i_threads = X264_THREADS_AUTO;
+	param.b_sliced_threads = 1;
+	param.i_log_level = X264_LOG_ERROR;
+
+	param.i_csp = X264_CSP_I420;
+	param.i_width = frame->width;
+	param.i_height = frame->height;
+	// zerolatency выключает VFR, и тогда ABR отдает каждому кадру bitrate/fps.
+	// Захват не держит ровно номинальный FPS, поэтому возвращаем VFR с метками
+	// времени захвата, а FPS остается только подсказкой для VBV.
+	param.b_vfr_input = 1;
+	param.i_timebase_num = 1;
+	param.i_timebase_den = 1000000;
+	param.i_fps_num = (enc->fps > 0 ? enc->fps : 30);
+	param.i_fps_den = 1;
+
+	param.i_keyint_max = (enc->gop > 0 ? (int)enc->gop : X264_KEYINT_MAX_INFINITE);
+	// С intra refresh вместо периодических IDR каждый кадр обновляет полосу,
+	// и keyint становится периодом полного обновления картинки
+	param.b_intra_refresh = enc->intra_refresh;
+	param.b_repeat_headers = 1; // SPS/PPS перед каждым ключевым кадром, как у M2M
+	param.b_annexb = 1;
+
+	param.rc.i_rc_method = X264_RC_ABR;
+	_x264_encoder_set_rc(enc, &param);
+
+	// Constrained Baseline, как у M2M-энкодера, для совместимости с браузерами
+	if (x264_param_apply_profile(&param, "baseline") < 0) {
+		_LOG_ERROR("Can't apply encoder profile");
+		goto error;
+	}
+
+	if ((run->handle = x264_encoder_open(&param)) == NULL) {
+		_LOG_ERROR("Can't open encoder");
+		goto error;
+	}
+
+	x264_picture_init(&run->pic);
+	run->pic.img.i_csp = X264_CSP_I420;
+	run->pic.img.i_plane = 3;
+	run->pts = -1;
+
+	run->ready = true;
+	_LOG_INFO("Encoder is ready");
+	return;
+
+error:
+	_x264_encoder_cleanup(enc);
+	_LOG_ERROR("Encoder destroyed due an error (prepare)");
+}
+
+static void _x264_encoder_set_rc(us_x264_encoder_s *enc, x264_param_t *param) {
+	param->rc.i_bitrate = enc->bitrate;
+	param->rc.i_vbv_max_bitrate = enc->bitrate;
+	param->rc.i_vbv_buffer_size = enc->bitrate / 2;
+}
+
+static void _x264_encoder_cleanup(us_x264_encoder_s *enc) {
+	us_x264_encoder_runtime_s *const run = enc->run;
+	if (run->handle != NULL) {
+		x264_encoder_close(run->handle);
+		run->handle = NULL;
+	}
+	run->last_online = -1;
+	run->ready = false;
+}
+
+static int _x264_encoder_prepare_picture(us_x264_encoder_s *enc, const us_frame_s *src) {
+	us_x264_encoder_runtime_s *const run = enc->run;
+	x264_image_t *const img = &run->pic.img;
+
+	const uint width = src->width;
+	const uint height = src->height;
+
+	switch (src->format) {
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YVU420: {
+			// Уже I420 (или YV12 с переставленными плоскостями), берем как есть
+			const uint stride = (src->stride > 0 ? src->stride : width);
+			u8 *const y = src->data;
+			u8 *const c0 = y + stride * height;
+			u8 *const c1 = c0 + (stride / 2) * (height / 2);
+			const bool yvu = (src->format == V4L2_PIX_FMT_YVU420);
+			img->plane[0] = y;
+			img->plane[1] = (yvu ? c1 : c0);
+			img->plane[2] = (yvu ? c0 : c1);
+			img->i_stride[0] = stride;
+			img->i_stride[1] = stride / 2;
+			img->i_stride[2] = stride / 2;
+			return 0;
+		}
+		default: break;
+	}
+
+	const uz y_size = width * height;
+	const uz c_size = (width / 2) * (height / 2);
+	us_frame_realloc_data(run->tmp, y_size + c_size * 2);
+	u8 *const y = run->tmp->data;
+	u8 *const u = y + y_size;
+	u8 *const v = u + c_size;
+
+	switch (src->format) {
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY:
+			_convert_yuv_packed(src, y, u, v);
+			break;
+		case V4L2_PIX_FMT_GREY:
+			_convert_grey(src, y, u, v);
+			break;
+		case V4L2_PIX_FMT_RGB565:
+		case V4L2_PIX_FMT_RGB24:
+		case V4L2_PIX_FMT_BGR24:
+			_convert_rgb(src, y, u, v);
+			break;
+		default: {
+			char fourcc_str[8];
+			_LOG_ERROR("Unsupported input format: %s", us_fourcc_to_string(src->format, fourcc_str, 8));
+			return -1;
+		}
+	}
+
+	img->plane[0] = y;
+	img->plane[1] = u;
+	img->plane[2] = v;
+	img->i_stride[0] = width;
+	img->i_stride[1] = width / 2;
+	img->i_stride[2] = width / 2;
+	return 0;
+}
+
+static void _convert_yuv_packed(const us_frame_s *src, u8 *y, u8 *u, u8 *v) {
+	const uint stride = (src->stride > 0 ? src->stride : src->width * 2);
+	uint y0_off = 0;
+	uint u_off = 1;
+	uint v_off = 3;
+	switch (src->format) {
+		case V4L2_PIX_FMT_YVYU: u_off = 3; v_off = 1; break;
+		case V4L2_PIX_FMT_UYVY: y0_off = 1; u_off = 0; v_off = 2; break;
+		default: break; // YUYV
+	}
+
+	for (uint row = 0; row < src->height; row += 2) {
+		const u8 *const line0 = src->data + stride * row;
+		const u8 *const line1 = line0 + stride;
+		u8 *const y0 = y + src->width * row;
+		u8 *const y1 = y0 + src->width;
+		for (uint col = 0; col < src->width; col += 2) {
+			const u8 *const p0 = line0 + col * 2;
+			const u8 *const p1 = line1 + col * 2;
+			y0[col] = p0[y0_off];
+			y0[col + 1] = p0[y0_off + 2];
+			y1[col] = p1[y0_off];
+			y1[col + 1] = p1[y0_off + 2];
+			// Хрома в 4:2:2 уже прорежена по горизонтали, усредняем только строки
+			*u++ = (p0[u_off] + p1[u_off] + 1) / 2;
+			*v++ = (p0[v_off] + p1[v_off] + 1) / 2;
+		}
+	}
+}
+
+static void _convert_grey(const us_frame_s *src, u8 *y, u8 *u, u8 *v) {
+	const uint stride = (src->stride > 0 ? src->stride : src->width);
+	for (uint row = 0; row < src->height; ++row) {
+		memcpy(y + src->width * row, src->data + stride * row, src->width);
+	}
+	const uz c_size = (src->width / 2) * (src->height / 2);
+	memset(u, 128, c_size);
+	memset(v, 128, c_size);
+}
+
+static void _convert_rgb(const us_frame_s *src, u8 *y, u8 *u, u8 *v) {
+	const uint bpp = (src->format == V4L2_PIX_FMT_RGB565 ? 2 : 3);
+	const uint stride = (src->stride > 0 ? src->stride : src->width * bpp);
+
+#	define READ_RGB(x_ptr, x_r, x_g, x_b) { \
+			if (src->format == V4L2_PIX_FMT_RGB565) { \
+				const uint m_pix = (x_ptr)[0] | ((x_ptr)[1] << 8); \
+				x_r = ((m_pix >> 11) & 0x1F) << 3; \
+				x_g = ((m_pix >> 5) & 0x3F) << 2; \
+				x_b = (m_pix & 0x1F) << 3; \
+			} else if (src->format == V4L2_PIX_FMT_RGB24) { \
+				x_r = (x_ptr)[0]; x_g = (x_ptr)[1]; x_b = (x_ptr)[2]; \
+			} else { \
+				x_r = (x_ptr)[2]; x_g = (x_ptr)[1]; x_b = (x_ptr)[0]; \
+			} \
+		}
+
+	// BT.601 limited range, как у libjpeg при сжатии в YCbCr
+	for (uint row = 0; row < src->height; row += 2) {
+		for (uint col = 0; col < src->width; col += 2) {
+			int sum_r = 0;
+			int sum_g = 0;
+			int sum_b = 0;
+			for (uint dy = 0; dy < 2; ++dy) {
+				for (uint dx = 0; dx < 2; ++dx) {
+					const u8 *const ptr = src->data + stride * (row + dy) + (col + dx) * bpp;
+					int r;
+					int g;
+					int b;
+					READ_RGB(ptr, r, g, b);
+					y[src->width * (row + dy) + col + dx] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+					sum_r += r;
+					sum_g += g;
+					sum_b += b;
+				}
+			}
+			sum_r /= 4;
+			sum_g /= 4;
+			sum_b /= 4;
+			*u++ = ((-38 * sum_r - 74 * sum_g + 112 * sum_b + 128) >> 8) + 128;
+			*v++ = ((112 * sum_r - 94 * sum_g - 18 * sum_b + 128) >> 8) + 128;
+		}
+	}
+
+#	undef READ_RGB
+}
@@ -0,0 +1,61 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdint.h> // x264.h requires it
+#include <x264.h>
+
+#include "../../../libs/types.h"
+#include "../../../libs/frame.h"
+
+
+typedef struct {
+	x264_t			*handle;
+	x264_picture_t	pic;
+	us_frame_s		*tmp;
+	s64				pts;
+
+	uint	p_width;
+	uint	p_height;
+
+	bool	ready;
+	int		last_online;
+	ldf		last_encode_ts;
+} us_x264_encoder_runtime_s;
+
+typedef struct {
+	char	*name;
+	uint	bitrate;
+	uint	gop;
+	uint	fps; // Nominal, 0 for default; the real rate is taken from the frames timestamps
+	bool	intra_refresh;
+
+	us_x264_encoder_runtime_s *run;
+} us_x264_encoder_s;
+
+
+us_x264_encoder_s *us_x264_encoder_init(const char *name, uint bitrate, uint gop, uint fps, bool intra_refresh);
+void us_x264_encoder_destroy(us_x264_encoder_s *enc);
+
+int us_x264_encoder_compress(us_x264_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key);
+void us_x264_encoder_set_bitrate(us_x264_encoder_s *enc, uint bitrate);
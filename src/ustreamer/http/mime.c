@@ -70,3 +70,14 @@ const char *us_guess_mime_type(const char *path) {
 misc:
 	return "application/misc";
 }
+
+bool us_is_compressible_mime_type(const char *mime) {
+	// Картинки, кроме svg и несжатых bmp/ico, уже сжаты и от gzip только растут
+	return (
+		!strncmp(mime, "text/", 5)
+		|| !strcmp(mime, "image/svg+xml")
+		|| !strcmp(mime, "image/bmp")
+		|| !strcmp(mime, "image/x-icon")
+		|| !strcmp(mime, "application/json")
+	);
+}
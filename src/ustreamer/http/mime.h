@@ -22,5 +22,8 @@
 
 #pragma once
 
+#include <stdbool.h>
+
 
 const char *us_guess_mime_type(const char *str);
+bool us_is_compressible_mime_type(const char *mime);
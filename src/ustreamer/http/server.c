@@ -35,6 +35,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -55,6 +56,7 @@
 #include "../../libs/tools.h"
 #include "../../libs/threading.h"
 #include "../../libs/logging.h"
+#include "../../libs/array.h"
 #include "../../libs/frame.h"
 #include "../../libs/base64.h"
 #include "../../libs/list.h"
@@ -62,11 +64,13 @@
 #include "../data/favicon_ico.h"
 #include "../encoder.h"
 #include "../stream.h"
+#include "../sched.h"
 #ifdef WITH_GPIO
 #	include "../gpio/gpio.h"
 #endif
 
 #include "tools.h"
+#include "ws.h"
 #include "mime.h"
 #include "static.h"
 #ifdef WITH_SYSTEMD
@@ -74,6 +78,12 @@
 #endif
 
 
+static us_server_s *_server_init(us_stream_s *stream);
+static void _server_destroy_events(us_server_s *server);
+static void _server_destroy(us_server_s *server);
+static void _http_inherit(us_server_s *mount, const us_server_s *server);
+static void _http_setup(us_server_s *server);
+
 static int _http_preprocess_request(struct evhttp_request *req, us_server_s *server);
 
 static int _http_check_run_compat_action(struct evhttp_request *req, void *v_server);
@@ -81,18 +91,56 @@ static int _http_check_run_compat_action(struct evhttp_request *req, void *v_ser
 static void _http_callback_root(struct evhttp_request *req, void *v_server);
 static void _http_callback_favicon(struct evhttp_request *req, void *v_server);
 static void _http_callback_static(struct evhttp_request *req, void *v_server);
+static void _http_reply_static(struct evhttp_request *req, const us_static_entry_s *entry);
 static void _http_callback_state(struct evhttp_request *req, void *v_server);
+static void _http_make_state(us_server_s *server, struct evbuffer *buf);
 static void _http_callback_snapshot(struct evhttp_request *req, void *v_server);
 
 static void _http_callback_stream(struct evhttp_request *req, void *v_server);
 static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_ctx);
 static void _http_callback_stream_error(struct bufferevent *buf_event, short what, void *v_ctx);
+static void _http_callback_stream_pending(int fd, short what, void *v_client);
+
+static void _http_callback_ws(struct evhttp_request *req, void *v_server);
+static void _http_callback_ws_read(struct bufferevent *buf_event, void *v_client);
+static void _http_callback_ws_closed(struct bufferevent *buf_event, void *v_client);
+static void _http_callback_ws_error(struct bufferevent *buf_event, short what, void *v_client);
+static void _http_ws_send_frame(us_ws_client_s *client);
+static void _http_ws_remove(us_ws_client_s *client, const char *reason);
+
+static void _http_callback_state_events(struct evhttp_request *req, void *v_server);
+static void _http_callback_sse_error(struct bufferevent *buf_event, short what, void *v_client);
+static void _http_sse_refresher(int fd, short what, void *v_server);
+static void _http_sse_get_state(us_server_s *server, us_server_sse_state_s *st);
+static void _http_sse_send_client_event(us_server_s *server, const char *type, u64 id, bool joined);
+static void _http_sse_send(us_server_s *server, struct evbuffer *buf);
+
+static void _http_add_raw_cors_headers(us_server_s *server, struct evhttp_request *req, struct evbuffer *buf);
+static void _http_set_tcp_nodelay(us_server_s *server, struct bufferevent *buf_event, const char *hostport);
+static void _http_stream_set_notsent_lowat(us_stream_client_s *client, struct bufferevent *buf_event);
+static void _http_stream_tune_sndbuf(us_stream_client_s *client, struct bufferevent *buf_event, uz frame_size);
+static void _http_update_has_clients(us_server_s *server);
 
 static void _http_refresher(int fd, short event, void *v_server);
-static void _http_send_stream(us_server_s *server, bool stream_updated, bool frame_updated);
+static void _http_send_stream(us_server_s *server, bool stream_updated, bool frame_updated, uint thumbs_updated);
+static bool _http_stream_check_limits(us_stream_client_s *client, uz size);
+static void _http_stream_queue_frame(us_stream_client_s *client, struct evhttp_connection *conn);
+static void _http_stream_set_pending(us_stream_client_s *client);
+static void _http_stream_update_rate(us_stream_client_s *client);
+static void _http_send_ws(us_server_s *server);
 static void _http_send_snapshot(us_server_s *server);
+static bool _http_reply_hq_snapshot(us_server_s *server, us_snapshot_client_s *client, u64 after_id, ldf min_grab_ts);
+static void _http_reply_snapshot(struct evhttp_request *req, const us_frame_s *frame, const char *etag);
+
+static uint _http_parse_thumb(struct evkeyvalq *params);
+static uint _http_update_thumbs(us_server_s *server);
+static const us_frame_s *_http_get_thumb(us_server_s *server, uint thumb, u64 *frame_id);
 
-static bool _expose_frame(us_server_s *server, const us_frame_s *frame);
+static void _http_add_frame_data(us_server_s *server, struct evbuffer *buf, const us_frame_s *frame);
+static struct evbuffer_file_segment *_http_get_frame_segment(us_server_s *server);
+static void _http_memfd_release(const struct evbuffer_file_segment *seg, int flags, void *v_memfd);
+
+static bool _expose_frame(us_server_s *server, us_frame_s **frame_ptr);
 
 
 #define _LOG_ERROR(x_msg, ...)		US_LOG_ERROR("HTTP: " x_msg, ##__VA_ARGS__)
@@ -110,30 +158,8 @@ static bool _expose_frame(us_server_s *server, const us_frame_s *frame);
 
 
 us_server_s *us_server_init(us_stream_s *stream) {
-	us_server_exposed_s *exposed;
-	US_CALLOC(exposed, 1);
-	exposed->frame = us_frame_init();
-	exposed->queued_fpsi = us_fpsi_init("MJPEG-QUEUED", false);
-
-	us_server_runtime_s *run;
-	US_CALLOC(run, 1);
-	run->ext_fd = -1;
-	run->exposed = exposed;
-
-	us_server_s *server;
-	US_CALLOC(server, 1);
-	server->host = "127.0.0.1";
-	server->port = 8080;
-	server->unix_path = "";
-	server->user = "";
-	server->passwd = "";
-	server->static_path = "";
-	server->allow_origin = "";
-	server->instance_id = "";
-	server->timeout = 10;
-	server->stream = stream;
-	server->run = run;
-
+	us_server_s *const server = _server_init(stream);
+	us_server_runtime_s *const run = server->run;
 	US_A(!evthread_use_pthreads());
 	US_A((run->base = event_base_new()) != NULL);
 	US_A((run->http = evhttp_new(run->base)) != NULL);
@@ -141,15 +167,29 @@ us_server_s *us_server_init(us_stream_s *stream) {
 	return server;
 }
 
+us_server_s *us_server_add_mount(us_server_s *server, us_stream_s *stream, const char *name) {
+	US_A(server->parent == NULL);
+	US_A(server->n_mounts < US_SERVER_MAX_MOUNTS);
+	// Базу событий и evhttp монтированный сервер получит от основного в us_server_listen()
+	us_server_s *const mount = _server_init(stream);
+	mount->mount_name = name;
+	mount->parent = server;
+	server->mounts[server->n_mounts] = mount;
+	++server->n_mounts;
+	return mount;
+}
+
 void us_server_destroy(us_server_s *server) {
 	us_server_runtime_s *const run = server->run;
 
-	if (run->refresher != NULL) {
-		event_del(run->refresher);
-		event_free(run->refresher);
+	// События монтированных серверов живут в общей базе и должны умереть раньше нее
+	for (uint i = 0; i < server->n_mounts; ++i) {
+		_server_destroy_events(server->mounts[i]);
 	}
+	_server_destroy_events(server);
 
 	evhttp_free(run->http);
+	US_DELETE(run->static_cache, us_static_cache_destroy);
 	US_CLOSE_FD(run->ext_fd);
 	event_base_free(run->base);
 
@@ -157,49 +197,24 @@ void us_server_destroy(us_server_s *server) {
 	libevent_global_shutdown();
 #	endif
 
-	US_LIST_ITERATE(run->snapshot_clients, client, { // cppcheck-suppress constStatement
-		free(client);
-	});
-
-	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
-		us_fpsi_destroy(client->fpsi);
-		free(client->key);
-		free(client->hostport);
-		free(client);
-	});
-
-	US_DELETE(run->auth_token, free);
-
-	us_fpsi_destroy(run->exposed->queued_fpsi);
-	us_frame_destroy(run->exposed->frame);
-	free(run->exposed);
-	free(server->run);
-	free(server);
+	for (uint i = 0; i < server->n_mounts; ++i) {
+		_server_destroy(server->mounts[i]);
+	}
+	_server_destroy(server);
 }
 
 int us_server_listen(us_server_s *server) {
 	us_server_runtime_s *const run = server->run;
-	us_server_exposed_s *const ex = run->exposed;
-	us_stream_s *const stream = server->stream;
 
-	{
-		if (us_str_is_ok(server->static_path)) {
-			_LOG_INFO("Enabling the file server: %s", server->static_path);
-			evhttp_set_gencb(run->http, _http_callback_static, (void*)server);
-		} else {
-			US_A(!evhttp_set_cb(run->http, "/", _http_callback_root, (void*)server));
-			US_A(!evhttp_set_cb(run->http, "/favicon.ico", _http_callback_favicon, (void*)server));
-		}
-		US_A(!evhttp_set_cb(run->http, "/state", _http_callback_state, (void*)server));
-		US_A(!evhttp_set_cb(run->http, "/snapshot", _http_callback_snapshot, (void*)server));
-		US_A(!evhttp_set_cb(run->http, "/stream", _http_callback_stream, (void*)server));
+	if (us_str_is_ok(server->static_path)) {
+		_LOG_INFO("Enabling the file server: %s", server->static_path);
+		run->static_cache = us_static_cache_init(run->base, server->static_path);
+		evhttp_set_gencb(run->http, _http_callback_static, (void*)server);
+	} else {
+		US_A(!evhttp_set_cb(run->http, "/", _http_callback_root, (void*)server));
+		US_A(!evhttp_set_cb(run->http, "/favicon.ico", _http_callback_favicon, (void*)server));
 	}
 
-	us_frame_copy(stream->run->blank->jpeg, ex->frame);
-
-	US_A((run->refresher = event_new(run->base, -1, 0, _http_refresher, server)) != NULL);
-	stream->run->http->jpeg_refresher = run->refresher;
-
 	evhttp_set_timeout(run->http, server->timeout);
 
 	if (us_str_is_ok(server->user)) {
@@ -216,6 +231,14 @@ int us_server_listen(us_server_s *server) {
 		_LOG_INFO("Using HTTP basic auth");
 	}
 
+	_http_setup(server);
+	for (uint i = 0; i < server->n_mounts; ++i) {
+		us_server_s *const mount = server->mounts[i];
+		_http_inherit(mount, server);
+		_http_setup(mount);
+		_LOG_INFO("Mounted %s at /%s/", mount->stream->cap->path, mount->mount_name);
+	}
+
 	if (us_str_is_ok(server->unix_path)) {
 		_LOG_DEBUG("Binding server to UNIX socket '%s' ...", server->unix_path);
 		if ((run->ext_fd = us_evhttp_bind_unix(
@@ -386,9 +409,23 @@ static void _http_callback_static(struct evhttp_request *req, void *v_server) {
 		}
 	}
 
+	{
+		const us_static_entry_s *const entry = us_static_cache_get(server->run->static_cache, decoded_path);
+		if (entry != NULL) {
+			if (entry->plain != NULL) {
+				_http_reply_static(req, entry);
+				goto cleanup;
+			} else if (entry->path == NULL) {
+				goto not_found;
+			}
+			static_path = us_strdup(entry->path); // Found already, but not cached
+		}
+	}
+
+	// Не закешировано, отдаем с диска
 	_A_EVBUFFER_NEW(buf);
 
-	if ((static_path = us_find_static_file_path(server->static_path, decoded_path)) == NULL) {
+	if (static_path == NULL && (static_path = us_find_static_file_path(server->static_path, decoded_path)) == NULL) {
 		goto not_found;
 	}
 
@@ -435,29 +472,86 @@ cleanup:
 
 #undef COMPAT_REQUEST
 
+static void _http_reply_static(struct evhttp_request *req, const us_static_entry_s *entry) {
+	us_static_blob_s *blob = entry->plain;
+	const char *etag = entry->etag;
+	const char *encoding = NULL;
+	if (entry->brotli != NULL && us_evhttp_is_encoding_accepted(req, "br")) {
+		blob = entry->brotli;
+		etag = entry->etag_brotli;
+		encoding = "br";
+	} else if (entry->gzip != NULL && us_evhttp_is_encoding_accepted(req, "gzip")) {
+		blob = entry->gzip;
+		etag = entry->etag_gzip;
+		encoding = "gzip";
+	}
+
+	_A_ADD_HEADER(req, "ETag", etag);
+	_A_ADD_HEADER(req, "Last-Modified", entry->last_modified);
+	if (entry->gzip != NULL || entry->brotli != NULL) {
+		_A_ADD_HEADER(req, "Vary", "Accept-Encoding");
+	}
+
+	const char *const if_none_match = us_evhttp_get_header(req, "If-None-Match");
+	const char *const if_modified_since = us_evhttp_get_header(req, "If-Modified-Since");
+	if (
+		(if_none_match != NULL && (strstr(if_none_match, etag) != NULL || !strcmp(if_none_match, "*")))
+		|| (if_none_match == NULL && if_modified_since != NULL && !strcmp(if_modified_since, entry->last_modified))
+	) {
+		evhttp_send_reply(req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+		return;
+	}
+
+	if (encoding != NULL) {
+		_A_ADD_HEADER(req, "Content-Encoding", encoding);
+	}
+
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	us_static_blob_add_to_evbuffer(blob, buf);
+	_A_ADD_HEADER(req, "Content-Type", entry->mime_type);
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
+
 static void _http_callback_state(struct evhttp_request *req, void *v_server) {
 	us_server_s *const server = v_server;
+
+	PREPROCESS_REQUEST;
+
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	_http_make_state(server, buf);
+
+	_A_ADD_HEADER(req, "Content-Type", "application/json");
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
+
+static void _http_make_state(us_server_s *server, struct evbuffer *buf) {
 	us_server_runtime_s *const run = server->run;
 	us_server_exposed_s *const ex = run->exposed;
 	us_stream_s *const stream = server->stream;
 
-	PREPROCESS_REQUEST;
-
 	us_encoder_type_e enc_type;
 	uint enc_quality;
 	us_encoder_get_runtime_params(stream->enc, &enc_type, &enc_quality);
 
-	struct evbuffer *buf;
-	_A_EVBUFFER_NEW(buf);
+	const uint enc_encoded = us_fpsi_get(stream->run->http->jpeg_encoded_fpsi, NULL);
+	const uint enc_wasted = us_fpsi_get(stream->run->http->jpeg_wasted_fpsi, NULL);
 
 	_A_EVBUFFER_ADD_PRINTF(
 		buf,
 		"{\"ok\": true, \"result\": {"
 		" \"instance_id\": \"%s\","
-		" \"encoder\": {\"type\": \"%s\", \"quality\": %u},",
+		" \"encoder\": {\"type\": \"%s\", \"quality\": %u,"
+		" \"encoded_fps\": %u, \"wasted_fps\": %u, \"wasted_ratio\": %.2f},",
 		server->instance_id,
 		us_encoder_type_to_string(enc_type),
-		enc_quality);
+		enc_quality,
+		enc_encoded,
+		enc_wasted,
+		(enc_encoded > 0 ? (double)enc_wasted / enc_encoded : 0));
 
 #	ifdef WITH_V4P
 	if (stream->drm != NULL) {
@@ -476,11 +570,33 @@ static void _http_callback_state(struct evhttp_request *req, void *v_server) {
 		const uint fps = us_fpsi_get(stream->run->http->h264_fpsi, &meta);
 		_A_EVBUFFER_ADD_PRINTF(
 			buf,
-			" \"h264\": {\"bitrate\": %u, \"gop\": %u, \"online\": %s, \"fps\": %u},",
+			" \"h264\": {\"encoder\": \"%s\", \"bitrate\": %u, \"current_bitrate\": %u,"
+			" \"gop\": %u, \"online\": %s, \"released\": %s, \"fps\": %u, \"layers\": [",
+			us_stream_h264_encoder_to_string(stream->h264_encoder),
 			stream->h264_bitrate,
+			atomic_load(&stream->run->http->h264_bitrate),
 			stream->h264_gop,
 			us_bool_to_string(meta.online),
+			us_bool_to_string(atomic_load(&stream->run->http->h264_released)),
 			fps);
+		for (uint i = 0; i < stream->n_h264_layers; ++i) {
+			const us_stream_h264_layer_s *const layer = &stream->h264_layers[i];
+			us_fpsi_meta_s layer_meta;
+			const uint layer_fps = us_fpsi_get(layer->fpsi, &layer_meta);
+			_A_EVBUFFER_ADD_PRINTF(
+				buf,
+				"%s{\"sink\": \"%s\", \"bitrate\": %u, \"current_bitrate\": %u, \"scale\": %u,"
+				" \"online\": %s, \"fps\": %u, \"has_clients\": %s}",
+				(i > 0 ? ", " : ""),
+				layer->sink->obj,
+				layer->bitrate,
+				atomic_load(&layer->current_bitrate),
+				layer->scale,
+				us_bool_to_string(layer_meta.online),
+				layer_fps,
+				us_bool_to_string(atomic_load(&layer->sink->has_clients)));
+		}
+		_A_EVBUFFER_ADD_PRINTF(buf, "]},");
 	}
 
 	if (stream->jpeg_sink != NULL || stream->h264_sink != NULL) {
@@ -501,41 +617,85 @@ static void _http_callback_state(struct evhttp_request *req, void *v_server) {
 		_A_EVBUFFER_ADD_PRINTF(buf, "},");
 	}
 
+	_A_EVBUFFER_ADD_PRINTF(buf, " \"threads\": {");
+#	define ADD_GROUP(x_group) { \
+			_A_EVBUFFER_ADD_PRINTF( \
+				buf, \
+				"\"%s\": {\"cpus\": \"%s\", \"policy\": \"%s\", \"priority\": %u}, ", \
+				x_group.role, \
+				(us_str_is_ok(x_group.cpus) ? x_group.cpus : "any"), \
+				(atomic_load(&x_group.rt_active) ? "fifo" : "other"), \
+				(atomic_load(&x_group.rt_active) ? x_group.rt_priority : 0)); \
+		}
+	ADD_GROUP(us_g_sched.capture);
+	ADD_GROUP(us_g_sched.encoder);
+	ADD_GROUP(us_g_sched.http);
+#	undef ADD_GROUP
+	_A_EVBUFFER_ADD_PRINTF(buf, "\"mlock\": %s},", us_bool_to_string(us_g_sched.locked));
+
 	us_fpsi_meta_s captured_meta;
 	const uint captured_fps = us_fpsi_get(stream->run->http->captured_fpsi, &captured_meta);
 	_A_EVBUFFER_ADD_PRINTF(
 		buf,
 		" \"source\": {\"resolution\": {\"width\": %u, \"height\": %u},"
-		" \"online\": %s, \"desired_fps\": %u, \"captured_fps\": %u},"
+		" \"online\": %s, \"idle\": %s, \"desired_fps\": %u, \"captured_fps\": %u, \"paced_fps\": %u},"
 		" \"stream\": {\"queued_fps\": %u, \"clients\": %u, \"clients_stat\": {",
 		(server->fake_width ? server->fake_width : captured_meta.width),
 		(server->fake_height ? server->fake_height : captured_meta.height),
 		us_bool_to_string(captured_meta.online),
+		us_bool_to_string(atomic_load(&stream->run->http->idle)),
 		stream->desired_fps,
 		captured_fps,
+		us_fpsi_get(stream->run->http->jpeg_paced_fpsi, NULL),
 		us_fpsi_get(ex->queued_fpsi, NULL),
 		run->stream_clients_count);
 
 	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
+		_http_stream_update_rate(client);
 		_A_EVBUFFER_ADD_PRINTF(
 			buf,
 			"\"%" PRIx64 "\": {\"fps\": %u, \"extra_headers\": %s, \"advance_headers\": %s,"
-			" \"dual_final_frames\": %s, \"zero_data\": %s, \"key\": \"%s\"}%s",
+			" \"dual_final_frames\": %s, \"zero_data\": %s, \"thumb\": %u,"
+			" \"fps_limit\": %u, \"maxrate\": %u, \"rate\": %u,"
+			" \"notsent_lowat\": %u, \"sndbuf\": %d, \"key\": \"%s\"}%s",
 			client->id,
 			us_fpsi_get(client->fpsi, NULL),
 			us_bool_to_string(client->extra_headers),
 			us_bool_to_string(client->advance_headers),
 			us_bool_to_string(client->dual_final_frames),
 			us_bool_to_string(client->zero_data),
+			client->thumb,
+			client->fps,
+			client->maxrate,
+			client->rate,
+			client->notsent_lowat,
+			client->sndbuf,
 			(client->key != NULL ? client->key : "0"),
 			(client->next ? ", " : ""));
 	});
 
-	_A_EVBUFFER_ADD_PRINTF(buf, "}}}}");
+	_A_EVBUFFER_ADD_PRINTF(buf, "}}, \"ws\": {\"clients\": %u, \"clients_stat\": {", run->ws_clients_count);
 
-	_A_ADD_HEADER(req, "Content-Type", "application/json");
-	evhttp_send_reply(req, HTTP_OK, "OK", buf);
-	evbuffer_free(buf);
+	US_LIST_ITERATE(run->ws_clients, client, { // cppcheck-suppress constStatement
+		_A_EVBUFFER_ADD_PRINTF(
+			buf,
+			"\"%" PRIx64 "\": {\"fps\": %u, \"window\": %u, \"in_flight\": %u,"
+			" \"skipped\": %u, \"rtt\": %.06Lf, \"thumb\": %u}%s",
+			client->id,
+			us_fpsi_get(client->fpsi, NULL),
+			client->window,
+			client->sent_seq - client->acked_seq,
+			client->skipped,
+			client->rtt,
+			client->thumb,
+			(client->next ? ", " : ""));
+	});
+
+	_A_EVBUFFER_ADD_PRINTF(buf, "}}, \"mounts\": [");
+	for (uint i = 0; i < server->n_mounts; ++i) {
+		_A_EVBUFFER_ADD_PRINTF(buf, "%s\"%s\"", (i > 0 ? ", " : ""), server->mounts[i]->mount_name);
+	}
+	_A_EVBUFFER_ADD_PRINTF(buf, "]}}");
 }
 
 static void _http_callback_snapshot(struct evhttp_request *req, void *v_server) {
@@ -543,11 +703,58 @@ static void _http_callback_snapshot(struct evhttp_request *req, void *v_server)
 
 	PREPROCESS_REQUEST;
 
+	struct evkeyvalq params;
+	evhttp_parse_query(evhttp_request_get_uri(req), &params);
+	const uint max_age = us_evkeyvalq_get_uint(&params, "max_age", 0);
+	const uint quality = us_evkeyvalq_get_uint(&params, "quality", 0);
+	const uint width = us_evkeyvalq_get_uint(&params, "width", 0);
+	const uint thumb = _http_parse_thumb(&params);
+	evhttp_clear_headers(&params);
+
+	if (quality > 100 || (width > 0 && width < 16)) {
+		evhttp_send_error(req, HTTP_BADREQUEST, "Invalid quality or width");
+		return;
+	}
+
 	us_snapshot_client_s *client;
 	US_CALLOC(client, 1);
 	client->server = server;
 	client->req = req;
 	client->req_ts = us_get_now_monotonic();
+	client->quality = quality;
+	client->width = width;
+	client->thumb = thumb;
+
+	if (quality > 0 || width > 0) {
+		// Кодируется отдельным фоновым воркером из сохраненного сырого кадра
+		if (max_age > 0 && _http_reply_hq_snapshot(server, client, 0, client->req_ts - max_age)) {
+			free(client);
+			return;
+		}
+		if (!us_snapshot_request(server->stream->run->http->snapshot, quality, width, &client->raw_id)) {
+			evhttp_send_error(req, HTTP_SERVUNAVAIL, "Too many different snapshot requests");
+			free(client);
+			return;
+		}
+		US_LIST_APPEND(server->run->snapshot_clients, client);
+		return;
+	}
+
+	const us_frame_s *const frame = server->run->exposed->frame;
+	u64 thumb_id = 0;
+	const us_frame_s *const thumb_frame = _http_get_thumb(server, thumb, &thumb_id);
+	if (
+		max_age > 0 && frame->online && frame->used > 0
+		&& frame->grab_begin_ts + max_age >= client->req_ts
+		&& thumb_frame != NULL && thumb_id == server->run->exposed->frame_id
+	) {
+		// Последний кадр достаточно свежий, отдаем сразу и не будим энкодер
+		char etag[64];
+		US_SNPRINTF(etag, 63, "\"%016" PRIx64 "-%u\"", thumb_id, thumb);
+		_http_reply_snapshot(req, thumb_frame, etag);
+		free(client);
+		return;
+	}
 
 	atomic_fetch_add(&server->stream->run->http->snapshot_requested, 1);
 	US_LIST_APPEND(server->run->snapshot_clients, client);
@@ -583,10 +790,15 @@ static void _http_callback_stream(struct evhttp_request *req, void *v_server) {
 		PARSE_PARAM(true, dual_final_frames);
 		PARSE_PARAM(true, zero_data);
 #		undef PARSE_PARAM
+		client->fps = us_evkeyvalq_get_uint(&params, "fps", 0);
+		client->maxrate = us_evkeyvalq_get_uint(&params, "maxrate", 0);
+		client->notsent_lowat = us_evkeyvalq_get_uint(&params, "notsent_lowat", server->tcp_notsent_lowat);
+		client->thumb = _http_parse_thumb(&params);
 		evhttp_clear_headers(&params);
 
 		client->hostport = us_evhttp_get_hostport(req);
 		client->id = us_get_now_id();
+		US_A((client->pending_timer = evtimer_new(run->base, _http_callback_stream_pending, client)) != NULL);
 
 		{
 			char *name;
@@ -596,27 +808,15 @@ static void _http_callback_stream(struct evhttp_request *req, void *v_server) {
 		}
 
 		US_LIST_APPEND_C(run->stream_clients, client, run->stream_clients_count);
-
-		if (run->stream_clients_count == 1) {
-			atomic_store(&server->stream->run->http->has_clients, true);
-#			ifdef WITH_GPIO
-			us_gpio_set_has_http_clients(true);
-#			endif
-		}
+		_http_update_has_clients(server);
+		_http_sse_send_client_event(server, "stream", client->id, true);
 
 		_LOG_INFO("NEW client (now=%u): %s, id=%" PRIx64,
 			run->stream_clients_count, client->hostport, client->id);
 
 		struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
-		if (server->tcp_nodelay && run->ext_fd >= 0) {
-			_LOG_DEBUG("Setting up TCP_NODELAY to the client %s ...", client->hostport);
-			const evutil_socket_t fd = bufferevent_getfd(buf_event);
-			US_A(fd >= 0);
-			int on = 1;
-			if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on)) != 0) {
-				_LOG_PERROR("Can't set TCP_NODELAY to the client %s", client->hostport);
-			}
-		}
+		_http_set_tcp_nodelay(server, buf_event, client->hostport);
+		_http_stream_set_notsent_lowat(client, buf_event);
 		bufferevent_setcb(buf_event, NULL, NULL, _http_callback_stream_error, (void*)client);
 		bufferevent_enable(buf_event, EV_READ);
 	} else {
@@ -624,12 +824,12 @@ static void _http_callback_stream(struct evhttp_request *req, void *v_server) {
 	}
 }
 
-#undef PREPROCESS_REQUEST
-
 static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_client) {
 	us_stream_client_s *const client = v_client;
 	us_server_s *const server = client->server;
 	us_server_exposed_s *const ex = server->run->exposed;
+	const us_frame_s *const frame = _http_get_thumb(server, client->thumb, NULL);
+	US_A(frame != NULL); // Клиента не будят, пока нет миниатюры
 
 	us_fpsi_update(client->fpsi, true, NULL);
 
@@ -665,24 +865,7 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 
 	if (client->need_initial) {
 		_A_EVBUFFER_ADD_PRINTF(buf, "HTTP/1.0 200 OK" RN);
-		
-		if (us_str_is_ok(client->server->allow_origin)) {
-			const char *const cors_headers = us_evhttp_get_header(client->req, "Access-Control-Request-Headers");
-			const char *const cors_method = us_evhttp_get_header(client->req, "Access-Control-Request-Method");
-
-			_A_EVBUFFER_ADD_PRINTF(
-				buf,
-				"Access-Control-Allow-Origin: %s" RN
-				"Access-Control-Allow-Credentials: true" RN,
-				client->server->allow_origin);
-
-			if (cors_headers != NULL) {
-				_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Headers: %s" RN, cors_headers);
-			}
-			if (cors_method != NULL) {
-				_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Methods: %s" RN, cors_method);
-			}
-		}
+		_http_add_raw_cors_headers(server, client->req, buf);
 
 		_A_EVBUFFER_ADD_PRINTF(
 			buf,
@@ -713,7 +896,7 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 			"Content-Length: %zu" RN
 			"X-Timestamp: %.06Lf" RN
 			"%s",
-			(!client->zero_data ? ex->frame->used : 0),
+			(!client->zero_data ? frame->used : 0),
 			us_get_now_real(),
 			(client->extra_headers ? "" : RN));
 
@@ -738,8 +921,8 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 				RN,
 				us_bool_to_string(ex->frame->online),
 				ex->dropped,
-				ex->frame->width,
-				ex->frame->height,
+				frame->width,
+				frame->height,
 				us_fpsi_get(client->fpsi, NULL),
 				ex->frame->grab_begin_ts,
 				ex->frame->grab_end_ts,
@@ -754,10 +937,14 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 	}
 
 	if (!client->zero_data) {
-		_A_EVBUFFER_ADD(buf, (void*)ex->frame->data, ex->frame->used);
+		_http_stream_tune_sndbuf(client, buf_event, frame->used);
+		_http_add_frame_data(server, buf, frame);
+		client->rate_bytes += frame->used;
 	}
 	_A_EVBUFFER_ADD_PRINTF(buf, RN "--" BOUNDARY RN);
 
+	_http_stream_update_rate(client);
+
 	if (client->advance_headers) {
 		ADD_ADVANCE_HEADERS;
 	}
@@ -781,13 +968,8 @@ static void _http_callback_stream_error(struct bufferevent *buf_event, short wha
 	us_server_runtime_s *const run = server->run;
 
 	US_LIST_REMOVE_C(run->stream_clients, client, run->stream_clients_count);
-
-	if (run->stream_clients_count == 0) {
-		atomic_store(&server->stream->run->http->has_clients, false);
-#		ifdef WITH_GPIO
-		us_gpio_set_has_http_clients(false);
-#		endif
-	}
+	_http_update_has_clients(server);
+	_http_sse_send_client_event(server, "stream", client->id, false);
 
 	char *const reason = us_bufferevent_format_reason(what);
 	_LOG_INFO("DEL client (now=%u): %s, id=%" PRIx64 ", %s",
@@ -797,143 +979,612 @@ static void _http_callback_stream_error(struct bufferevent *buf_event, short wha
 	struct evhttp_connection *conn = evhttp_request_get_connection(client->req);
 	US_DELETE(conn, evhttp_connection_free);
 
+	US_DELETE(client->pending_timer, event_free);
 	us_fpsi_destroy(client->fpsi);
 	free(client->key);
 	free(client->hostport);
 	free(client);
 }
 
-static void _http_send_stream(us_server_s *server, bool stream_updated, bool frame_updated) {
-	us_server_runtime_s *const run = server->run;
-	us_server_exposed_s *const ex = run->exposed;
+static void _http_callback_stream_pending(int fd, short what, void *v_client) {
+	(void)fd;
+	(void)what;
 
-	bool queued = false;
-	bool has_clients = true;
+	// Лимиты клиента освободились, а нового кадра с тех пор не было, отправляем последний
+	us_stream_client_s *const client = v_client;
+	if (!client->pending) {
+		return;
+	}
+	struct evhttp_connection *const conn = evhttp_request_get_connection(client->req);
+	const us_frame_s *const frame = _http_get_thumb(client->server, client->thumb, NULL);
+	if (conn == NULL || frame == NULL) {
+		return;
+	}
+	if (_http_stream_check_limits(client, frame->used)) {
+		_http_stream_queue_frame(client, conn);
+		client->updated_prev = true;
+	} else {
+		_http_stream_set_pending(client);
+	}
+}
 
-	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
-		struct evhttp_connection *const conn = evhttp_request_get_connection(client->req);
-		if (conn != NULL) {
-			// Фикс для бага WebKit. При включенной опции дропа одинаковых фреймов,
-			// WebKit отрисовывает последний фрейм в серии с некоторой задержкой,
-			// и нужно послать два фрейма, чтобы серия была вовремя завершена.
-			// Это похоже на баг Blink (см. _http_callback_stream_write() и advance_headers),
-			// но фикс для него не лечит проблему вебкита. Такие дела.
+static void _http_callback_ws(struct evhttp_request *req, void *v_server) {
+	// Бинарный JPEG-стрим поверх WebSocket с подтверждениями от клиента.
+	// Каждый кадр уходит одним сообщением: заголовок с метаданными и JPEG.
+	// Клиент отвечает текстовым сообщением с номером полученного кадра,
+	// а новый кадр отправляется только если в полете их меньше, чем window.
+	// Так задержка не копится в буферах браузера и сети, лишние кадры просто пропускаются.
 
-			const bool dual_update = (
-				server->drop_same_frames
-				&& client->dual_final_frames
-				&& stream_updated
-				&& client->updated_prev
-				&& !frame_updated
-			);
+	us_server_s *const server = v_server;
+	us_server_runtime_s *const run = server->run;
 
-			if (dual_update || frame_updated || client->need_first_frame) {
-				struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
-				bufferevent_setcb(buf_event, NULL, _http_callback_stream_write, _http_callback_stream_error, (void*)client);
-				bufferevent_enable(buf_event, EV_READ|EV_WRITE);
+	PREPROCESS_REQUEST;
 
-				client->need_first_frame = false;
-				client->updated_prev = (frame_updated || client->need_first_frame); // Игнорировать dual
-				queued = true;
-			} else if (stream_updated) { // Для dual
-				client->updated_prev = false;
-			}
-			has_clients = true;
-		}
-	});
+	const char *const upgrade = us_evhttp_get_header(req, "Upgrade");
+	const char *const version = us_evhttp_get_header(req, "Sec-WebSocket-Version");
+	const char *const ws_key = us_evhttp_get_header(req, "Sec-WebSocket-Key");
+	if (
+		evhttp_request_get_command(req) != EVHTTP_REQ_GET
+		|| upgrade == NULL || strcasecmp(upgrade, "websocket")
+		|| version == NULL || strcmp(version, "13")
+		|| ws_key == NULL
+	) {
+		evhttp_send_reply(req, HTTP_BADREQUEST, "Bad Request", NULL);
+		return;
+	}
 
-	if (queued) {
-		us_fpsi_update(ex->queued_fpsi, true, NULL);
-	} else if (!has_clients) {
-		us_fpsi_update(ex->queued_fpsi, false, NULL);
+	struct evhttp_connection *const conn = evhttp_request_get_connection(req);
+	if (conn == NULL) {
+		evhttp_request_free(req);
+		return;
 	}
-}
 
-static void _http_send_snapshot(us_server_s *server) {
-	us_server_exposed_s *const ex = server->run->exposed;
-	us_blank_s *blank = NULL;
+	us_ws_client_s *client;
+	US_CALLOC(client, 1);
+	client->server = server;
+	client->req = req;
 
-#	define ADD_TIME_HEADER(x_key, x_value) { \
-			US_SNPRINTF(header_buf, 255, "%.06Lf", x_value); \
-			_A_ADD_HEADER(req, x_key, header_buf); \
-		}
+	struct evkeyvalq params;
+	evhttp_parse_query(evhttp_request_get_uri(req), &params);
+	client->window = US_MAX(1u, US_MIN(us_evkeyvalq_get_uint(&params, "window", 2), (uint)US_WS_MAX_WINDOW));
+	client->thumb = _http_parse_thumb(&params);
+	evhttp_clear_headers(&params);
 
-#	define ADD_UNSIGNED_HEADER(x_key, x_value) { \
-			US_SNPRINTF(header_buf, 255, "%u", x_value); \
-			_A_ADD_HEADER(req, x_key, header_buf); \
-		}
+	client->hostport = us_evhttp_get_hostport(req);
+	client->id = us_get_now_id();
 
-	us_fpsi_meta_s captured_meta;
-	us_fpsi_get(server->stream->run->http->captured_fpsi, &captured_meta);
+	{
+		char *name;
+		US_ASPRINTF(name, "WS-CLIENT-%" PRIx64, client->id);
+		client->fpsi = us_fpsi_init(name, false);
+		free(name);
+	}
 
-	US_LIST_ITERATE(server->run->snapshot_clients, client, { // cppcheck-suppress constStatement
-		struct evhttp_request *req = client->req;
+	US_LIST_APPEND_C(run->ws_clients, client, run->ws_clients_count);
+	_http_update_has_clients(server);
+	_http_sse_send_client_event(server, "ws", client->id, true);
 
-		const bool has_fresh_snapshot = (atomic_load(&server->stream->run->http->snapshot_requested) == 0);
-		const bool timed_out = (client->req_ts + US_MAX((uint)1, server->stream->error_delay * 3) < us_get_now_monotonic());
+	_LOG_INFO("NEW WS client (now=%u): %s, id=%" PRIx64 ", window=%u",
+		run->ws_clients_count, client->hostport, client->id, client->window);
 
-		if (has_fresh_snapshot || timed_out) {
-			us_frame_s *frame = ex->frame;
-			if (!captured_meta.online) {
-				if (blank == NULL) {
-					blank = us_blank_init();
-					us_blank_draw(blank, "< NO LIVE VIDEO >", captured_meta.width, captured_meta.height);
-				}
-				frame = blank->jpeg;
-			}
+	struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
+	_http_set_tcp_nodelay(server, buf_event, client->hostport);
 
-			struct evbuffer *buf;
-			_A_EVBUFFER_NEW(buf);
-			_A_EVBUFFER_ADD(buf, (const void*)frame->data, frame->used);
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	char *const accept = us_ws_make_accept(ws_key);
+	_A_EVBUFFER_ADD_PRINTF(
+		buf,
+		"HTTP/1.1 101 Switching Protocols" RN
+		"Upgrade: websocket" RN
+		"Connection: Upgrade" RN
+		"Sec-WebSocket-Accept: %s" RN
+		RN,
+		accept);
+	free(accept);
+	US_A(!bufferevent_write_buffer(buf_event, buf));
+	evbuffer_free(buf);
 
-			_A_ADD_HEADER(req, "Cache-Control", "no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0");
-			_A_ADD_HEADER(req, "Pragma", "no-cache");
-			_A_ADD_HEADER(req, "Expires", "Mon, 3 Jan 2000 12:34:56 GMT");
+	bufferevent_setcb(buf_event, _http_callback_ws_read, NULL, _http_callback_ws_error, (void*)client);
+	bufferevent_enable(buf_event, EV_READ|EV_WRITE);
 
-			char header_buf[256];
+	_http_ws_send_frame(client);
+}
 
-			ADD_TIME_HEADER("X-Timestamp", us_get_now_real());
+static void _http_callback_state_events(struct evhttp_request *req, void *v_server) {
+	// Server-Sent Events: сначала полный /state, затем только изменения.
+	// Подписчики не дергают сервер опросами и не заставляют каждый раз рендерить весь JSON.
 
-			_A_ADD_HEADER(req, "X-UStreamer-Online",				us_bool_to_string(frame->online));
-			ADD_UNSIGNED_HEADER("X-UStreamer-Width",				frame->width);
-			ADD_UNSIGNED_HEADER("X-UStreamer-Height",				frame->height);
-			ADD_TIME_HEADER("X-UStreamer-Grab-Begin-Timestamp",		frame->grab_begin_ts);
-			ADD_TIME_HEADER("X-UStreamer-Grab-End-Timestamp",		frame->grab_end_ts);
-			ADD_TIME_HEADER("X-UStreamer-Encode-Begin-Timestamp",	frame->encode_begin_ts);
-			ADD_TIME_HEADER("X-UStreamer-Encode-End-Timestamp",		frame->encode_end_ts);
-			ADD_TIME_HEADER("X-UStreamer-Send-Timestamp",			us_get_now_monotonic());
+	us_server_s *const server = v_server;
+	us_server_runtime_s *const run = server->run;
 
-			_A_ADD_HEADER(req, "Content-Type", "image/jpeg");
+	PREPROCESS_REQUEST;
 
-			evhttp_send_reply(req, HTTP_OK, "OK", buf);
-			evbuffer_free(buf);
+	struct evhttp_connection *const conn = evhttp_request_get_connection(req);
+	if (conn == NULL) {
+		evhttp_request_free(req);
+		return;
+	}
 
-			US_LIST_REMOVE(server->run->snapshot_clients, client);
-			free(client);
-		}
-	});
+	us_sse_client_s *client;
+	US_CALLOC(client, 1);
+	client->server = server;
+	client->req = req;
+	client->hostport = us_evhttp_get_hostport(req);
+	client->id = us_get_now_id();
 
-#	undef ADD_UNSUGNED_HEADER
-#	undef ADD_TIME_HEADER
+	if (run->sse_clients == NULL) {
+		// Первый подписчик: дальше шлем изменения относительно того, что он получит сейчас
+		_http_sse_get_state(server, &run->sse_state);
+	}
+	US_LIST_APPEND_C(run->sse_clients, client, run->sse_clients_count);
 
-	US_DELETE(blank, us_blank_destroy);
-}
+	_LOG_INFO("NEW SSE client (now=%u): %s, id=%" PRIx64,
+		run->sse_clients_count, client->hostport, client->id);
 
-static void _http_refresher(int fd, short what, void *v_server) {
-	(void)fd;
-	(void)what;
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	_A_EVBUFFER_ADD_PRINTF(buf, "HTTP/1.0 200 OK" RN);
+	_http_add_raw_cors_headers(server, req, buf);
+	_A_EVBUFFER_ADD_PRINTF(
+		buf,
+		"Cache-Control: no-store" RN
+		"Content-Type: text/event-stream" RN
+		RN
+		"event: state" RN
+		"data: ");
+	_http_make_state(server, buf);
+	_A_EVBUFFER_ADD_PRINTF(buf, RN RN);
+
+	struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
+	US_A(!bufferevent_write_buffer(buf_event, buf));
+	evbuffer_free(buf);
 
-	us_server_s *server = v_server;
-	us_server_exposed_s *ex = server->run->exposed;
-	us_ring_s *const ring = server->stream->run->http->jpeg_ring;
+	bufferevent_setcb(buf_event, NULL, NULL, _http_callback_sse_error, (void*)client);
+	bufferevent_enable(buf_event, EV_READ|EV_WRITE);
+}
 
-	bool stream_updated = false;
+#undef PREPROCESS_REQUEST
+
+static void _http_callback_ws_read(struct bufferevent *buf_event, void *v_client) {
+	us_ws_client_s *const client = v_client;
+	struct evbuffer *const input = bufferevent_get_input(buf_event);
+
+	while (!client->closing) {
+		us_ws_opcode_e opcode;
+		u8 data[126]; // Управляющие фреймы не длиннее 125 байт, подтверждения тоже короткие
+		uz size;
+		const int retval = us_ws_read_message(input, &opcode, data, sizeof(data) - 1, &size);
+		if (retval == 0) {
+			break;
+		} else if (retval < 0) {
+			_http_ws_remove(client, "protocol error");
+			return;
+		}
+
+		switch (opcode) {
+			case US_WS_OP_TEXT: {
+				data[size] = '\0';
+				char *end = NULL;
+				const unsigned long long seq = strtoull((const char*)data, &end, 10);
+				const u32 acked = seq - client->acked_seq;
+				const u32 in_flight = client->sent_seq - client->acked_seq;
+				if (end == (char*)data || *end != '\0' || acked == 0 || acked > in_flight) {
+					_LOG_DEBUG("Ignoring WS ack %s from client %s, id=%" PRIx64,
+						data, client->hostport, client->id);
+					break;
+				}
+				client->acked_seq = seq;
+				client->rtt = us_get_now_monotonic() - client->sent_ts[seq % US_WS_MAX_WINDOW];
+				_http_ws_send_frame(client);
+				break;
+			}
+
+			case US_WS_OP_PING: {
+				struct evbuffer *buf;
+				_A_EVBUFFER_NEW(buf);
+				us_ws_add_header(buf, US_WS_OP_PONG, size);
+				_A_EVBUFFER_ADD(buf, data, size);
+				US_A(!bufferevent_write_buffer(buf_event, buf));
+				evbuffer_free(buf);
+				break;
+			}
+
+			case US_WS_OP_CLOSE: {
+				// Отвечаем закрытием и ждем, пока ответ уйдет, прежде чем рвать соединение
+				struct evbuffer *buf;
+				_A_EVBUFFER_NEW(buf);
+				us_ws_add_header(buf, US_WS_OP_CLOSE, US_MIN(size, (uz)2));
+				_A_EVBUFFER_ADD(buf, data, US_MIN(size, (uz)2));
+				US_A(!bufferevent_write_buffer(buf_event, buf));
+				evbuffer_free(buf);
+				client->closing = true;
+				bufferevent_setcb(buf_event, NULL, _http_callback_ws_closed, _http_callback_ws_error, (void*)client);
+				bufferevent_disable(buf_event, EV_READ);
+				break;
+			}
+
+			case US_WS_OP_BINARY: // Binary and pong aren't expected from the client
+			case US_WS_OP_PONG: break;
+
+			default:
+				_http_ws_remove(client, "unexpected opcode");
+				return;
+		}
+	}
+}
+
+static void _http_callback_ws_closed(struct bufferevent *buf_event, void *v_client) {
+	(void)buf_event;
+	_http_ws_remove(v_client, "closed by client");
+}
+
+static void _http_callback_ws_error(struct bufferevent *buf_event, short what, void *v_client) {
+	(void)buf_event;
+	char *const reason = us_bufferevent_format_reason(what);
+	_http_ws_remove(v_client, reason);
+	free(reason);
+}
+
+static void _http_ws_send_frame(us_ws_client_s *client) {
+	us_server_s *const server = client->server;
+	u64 frame_id = 0;
+	const us_frame_s *const frame = _http_get_thumb(server, client->thumb, &frame_id);
+
+	if (
+		client->closing
+		|| frame == NULL || frame->used == 0
+		|| client->frame_id == frame_id
+		|| client->sent_seq - client->acked_seq >= client->window
+	) {
+		return;
+	}
+
+	struct evhttp_connection *const conn = evhttp_request_get_connection(client->req);
+	if (conn == NULL) {
+		return;
+	}
+
+	const ldf now_ts = us_get_now_monotonic();
+	if (client->frame_id > 0) {
+		client->skipped += frame_id - client->frame_id - 1; // Не влезли в окно
+	}
+	++client->sent_seq;
+	client->sent_ts[client->sent_seq % US_WS_MAX_WINDOW] = now_ts;
+	client->frame_id = frame_id;
+
+	// Метаданные перед JPEG, все числа little-endian:
+	//   0: u8 version=1, 1: u8 flags (bit 0 - online), 2: u16 header size=24,
+	//   4: u16 width, 6: u16 height, 8: u32 seq (для подтверждения), 12: u32 skipped,
+	//   16: f64 latency (секунды от начала захвата до отправки).
+	u8 meta[24] = {0};
+	{
+		const ldf latency = now_ts - frame->grab_begin_ts;
+		const double latency_f = (frame->grab_begin_ts > 0 ? latency : 0);
+		u64 latency_bits;
+		memcpy(&latency_bits, &latency_f, sizeof(latency_bits));
+
+#		define PUT(x_offset, x_size, x_value) { \
+				for (uint m_index = 0; m_index < (x_size); ++m_index) { \
+					meta[(x_offset) + m_index] = (u64)(x_value) >> (m_index * 8); \
+				} \
+			}
+		PUT(0, 1, 1);
+		PUT(1, 1, frame->online);
+		PUT(2, 2, sizeof(meta));
+		PUT(4, 2, frame->width);
+		PUT(6, 2, frame->height);
+		PUT(8, 4, client->sent_seq);
+		PUT(12, 4, client->skipped);
+		PUT(16, 8, latency_bits);
+#		undef PUT
+	}
+
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	us_ws_add_header(buf, US_WS_OP_BINARY, sizeof(meta) + frame->used);
+	_A_EVBUFFER_ADD(buf, meta, sizeof(meta));
+	_http_add_frame_data(server, buf, frame);
+	US_A(!bufferevent_write_buffer(evhttp_connection_get_bufferevent(conn), buf));
+	evbuffer_free(buf);
+
+	us_fpsi_update(client->fpsi, true, NULL);
+}
+
+static void _http_ws_remove(us_ws_client_s *client, const char *reason) {
+	us_server_s *const server = client->server;
+	us_server_runtime_s *const run = server->run;
+
+	US_LIST_REMOVE_C(run->ws_clients, client, run->ws_clients_count);
+	_http_update_has_clients(server);
+	_http_sse_send_client_event(server, "ws", client->id, false);
+
+	_LOG_INFO("DEL WS client (now=%u): %s, id=%" PRIx64 ", %s",
+		run->ws_clients_count, client->hostport, client->id, reason);
+
+	struct evhttp_connection *conn = evhttp_request_get_connection(client->req);
+	US_DELETE(conn, evhttp_connection_free);
+
+	us_fpsi_destroy(client->fpsi);
+	free(client->hostport);
+	free(client);
+}
+
+static void _http_send_stream(us_server_s *server, bool stream_updated, bool frame_updated, uint thumbs_updated) {
+	us_server_runtime_s *const run = server->run;
+	us_server_exposed_s *const ex = run->exposed;
+
+	bool queued = false;
+	bool has_clients = true;
+	uz backlog = 0;
+
+	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
+		struct evhttp_connection *const conn = evhttp_request_get_connection(client->req);
+		if (conn != NULL) {
+			const uz client_backlog = evbuffer_get_length(
+				bufferevent_get_output(evhttp_connection_get_bufferevent(conn)));
+			backlog = US_MAX(backlog, client_backlog);
+
+			// Фикс для бага WebKit. При включенной опции дропа одинаковых фреймов,
+			// WebKit отрисовывает последний фрейм в серии с некоторой задержкой,
+			// и нужно послать два фрейма, чтобы серия была вовремя завершена.
+			// Это похоже на баг Blink (см. _http_callback_stream_write() и advance_headers),
+			// но фикс для него не лечит проблему вебкита. Такие дела.
+
+			// Для миниатюры новым кадром считается момент, когда ее закодировал воркер
+			const us_frame_s *const frame = _http_get_thumb(server, client->thumb, NULL);
+			const bool client_frame_updated = (client->thumb > 0 ? (thumbs_updated & client->thumb) : frame_updated);
+			const bool client_stream_updated = (stream_updated || client_frame_updated);
+
+			const bool dual_update = (
+				server->drop_same_frames
+				&& client->dual_final_frames
+				&& client_stream_updated
+				&& client->updated_prev
+				&& !client_frame_updated
+			);
+
+			const bool need_update = (
+				frame != NULL // Миниатюра может быть еще не готова
+				&& (dual_update || client_frame_updated || client->need_first_frame)
+			);
+
+			if (need_update && !client->need_first_frame && !_http_stream_check_limits(client, frame->used)) {
+				client->updated_prev = false; // Пропущен по лимитам клиента
+				_http_stream_set_pending(client);
+			} else if (need_update) {
+				_http_stream_queue_frame(client, conn);
+				client->updated_prev = client_frame_updated; // Игнорировать dual
+				queued = true;
+			} else if (client_stream_updated) { // Для dual
+				client->updated_prev = false;
+			}
+			_http_stream_update_rate(client); // Простаивающему клиенту тоже
+			has_clients = true;
+		}
+	});
+
+	atomic_store(&server->stream->run->http->clients_backlog, backlog);
+
+	if (queued) {
+		us_fpsi_update(ex->queued_fpsi, true, NULL);
+	} else if (!has_clients) {
+		us_fpsi_update(ex->queued_fpsi, false, NULL);
+	}
+}
+
+static bool _http_stream_check_limits(us_stream_client_s *client, uz size) {
+	// Кадры сверх fps или maxrate клиента просто пропускаются.
+	// Для maxrate это token bucket в байтах с запасом на секунду: кадр уходит,
+	// если бюджет не отрицательный, и может увести его в долг, чтобы большие
+	// кадры не блокировались навсегда при маленьком лимите.
+	const ldf now_ts = us_get_now_monotonic();
+	const ldf rate = (ldf)client->maxrate * 1000 / 8;
+	if (client->maxrate > 0) {
+		if (client->tokens_ts > 0) {
+			client->tokens = US_MIN(client->tokens + (now_ts - client->tokens_ts) * rate, rate);
+		}
+		client->tokens_ts = now_ts;
+		if (client->tokens < 0) {
+			return false;
+		}
+	}
+	if (!us_pacer_check(&client->pacer, client->fps, now_ts)) {
+		return false;
+	}
+	if (client->maxrate > 0) {
+		client->tokens -= size;
+	}
+	return true;
+}
+
+static void _http_stream_queue_frame(us_stream_client_s *client, struct evhttp_connection *conn) {
+	struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
+	bufferevent_setcb(buf_event, NULL, _http_callback_stream_write, _http_callback_stream_error, (void*)client);
+	bufferevent_enable(buf_event, EV_READ|EV_WRITE);
+
+	client->need_first_frame = false;
+	client->pending = false;
+	US_A(!event_del(client->pending_timer));
+}
+
+static void _http_stream_set_pending(us_stream_client_s *client) {
+	// Будим себя, когда пополнится бюджет maxrate или подойдет срок по fps
+	const ldf now_ts = us_get_now_monotonic();
+	ldf delay = 0;
+	if (client->maxrate > 0 && client->tokens < 0) {
+		delay = -client->tokens / ((ldf)client->maxrate * 1000 / 8);
+	} else if (client->fps > 0) {
+		delay = client->pacer.next_ts - now_ts;
+	}
+	delay = US_MAX(delay, (ldf)0.001);
+
+	struct timeval interval = {0};
+	interval.tv_sec = delay;
+	interval.tv_usec = (delay - interval.tv_sec) * 1000000;
+	client->pending = true;
+	US_A(!event_add(client->pending_timer, &interval));
+}
+
+static void _http_stream_update_rate(us_stream_client_s *client) {
+	const ldf now_ts = us_get_now_monotonic();
+	if (client->rate_ts <= 0) {
+		client->rate_ts = now_ts;
+	} else if (now_ts - client->rate_ts >= 1) {
+		client->rate = client->rate_bytes * 8 / 1000 / (now_ts - client->rate_ts);
+		client->rate_bytes = 0;
+		client->rate_ts = now_ts;
+	}
+}
+
+static void _http_send_ws(us_server_s *server) {
+	// Если окно клиента занято, кадр будет отправлен по подтверждению, либо пропущен.
+	// Клиент, не подтверждающий кадры дольше таймаута, отваливается по таймауту чтения,
+	// а тот, кому просто нечего подтверждать, не должен, поэтому для него таймаут взводится заново.
+	US_LIST_ITERATE(server->run->ws_clients, client, { // cppcheck-suppress constStatement
+		_http_ws_send_frame(client);
+		struct evhttp_connection *const conn = evhttp_request_get_connection(client->req);
+		if (conn != NULL && !client->closing && client->sent_seq == client->acked_seq) {
+			bufferevent_enable(evhttp_connection_get_bufferevent(conn), EV_READ);
+		}
+	});
+}
+
+static void _http_send_snapshot(us_server_s *server) {
+	us_server_exposed_s *const ex = server->run->exposed;
+	us_blank_s *blank = NULL;
+
+	us_fpsi_meta_s captured_meta;
+	us_fpsi_get(server->stream->run->http->captured_fpsi, &captured_meta);
+
+	US_LIST_ITERATE(server->run->snapshot_clients, client, { // cppcheck-suppress constStatement
+		struct evhttp_request *req = client->req;
+
+		u64 thumb_id = 0;
+		const us_frame_s *const thumb_frame = _http_get_thumb(server, client->thumb, &thumb_id);
+		const bool hq = (client->quality > 0 || client->width > 0);
+		const bool has_fresh_snapshot = (
+			!hq && atomic_load(&server->stream->run->http->snapshot_requested) == 0
+			&& thumb_frame != NULL && thumb_id == ex->frame_id // Ждем миниатюру свежего кадра
+		);
+		const bool timed_out = (client->req_ts + US_MAX((uint)1, server->stream->error_delay * 3) < us_get_now_monotonic());
+
+		if (hq && _http_reply_hq_snapshot(server, client, client->raw_id, 0)) {
+			US_LIST_REMOVE(server->run->snapshot_clients, client);
+			free(client);
+		} else if (has_fresh_snapshot || timed_out) {
+			// Если фоновый воркер не успел, отдаем обычный кадр потока
+			const us_frame_s *frame = ex->frame;
+			if (!captured_meta.online) {
+				if (blank == NULL) {
+					blank = us_blank_init();
+					us_blank_draw(blank, "< NO LIVE VIDEO >", captured_meta.width, captured_meta.height);
+				}
+				frame = blank->jpeg;
+			}
+
+			char etag[64];
+			if (frame == ex->frame && thumb_frame != NULL) {
+				US_SNPRINTF(etag, 63, "\"%016" PRIx64 "-%u\"", thumb_id, client->thumb);
+				_http_reply_snapshot(req, thumb_frame, etag);
+			} else if (frame == ex->frame) {
+				// Воркер так и не успел, лучше полный кадр, чем ничего
+				US_SNPRINTF(etag, 63, "\"%016" PRIx64 "-0\"", ex->frame_id);
+				_http_reply_snapshot(req, frame, etag);
+			} else {
+				// Заглушка не имеет своего номера, поэтому ETag только у реального кадра
+				_http_reply_snapshot(req, frame, NULL);
+			}
+
+			US_LIST_REMOVE(server->run->snapshot_clients, client);
+			free(client);
+		}
+	});
+
+	US_DELETE(blank, us_blank_destroy);
+}
+
+static bool _http_reply_hq_snapshot(us_server_s *server, us_snapshot_client_s *client, u64 after_id, ldf min_grab_ts) {
+	us_frame_s *const frame = server->run->snapshot_frame;
+	u64 raw_id;
+	if (!us_snapshot_get(
+		server->stream->run->http->snapshot, client->quality, client->width,
+		after_id, min_grab_ts, frame, &raw_id
+	)) {
+		return false;
+	}
+	char etag[64];
+	US_SNPRINTF(etag, 63, "\"%016" PRIx64 "-%u-%u\"", raw_id, client->quality, client->width);
+	_http_reply_snapshot(client->req, frame, etag);
+	return true;
+}
+
+static void _http_reply_snapshot(struct evhttp_request *req, const us_frame_s *frame, const char *etag) {
+#	define ADD_TIME_HEADER(x_key, x_value) { \
+			US_SNPRINTF(header_buf, 255, "%.06Lf", x_value); \
+			_A_ADD_HEADER(req, x_key, header_buf); \
+		}
+
+#	define ADD_UNSIGNED_HEADER(x_key, x_value) { \
+			US_SNPRINTF(header_buf, 255, "%u", x_value); \
+			_A_ADD_HEADER(req, x_key, header_buf); \
+		}
+
+	char header_buf[256];
+
+	_A_ADD_HEADER(req, "Cache-Control", "no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0");
+	_A_ADD_HEADER(req, "Pragma", "no-cache");
+	_A_ADD_HEADER(req, "Expires", "Mon, 3 Jan 2000 12:34:56 GMT");
+
+	if (etag != NULL) {
+		_A_ADD_HEADER(req, "ETag", etag);
+		const char *const if_none_match = us_evhttp_get_header(req, "If-None-Match");
+		if (if_none_match != NULL && (strstr(if_none_match, etag) != NULL || !strcmp(if_none_match, "*"))) {
+			evhttp_send_reply(req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+			return;
+		}
+	}
+
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	_A_EVBUFFER_ADD(buf, (const void*)frame->data, frame->used);
+
+	ADD_TIME_HEADER("X-Timestamp", us_get_now_real());
+
+	_A_ADD_HEADER(req, "X-UStreamer-Online",				us_bool_to_string(frame->online));
+	ADD_UNSIGNED_HEADER("X-UStreamer-Width",				frame->width);
+	ADD_UNSIGNED_HEADER("X-UStreamer-Height",				frame->height);
+	ADD_TIME_HEADER("X-UStreamer-Grab-Begin-Timestamp",		frame->grab_begin_ts);
+	ADD_TIME_HEADER("X-UStreamer-Grab-End-Timestamp",		frame->grab_end_ts);
+	ADD_TIME_HEADER("X-UStreamer-Encode-Begin-Timestamp",	frame->encode_begin_ts);
+	ADD_TIME_HEADER("X-UStreamer-Encode-End-Timestamp",		frame->encode_end_ts);
+	ADD_TIME_HEADER("X-UStreamer-Send-Timestamp",			us_get_now_monotonic());
+
+	_A_ADD_HEADER(req, "Content-Type", "image/jpeg");
+
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+
+#	undef ADD_UNSIGNED_HEADER
+#	undef ADD_TIME_HEADER
+}
+
+static void _http_refresher(int fd, short what, void *v_server) {
+	(void)fd;
+	(void)what;
+
+	us_server_s *server = v_server;
+	us_server_exposed_s *ex = server->run->exposed;
+	us_ring_s *const ring = server->stream->run->http->jpeg_ring;
+
+	bool stream_updated = false;
 	bool frame_updated = false;
 
 	int ri;
 	while ((ri = us_ring_consumer_acquire(ring, 0)) >= 0) {
-		const us_frame_s *const frame = ring->items[ri];
-		frame_updated = _expose_frame(server, frame);
+		us_frame_s *frame = ring->items[ri];
+		frame_updated = _expose_frame(server, &frame);
+		ring->items[ri] = frame;
 		stream_updated = true;
 		us_ring_consumer_release(ring, ri);
 	}
@@ -947,12 +1598,534 @@ static void _http_refresher(int fd, short what, void *v_server) {
 		stream_updated = true;
 	}
 
-	_http_send_stream(server, stream_updated, frame_updated);
+	const uint thumbs_updated = _http_update_thumbs(server);
+
+	_http_send_stream(server, stream_updated, frame_updated, thumbs_updated);
+	_http_send_ws(server);
 	_http_send_snapshot(server);
 }
 
-static bool _expose_frame(us_server_s *server, const us_frame_s *frame) {
+static uint _http_parse_thumb(struct evkeyvalq *params) {
+	// Поддерживаемые libjpeg масштабы, остальное округляем вниз
+	const uint thumb = us_evkeyvalq_get_uint(params, "thumb", 0);
+	return (thumb >= 8 ? 8 : thumb >= 4 ? 4 : thumb >= 2 ? 2 : 0);
+}
+
+static uint _http_update_thumbs(us_server_s *server) {
+	// Миниатюры кодирует отдельный поток: забираем готовые и заказываем для нового кадра.
+	// Он будит рефрешер, когда закончит, так что готовые придут в следующий вызов.
+	us_server_runtime_s *const run = server->run;
+	us_server_exposed_s *const ex = run->exposed;
+
+	uint wanted = 0; // Масштабы 2, 4 и 8 сами по себе битовая маска
+	US_LIST_ITERATE(run->stream_clients, client, { wanted |= client->thumb; });
+	US_LIST_ITERATE(run->ws_clients, client, { wanted |= client->thumb; });
+	US_LIST_ITERATE(run->snapshot_clients, client, { wanted |= client->thumb; });
+
+	uint updated = 0;
+	for (uint thumb = 2; thumb <= 8; thumb <<= 1) {
+		us_thumb_s *const th = &run->thumbs[us_thumbs_get_index(thumb)];
+		if (us_thumbs_get(run->thumbs_worker, thumb, th->frame_id, th->jpeg, &th->frame_id)) {
+			updated |= thumb;
+		}
+		if (
+			(wanted & thumb) && th->frame_id != ex->frame_id
+			&& ex->frame->used > 0 && us_is_jpeg(ex->frame->format)
+		) {
+			us_encoder_type_e type;
+			uint quality;
+			us_encoder_get_runtime_params(server->stream->enc, &type, &quality);
+			if (quality == 0) {
+				quality = server->stream->cap->jpeg_quality; // Для HW и passthrough берем заказанное у устройства
+			}
+			us_thumbs_request(run->thumbs_worker, ex->frame, ex->frame_id, thumb, quality);
+		}
+	}
+	return updated;
+}
+
+static const us_frame_s *_http_get_thumb(us_server_s *server, uint thumb, u64 *frame_id) {
+	// Последняя готовая миниатюра, она может отставать от кадра или еще не появиться
+	us_server_exposed_s *const ex = server->run->exposed;
+	if (thumb == 0 || ex->frame->used == 0 || !us_is_jpeg(ex->frame->format)) {
+		if (frame_id != NULL) {
+			*frame_id = ex->frame_id;
+		}
+		return ex->frame;
+	}
+
+	const us_thumb_s *const th = &server->run->thumbs[us_thumbs_get_index(thumb)];
+	if (th->jpeg->used == 0) {
+		return NULL;
+	}
+	if (frame_id != NULL) {
+		*frame_id = th->frame_id;
+	}
+	return th->jpeg;
+}
+
+static void _http_callback_sse_error(struct bufferevent *buf_event, short what, void *v_client) {
+	(void)buf_event;
+
+	us_sse_client_s *const client = v_client;
+	us_server_runtime_s *const run = client->server->run;
+
+	US_LIST_REMOVE_C(run->sse_clients, client, run->sse_clients_count);
+
+	char *const reason = us_bufferevent_format_reason(what);
+	_LOG_INFO("DEL SSE client (now=%u): %s, id=%" PRIx64 ", %s",
+		run->sse_clients_count, client->hostport, client->id, reason);
+	free(reason);
+
+	struct evhttp_connection *conn = evhttp_request_get_connection(client->req);
+	US_DELETE(conn, evhttp_connection_free);
+
+	free(client->hostport);
+	free(client);
+}
+
+static void _http_sse_refresher(int fd, short what, void *v_server) {
+	(void)fd;
+	(void)what;
+
+	us_server_s *const server = v_server;
+	us_server_runtime_s *const run = server->run;
+
+	if (run->sse_clients == NULL) {
+		return;
+	}
+
+	us_server_sse_state_s st;
+	_http_sse_get_state(server, &st);
+	us_server_sse_state_s *const prev = &run->sse_state;
+
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+
+	// FPS шумит, поэтому шлем его только при изменении хотя бы на 10%
+#	define FPS_CHANGED(x_name) ( \
+		st.x_name != prev->x_name \
+		&& (US_MAX(st.x_name, prev->x_name) - US_MIN(st.x_name, prev->x_name)) * 10 >= US_MAX(st.x_name, prev->x_name) \
+	)
+#	define ADD_DELTA(x_fmt, ...) { \
+		_A_EVBUFFER_ADD_PRINTF(buf, "%s" x_fmt, (evbuffer_get_length(buf) == 0 ? "{" : ", "), ##__VA_ARGS__); \
+	}
+
+	if (st.width != prev->width || st.height != prev->height) {
+		ADD_DELTA("\"resolution\": {\"width\": %u, \"height\": %u}", st.width, st.height);
+	}
+	if (st.online != prev->online) {
+		ADD_DELTA("\"online\": %s", us_bool_to_string(st.online));
+	}
+	if (st.enc_type != prev->enc_type || st.enc_quality != prev->enc_quality) {
+		ADD_DELTA("\"encoder\": {\"type\": \"%s\", \"quality\": %u}",
+			us_encoder_type_to_string(st.enc_type), st.enc_quality);
+	}
+	if (FPS_CHANGED(captured_fps)) {
+		ADD_DELTA("\"captured_fps\": %u", st.captured_fps);
+	} else {
+		st.captured_fps = prev->captured_fps;
+	}
+	if (FPS_CHANGED(queued_fps)) {
+		ADD_DELTA("\"queued_fps\": %u", st.queued_fps);
+	} else {
+		st.queued_fps = prev->queued_fps;
+	}
+	if (st.stream_clients != prev->stream_clients) {
+		ADD_DELTA("\"clients\": %u", st.stream_clients);
+	}
+	if (st.ws_clients != prev->ws_clients) {
+		ADD_DELTA("\"ws_clients\": %u", st.ws_clients);
+	}
+
+#	undef ADD_DELTA
+#	undef FPS_CHANGED
+
+	const ldf now_ts = us_get_now_monotonic();
+	if (evbuffer_get_length(buf) > 0) {
+		US_A(!evbuffer_prepend(buf, "event: delta" RN "data: ", strlen("event: delta" RN "data: ")));
+		_A_EVBUFFER_ADD_PRINTF(buf, "}" RN RN);
+		*prev = st;
+	} else if (now_ts - run->sse_last_ts >= US_MAX(server->timeout / 2, 1u)) {
+		// Иначе соединение отвалится по таймауту чтения
+		_A_EVBUFFER_ADD_PRINTF(buf, ": keepalive" RN RN);
+	}
+	if (evbuffer_get_length(buf) > 0) {
+		_http_sse_send(server, buf);
+	}
+	evbuffer_free(buf);
+}
+
+static void _http_sse_get_state(us_server_s *server, us_server_sse_state_s *st) {
+	const us_server_runtime_s *const run = server->run;
+	us_stream_http_s *const http = server->stream->run->http;
+
+	us_fpsi_meta_s captured_meta;
+	st->captured_fps = us_fpsi_get(http->captured_fpsi, &captured_meta);
+	st->width = (server->fake_width ? server->fake_width : captured_meta.width);
+	st->height = (server->fake_height ? server->fake_height : captured_meta.height);
+	st->online = captured_meta.online;
+	us_encoder_get_runtime_params(server->stream->enc, &st->enc_type, &st->enc_quality);
+	st->queued_fps = us_fpsi_get(run->exposed->queued_fpsi, NULL);
+	st->stream_clients = run->stream_clients_count;
+	st->ws_clients = run->ws_clients_count;
+}
+
+static void _http_sse_send_client_event(us_server_s *server, const char *type, u64 id, bool joined) {
+	if (server->run->sse_clients == NULL) {
+		return;
+	}
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	_A_EVBUFFER_ADD_PRINTF(
+		buf,
+		"event: client" RN
+		"data: {\"type\": \"%s\", \"id\": \"%" PRIx64 "\", \"joined\": %s}" RN
+		RN,
+		type, id, us_bool_to_string(joined));
+	_http_sse_send(server, buf);
+	evbuffer_free(buf);
+}
+
+static void _http_sse_send(us_server_s *server, struct evbuffer *buf) {
+	const uz size = evbuffer_get_length(buf);
+	const u8 *const data = evbuffer_pullup(buf, -1);
+	US_LIST_ITERATE(server->run->sse_clients, client, { // cppcheck-suppress constStatement
+		struct evhttp_connection *const conn = evhttp_request_get_connection(client->req);
+		if (conn != NULL) {
+			struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
+			US_A(!bufferevent_write(buf_event, data, size));
+			bufferevent_enable(buf_event, EV_READ|EV_WRITE); // Заодно перевзводит таймаут чтения
+		}
+	});
+	server->run->sse_last_ts = us_get_now_monotonic();
+}
+
+static void _http_add_raw_cors_headers(us_server_s *server, struct evhttp_request *req, struct evbuffer *buf) {
+	// Для ответов, которые пишутся напрямую в сокет мимо evhttp
+	if (us_str_is_ok(server->allow_origin)) {
+		const char *const cors_headers = us_evhttp_get_header(req, "Access-Control-Request-Headers");
+		const char *const cors_method = us_evhttp_get_header(req, "Access-Control-Request-Method");
+
+		_A_EVBUFFER_ADD_PRINTF(
+			buf,
+			"Access-Control-Allow-Origin: %s" RN
+			"Access-Control-Allow-Credentials: true" RN,
+			server->allow_origin);
+
+		if (cors_headers != NULL) {
+			_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Headers: %s" RN, cors_headers);
+		}
+		if (cors_method != NULL) {
+			_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Methods: %s" RN, cors_method);
+		}
+	}
+}
+
+static void _http_set_tcp_nodelay(us_server_s *server, struct bufferevent *buf_event, const char *hostport) {
+	if (server->tcp_nodelay && server->run->ext_fd >= 0) {
+		_LOG_DEBUG("Setting up TCP_NODELAY to the client %s ...", hostport);
+		const evutil_socket_t fd = bufferevent_getfd(buf_event);
+		US_A(fd >= 0);
+		int on = 1;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on)) != 0) {
+			_LOG_PERROR("Can't set TCP_NODELAY to the client %s", hostport);
+		}
+	}
+}
+
+static void _http_stream_set_notsent_lowat(us_stream_client_s *client, struct bufferevent *buf_event) {
+	// С TCP_NOTSENT_LOWAT сокет становится доступным для записи, только когда ядро
+	// почти отправило предыдущий кадр. Колбэк записи берет кадр в этот момент,
+	// поэтому медленный клиент получает самый свежий кадр, а не очередь устаревших.
+	if (client->notsent_lowat == 0 || us_str_is_ok(client->server->unix_path)) {
+		client->notsent_lowat = 0;
+		return;
+	}
+	_LOG_DEBUG("Setting up TCP_NOTSENT_LOWAT=%u to the client %s ...", client->notsent_lowat, client->hostport);
+	const evutil_socket_t fd = bufferevent_getfd(buf_event);
+	US_A(fd >= 0);
+	const int lowat = client->notsent_lowat;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void*)&lowat, sizeof(lowat)) != 0) {
+		_LOG_PERROR("Can't set TCP_NOTSENT_LOWAT to the client %s", client->hostport);
+		client->notsent_lowat = 0;
+	}
+}
+
+static void _http_stream_tune_sndbuf(us_stream_client_s *client, struct bufferevent *buf_event, uz frame_size) {
+	// Дефолтный буфер с автотюнингом вмещает несколько кадров, которые будут
+	// показаны с опозданием. Держим его под один кадр с запасом на заголовки
+	// и пересчитываем, только когда размер кадра заметно поменялся.
+	if (client->notsent_lowat == 0) {
+		return;
+	}
+	const int sndbuf = US_MAX(frame_size + client->notsent_lowat, (uz)16384);
+	if (sndbuf <= client->sndbuf && sndbuf * 2 >= client->sndbuf) {
+		return;
+	}
+	const evutil_socket_t fd = bufferevent_getfd(buf_event);
+	US_A(fd >= 0);
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void*)&sndbuf, sizeof(sndbuf)) != 0) {
+		_LOG_PERROR("Can't set SO_SNDBUF to the client %s", client->hostport);
+		client->notsent_lowat = 0; // Больше не пытаемся
+		return;
+	}
+	_LOG_DEBUG("Using SO_SNDBUF=%d for the client %s", sndbuf, client->hostport);
+	client->sndbuf = sndbuf;
+}
+
+static void _http_update_has_clients(us_server_s *server) {
+	const us_server_runtime_s *const run = server->run;
+	const bool has_clients = (run->stream_clients_count > 0 || run->ws_clients_count > 0);
+	atomic_store(&server->stream->run->http->has_clients, has_clients);
+#	ifdef WITH_GPIO
+	// Пин один на весь процесс, поэтому учитываем клиентов всех устройств
+	const us_server_s *const root = (server->parent != NULL ? server->parent : server);
+	bool any_clients = atomic_load(&root->stream->run->http->has_clients);
+	for (uint i = 0; i < root->n_mounts; ++i) {
+		any_clients = (any_clients || atomic_load(&root->mounts[i]->stream->run->http->has_clients));
+	}
+	us_gpio_set_has_http_clients(any_clients);
+#	endif
+}
+
+static void _http_add_frame_data(us_server_s *server, struct evbuffer *buf, const us_frame_s *frame) {
+	// Текущий кадр отдаем из memfd через sendfile(), чтобы ядро не гоняло
+	// его через юзерспейс для каждого клиента. Превью и прочее - обычным копированием.
+	if (frame == server->run->exposed->frame && frame->used > 0) {
+		struct evbuffer_file_segment *const seg = _http_get_frame_segment(server);
+		if (seg != NULL) {
+			US_A(!evbuffer_add_file_segment(buf, seg, 0, frame->used));
+			return;
+		}
+	}
+	_A_EVBUFFER_ADD(buf, (void*)frame->data, frame->used);
+}
+
+static struct evbuffer_file_segment *_http_get_frame_segment(us_server_s *server) {
+	us_server_runtime_s *const run = server->run;
+	us_server_exposed_s *const ex = run->exposed;
+
+	if (ex->seg != NULL && ex->seg_frame_id == ex->frame_id) {
+		return ex->seg;
+	}
+	// Сегмент освободится, когда его допишут все клиенты, и тогда memfd вернется в пул
+	US_DELETE(ex->seg, evbuffer_file_segment_free);
+	if (run->memfd_failed) {
+		return NULL;
+	}
+
+	us_server_memfd_s *memfd = NULL;
+	for (uint i = 0; i < US_ARRAY_LEN(run->memfds) && memfd == NULL; ++i) {
+		if (!run->memfds[i].busy) {
+			memfd = &run->memfds[i];
+		}
+	}
+	if (memfd == NULL) {
+		_LOG_DEBUG("All memfds are busy with slow clients, falling back to copying");
+		return NULL;
+	}
+
+	// Запечатать memfd от записи нельзя: печать необратима, а нам нужно переиспользовать его.
+	// Вместо этого в него не пишем, пока на него ссылается хоть один сегмент.
+	if (memfd->fd < 0) {
+		if ((memfd->fd = memfd_create("us-http-frame", MFD_CLOEXEC)) < 0) {
+			_LOG_PERROR("Can't create memfd, sendfile() is disabled");
+			run->memfd_failed = true;
+			return NULL;
+		}
+		memfd->allocated = 0;
+	}
+	const us_frame_s *const frame = ex->frame;
+	if (memfd->allocated < frame->used) {
+		if (ftruncate(memfd->fd, frame->used) < 0) {
+			_LOG_PERROR("Can't resize memfd");
+			return NULL;
+		}
+		memfd->allocated = frame->used;
+	}
+	if (pwrite(memfd->fd, frame->data, frame->used, 0) != (ssize_t)frame->used) {
+		_LOG_PERROR("Can't write frame to memfd");
+		return NULL;
+	}
+
+	if ((ex->seg = evbuffer_file_segment_new(memfd->fd, 0, frame->used, EVBUF_FS_DISABLE_LOCKING)) == NULL) {
+		_LOG_ERROR("Can't create file segment for memfd");
+		return NULL;
+	}
+	evbuffer_file_segment_add_cleanup_cb(ex->seg, _http_memfd_release, memfd);
+	memfd->busy = true;
+	ex->seg_frame_id = ex->frame_id;
+	return ex->seg;
+}
+
+static void _http_memfd_release(const struct evbuffer_file_segment *seg, int flags, void *v_memfd) {
+	(void)seg;
+	(void)flags;
+	us_server_memfd_s *const memfd = v_memfd;
+	memfd->busy = false;
+}
+
+static us_server_s *_server_init(us_stream_s *stream) {
+	us_server_exposed_s *exposed;
+	US_CALLOC(exposed, 1);
+	exposed->frame = us_frame_init();
+	exposed->queued_fpsi = us_fpsi_init("MJPEG-QUEUED", false);
+	exposed->frame_id = us_get_now_id(); // Случайная база, чтобы ETag не повторялись после рестарта
+
+	us_server_runtime_s *run;
+	US_CALLOC(run, 1);
+	run->ext_fd = -1;
+	run->exposed = exposed;
+	run->snapshot_frame = us_frame_init();
+	for (uint i = 0; i < US_ARRAY_LEN(run->thumbs); ++i) {
+		run->thumbs[i].jpeg = us_frame_init();
+	}
+	for (uint i = 0; i < US_ARRAY_LEN(run->memfds); ++i) {
+		run->memfds[i].fd = -1;
+	}
+
+	us_server_s *server;
+	US_CALLOC(server, 1);
+	server->host = "127.0.0.1";
+	server->port = 8080;
+	server->unix_path = "";
+	server->user = "";
+	server->passwd = "";
+	server->static_path = "";
+	server->allow_origin = "";
+	server->instance_id = "";
+	server->timeout = 10;
+	server->stream = stream;
+	server->run = run;
+	return server;
+}
+
+static void _server_destroy_events(us_server_s *server) {
+	us_server_runtime_s *const run = server->run;
+	US_DELETE(run->thumbs_worker, us_thumbs_destroy); // Activates the refresher
+	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
+		US_DELETE(client->pending_timer, event_free);
+	});
+	if (run->refresher != NULL) {
+		event_del(run->refresher);
+		US_DELETE(run->refresher, event_free);
+	}
+	if (run->sse_refresher != NULL) {
+		event_del(run->sse_refresher);
+		US_DELETE(run->sse_refresher, event_free);
+	}
+}
+
+static void _server_destroy(us_server_s *server) {
+	us_server_runtime_s *const run = server->run;
+
+	US_LIST_ITERATE(run->snapshot_clients, client, { // cppcheck-suppress constStatement
+		free(client);
+	});
+
+	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
+		us_fpsi_destroy(client->fpsi);
+		free(client->key);
+		free(client->hostport);
+		free(client);
+	});
+
+	US_LIST_ITERATE(run->ws_clients, client, { // cppcheck-suppress constStatement
+		us_fpsi_destroy(client->fpsi);
+		free(client->hostport);
+		free(client);
+	});
+
+	US_LIST_ITERATE(run->sse_clients, client, { // cppcheck-suppress constStatement
+		free(client->hostport);
+		free(client);
+	});
+
+	US_DELETE(run->auth_token, free);
+
+	US_DELETE(run->exposed->seg, evbuffer_file_segment_free);
+	for (uint i = 0; i < US_ARRAY_LEN(run->memfds); ++i) {
+		US_CLOSE_FD(run->memfds[i].fd);
+	}
+
+	us_fpsi_destroy(run->exposed->queued_fpsi);
+	us_frame_destroy(run->exposed->frame);
+	free(run->exposed);
+	us_frame_destroy(run->snapshot_frame);
+	for (uint i = 0; i < US_ARRAY_LEN(run->thumbs); ++i) {
+		us_frame_destroy(run->thumbs[i].jpeg);
+	}
+	free(server->run);
+	free(server);
+}
+
+static void _http_inherit(us_server_s *mount, const us_server_s *server) {
+	// Монтированный сервер работает в том же evhttp, поэтому и настройки у него те же
+	mount->unix_path = server->unix_path;
+	mount->tcp_nodelay = server->tcp_nodelay;
+	mount->tcp_notsent_lowat = server->tcp_notsent_lowat;
+	mount->timeout = server->timeout;
+	mount->user = server->user;
+	mount->passwd = server->passwd;
+	mount->allow_origin = server->allow_origin;
+	mount->instance_id = server->instance_id;
+	mount->drop_same_frames = server->drop_same_frames;
+	mount->fake_width = server->fake_width;
+	mount->fake_height = server->fake_height;
+
+	mount->run->base = server->run->base;
+	mount->run->http = server->run->http;
+	if (server->run->auth_token != NULL) {
+		mount->run->auth_token = us_strdup(server->run->auth_token);
+	}
+}
+
+static void _http_setup(us_server_s *server) {
+	us_server_runtime_s *const run = server->run;
+	us_server_exposed_s *const ex = run->exposed;
+	us_stream_s *const stream = server->stream;
+
+	char *prefix;
+	if (server->mount_name != NULL) {
+		US_ASPRINTF(prefix, "/%s", server->mount_name);
+	} else {
+		prefix = us_strdup("");
+	}
+
+#	define ADD_CB(x_path, x_cb) { \
+			char *m_path; \
+			US_ASPRINTF(m_path, "%s" x_path, prefix); \
+			US_A(!evhttp_set_cb(run->http, m_path, x_cb, (void*)server)); \
+			free(m_path); \
+		}
+	if (server->mount_name != NULL) {
+		ADD_CB("/", _http_callback_root);
+	}
+	ADD_CB("/state", _http_callback_state);
+	ADD_CB("/state/events", _http_callback_state_events);
+	ADD_CB("/snapshot", _http_callback_snapshot);
+	ADD_CB("/stream", _http_callback_stream);
+	ADD_CB("/ws", _http_callback_ws);
+#	undef ADD_CB
+	free(prefix);
+
+	us_frame_copy(stream->run->blank->jpeg, ex->frame);
+
+	US_A((run->refresher = event_new(run->base, -1, 0, _http_refresher, server)) != NULL);
+	stream->run->http->jpeg_refresher = run->refresher;
+	run->thumbs_worker = us_thumbs_init(run->refresher);
+
+	{
+		US_A((run->sse_refresher = event_new(run->base, -1, EV_PERSIST, _http_sse_refresher, server)) != NULL);
+		struct timeval interval = {.tv_sec = 1};
+		US_A(!event_add(run->sse_refresher, &interval));
+	}
+}
+
+static bool _expose_frame(us_server_s *server, us_frame_s **frame_ptr) {
 	us_server_exposed_s *const ex = server->run->exposed;
+	us_frame_s *const frame = *frame_ptr;
 
 	_LOG_DEBUG("Updating exposed frame (online=%d) ...", frame->online);
 	ex->expose_begin_ts = us_get_now_monotonic();
@@ -982,8 +2155,12 @@ static bool _expose_frame(us_server_s *server, const us_frame_s *frame) {
 		// что у нас уже есть, с поправкой на онлайн.
 		ex->frame->online = frame->online;
 	} else {
-		us_frame_copy(frame, ex->frame);
+		// Вместо копирования меняемся фреймами с кольцом,
+		// старый exposed будет перезаписан продюсером.
+		*frame_ptr = ex->frame;
+		ex->frame = frame;
 	}
+	++ex->frame_id;
 
 	ex->dropped = 0;
 	ex->expose_cmp_ts = ex->expose_begin_ts;
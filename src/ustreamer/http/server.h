@@ -27,14 +27,22 @@
 #include <event2/util.h>
 #include <event2/event.h>
 #include <event2/http.h>
+#include <event2/buffer.h>
 
 #include "../../libs/types.h"
 #include "../../libs/frame.h"
+#include "../../libs/pacer.h"
 #include "../../libs/list.h"
 #include "../../libs/fpsi.h"
 #include "../encoder.h"
 #include "../stream.h"
 
+#include "static.h"
+#include "thumbs.h"
+
+
+#define US_SERVER_MAX_MOUNTS 3
+
 
 typedef struct {
 	struct us_server_sx		*server;
@@ -45,6 +53,11 @@ typedef struct {
 	bool	advance_headers;
 	bool	dual_final_frames;
 	bool	zero_data;
+	uint	thumb;
+	uint	fps;
+	uint	maxrate; // Kbps
+	uint	notsent_lowat;
+	int		sndbuf;
 
 	char	*hostport;
 	u64		id;
@@ -52,6 +65,15 @@ typedef struct {
 	bool	need_first_frame;
 	bool	updated_prev;
 
+	us_pacer_s	pacer;
+	ldf			tokens; // Bytes
+	ldf			tokens_ts;
+	bool		pending; // The latest frame was skipped by the limits
+	struct event *pending_timer;
+	uz			rate_bytes;
+	ldf			rate_ts;
+	uint		rate; // Kbps
+
 	us_fpsi_s *fpsi;
 
 	US_LIST_DECLARE;
@@ -62,13 +84,76 @@ typedef struct {
 	struct evhttp_request	*req;
 	ldf						req_ts;
 
+	uint	quality;
+	uint	width;
+	u64		raw_id;
+	uint	thumb;
+
 	US_LIST_DECLARE;
 } us_snapshot_client_s;
 
+#define US_WS_MAX_WINDOW 8
+
+typedef struct {
+	struct us_server_sx		*server;
+	struct evhttp_request	*req;
+
+	uint	window;
+	uint	thumb;
+
+	char	*hostport;
+	u64		id;
+	u32		sent_seq;
+	u32		acked_seq;
+	ldf		sent_ts[US_WS_MAX_WINDOW]; // By seq, for RTT
+	ldf		rtt;
+	u64		frame_id; // Of the last sent exposed frame
+	uint	skipped;
+	bool	closing;
+
+	us_fpsi_s *fpsi;
+
+	US_LIST_DECLARE;
+} us_ws_client_s;
+
+typedef struct {
+	struct us_server_sx		*server;
+	struct evhttp_request	*req;
+
+	char	*hostport;
+	u64		id;
+
+	US_LIST_DECLARE;
+} us_sse_client_s;
+
+typedef struct {
+	uint				width;
+	uint				height;
+	bool				online;
+	us_encoder_type_e	enc_type;
+	uint				enc_quality;
+	uint				captured_fps;
+	uint				queued_fps;
+	uint				stream_clients;
+	uint				ws_clients;
+} us_server_sse_state_s;
+
+#define US_SERVER_MEMFD_POOL 4
+
+typedef struct {
+	int		fd;
+	uz		allocated;
+	bool	busy; // Referenced by the file segment
+} us_server_memfd_s;
+
 typedef struct {
 	us_frame_s	*frame;
+	u64			frame_id; // For ETag
 	us_fpsi_s	*queued_fpsi;
 	uint		dropped;
+
+	struct evbuffer_file_segment *seg; // The frame in memfd for sendfile()
+	u64			seg_frame_id;
 	ldf			expose_begin_ts;
 	ldf			expose_cmp_ts;
 	ldf			expose_end_ts;
@@ -80,6 +165,7 @@ typedef struct {
 	evutil_socket_t		ext_fd; // Unix or socket activation
 
 	char				*auth_token;
+	us_static_cache_s	*static_cache;
 
 	struct event		*refresher;
 	us_server_exposed_s	*exposed;
@@ -87,7 +173,23 @@ typedef struct {
 	us_stream_client_s	*stream_clients;
 	uint				stream_clients_count;
 
+	us_ws_client_s		*ws_clients;
+	uint				ws_clients_count;
+
+	us_sse_client_s		*sse_clients;
+	uint				sse_clients_count;
+	struct event		*sse_refresher;
+	us_server_sse_state_s sse_state; // Last sent
+	ldf					sse_last_ts;
+
 	us_snapshot_client_s *snapshot_clients;
+	us_frame_s			*snapshot_frame;
+
+	us_server_memfd_s	memfds[US_SERVER_MEMFD_POOL];
+	bool				memfd_failed;
+
+	us_thumbs_s			*thumbs_worker;
+	us_thumb_s			thumbs[US_THUMBS_N]; // The latest ready ones, for the loop
 } us_server_runtime_s;
 
 typedef struct us_server_sx {
@@ -105,6 +207,7 @@ typedef struct us_server_sx {
 #	endif
 
 	bool	tcp_nodelay;
+	uint	tcp_notsent_lowat;
 	uint	timeout;
 
 	char	*user;
@@ -117,11 +220,18 @@ typedef struct us_server_sx {
 	uint	fake_width;
 	uint	fake_height;
 
+	// Дополнительные устройства на том же порту под /<name>/...
+	const char				*mount_name; // NULL for the main server
+	struct us_server_sx		*parent;
+	struct us_server_sx		*mounts[US_SERVER_MAX_MOUNTS];
+	uint					n_mounts;
+
 	us_server_runtime_s *run;
 } us_server_s;
 
 
 us_server_s *us_server_init(us_stream_s *stream);
+us_server_s *us_server_add_mount(us_server_s *server, us_stream_s *stream, const char *name);
 void us_server_destroy(us_server_s *server);
 
 int us_server_listen(us_server_s *server);
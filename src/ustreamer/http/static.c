@@ -26,13 +26,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
 #include <sys/stat.h>
+#include <sys/inotify.h>
 
+#include <zlib.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "../../libs/types.h"
 #include "../../libs/tools.h"
 #include "../../libs/logging.h"
+#include "../../libs/list.h"
 
 #include "path.h"
+#include "mime.h"
+
+
+static us_static_entry_s *_static_entry_load(us_static_cache_s *cache, const char *req_path);
+static bool _static_watch(us_static_cache_s *cache, const char *path);
+static uz _static_variant_size(const char *path, const struct stat *fresh_st);
+static void _static_entry_destroy(us_static_entry_s *entry);
+static us_static_blob_s *_static_blob_load(const char *path, const struct stat *fresh_st, struct stat *st);
+static us_static_blob_s *_static_blob_gzip(const us_static_blob_s *plain);
+static void _static_blob_unref(us_static_blob_s *blob);
+static void _static_blob_cleanup(const void *data, size_t data_len, void *v_blob);
+static void _static_inotify_callback(int fd, short what, void *v_cache);
+static void _static_cache_clear(us_static_cache_s *cache);
 
 
 char *us_find_static_file_path(const char *root_path, const char *req_path) {
@@ -81,3 +105,337 @@ ok:
 	free(simplified_path);
 	return path;
 }
+
+us_static_cache_s *us_static_cache_init(struct event_base *base, const char *root_path) {
+	us_static_cache_s *cache;
+	US_CALLOC(cache, 1);
+	cache->root_path = us_strdup(root_path);
+	if ((cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		US_LOG_PERROR("HTTP: Can't create inotify for the static cache, caching is disabled");
+	} else {
+		US_A((cache->inotify_event = event_new(base, cache->inotify_fd,
+			EV_READ | EV_PERSIST, _static_inotify_callback, cache)) != NULL);
+		US_A(!event_add(cache->inotify_event, NULL));
+	}
+	return cache;
+}
+
+void us_static_cache_destroy(us_static_cache_s *cache) {
+	_static_cache_clear(cache);
+	if (cache->inotify_event != NULL) {
+		event_del(cache->inotify_event);
+		event_free(cache->inotify_event);
+	}
+	US_CLOSE_FD(cache->inotify_fd);
+	free(cache->root_path);
+	free(cache);
+}
+
+const us_static_entry_s *us_static_cache_get(us_static_cache_s *cache, const char *req_path) {
+	// NULL означает, что кеш не работает (нет inotify или переполнена таблица ненайденных),
+	// и файл нужно искать и отдавать с диска как обычно. Запись без plain означает,
+	// что файл известен, но не закеширован: при path == NULL его нет вовсе.
+
+	if (cache->inotify_fd < 0) {
+		return NULL;
+	}
+
+	char *const simplified_path = us_simplify_request_path(req_path);
+	us_static_entry_s *found = NULL;
+	US_LIST_ITERATE(cache->entries, entry, { // cppcheck-suppress constStatement
+		if (found == NULL && !strcmp(entry->req_path, simplified_path)) {
+			found = entry;
+		}
+	});
+	if (found == NULL && us_str_is_ok(simplified_path)) {
+		found = _static_entry_load(cache, simplified_path);
+	}
+	free(simplified_path);
+	return found;
+}
+
+void us_static_blob_add_to_evbuffer(us_static_blob_s *blob, struct evbuffer *buf) {
+	// Без копирования: буфер держит ссылку на блоб, пока данные не отправлены,
+	// даже если кеш за это время был сброшен.
+	++blob->refs;
+	US_A(!evbuffer_add_reference(buf, blob->data, blob->size, _static_blob_cleanup, blob));
+}
+
+static us_static_entry_s *_static_entry_load(us_static_cache_s *cache, const char *req_path) {
+	// Ненайденные, слишком большие и не влезшие в кеш файлы тоже запоминаются,
+	// но без содержимого, чтобы не искать и не читать их на каждый запрос.
+	// Любое событие inotify сбрасывает кеш целиком вместе с такими записями.
+
+	us_static_entry_s *entry;
+	US_CALLOC(entry, 1);
+	entry->req_path = us_strdup(req_path);
+	entry->path = us_find_static_file_path(cache->root_path, req_path);
+
+	if (entry->path == NULL) {
+		char *wanted_path;
+		US_ASPRINTF(wanted_path, "%s/%s", cache->root_path, req_path);
+		const bool watched = _static_watch(cache, wanted_path);
+		free(wanted_path);
+		if (!watched) {
+			goto error;
+		}
+		goto uncached;
+	}
+	if (!_static_watch(cache, entry->path)) {
+		goto error;
+	}
+	entry->mime_type = us_guess_mime_type(entry->path);
+
+	struct stat st;
+	if (stat(entry->path, &st) < 0) {
+		US_LOG_PERROR("HTTP: Can't stat() found static file %s", entry->path);
+		goto uncached;
+	}
+	if (st.st_size > US_STATIC_CACHE_MAX_FILE_SIZE) {
+		US_LOG_VERBOSE("HTTP: Static file %s is too big for the cache, serving from disk", entry->path);
+		goto uncached;
+	}
+
+	// Размеры проверяем до чтения, чтобы не читать файлы, которые не влезут в кеш
+	char *gzip_path;
+	char *brotli_path;
+	US_ASPRINTF(gzip_path, "%s.gz", entry->path);
+	US_ASPRINTF(brotli_path, "%s.br", entry->path);
+	const uz gzip_size = _static_variant_size(gzip_path, &st);
+	const uz brotli_size = _static_variant_size(brotli_path, &st);
+	if (cache->size + st.st_size + gzip_size + brotli_size > US_STATIC_CACHE_MAX_SIZE) {
+		US_LOG_VERBOSE("HTTP: Static cache is full, serving %s from disk", entry->path);
+		free(gzip_path);
+		free(brotli_path);
+		goto uncached;
+	}
+
+	if ((entry->plain = _static_blob_load(entry->path, NULL, &st)) != NULL) {
+		struct stat variant_st;
+		if (gzip_size > 0) {
+			entry->gzip = _static_blob_load(gzip_path, &st, &variant_st);
+		}
+		if (brotli_size > 0) {
+			entry->brotli = _static_blob_load(brotli_path, &st, &variant_st);
+		}
+	}
+	free(gzip_path);
+	free(brotli_path);
+	if (entry->plain == NULL) {
+		goto uncached;
+	}
+
+	if (
+		entry->gzip == NULL
+		&& entry->plain->size >= US_STATIC_CACHE_MIN_GZIP_SIZE
+		&& us_is_compressible_mime_type(entry->mime_type)
+	) {
+		// Готового file.gz нет, так что сжимаем сами. Это делается один раз
+		// при заполнении кеша, а не на каждый запрос.
+		entry->gzip = _static_blob_gzip(entry->plain);
+		if (entry->gzip != NULL && cache->size + st.st_size + entry->gzip->size + brotli_size > US_STATIC_CACHE_MAX_SIZE) {
+			US_DELETE(entry->gzip, _static_blob_unref);
+		}
+	}
+
+	cache->size += entry->plain->size;
+	cache->size += (entry->gzip != NULL ? entry->gzip->size : 0);
+	cache->size += (entry->brotli != NULL ? entry->brotli->size : 0);
+
+	// Сжатые варианты - это другие представления ресурса, им нужны свои ETag
+#	define MAKE_ETAG(x_dest, x_suffix) US_SNPRINTF(entry->x_dest, 63, "\"%llx-%llx" x_suffix "\"", \
+		(unsigned long long)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000, \
+		(unsigned long long)st.st_size)
+	MAKE_ETAG(etag, "");
+	MAKE_ETAG(etag_gzip, "-gz");
+	MAKE_ETAG(etag_brotli, "-br");
+#	undef MAKE_ETAG
+	struct tm tm;
+	US_A(gmtime_r(&st.st_mtim.tv_sec, &tm) != NULL);
+	US_A(strftime(entry->last_modified, 63, "%a, %d %b %Y %H:%M:%S GMT", &tm) > 0);
+
+	US_LIST_APPEND(cache->entries, entry);
+	US_LOG_VERBOSE("HTTP: Cached static file %s: size=%zu, gzip=%zu, brotli=%zu",
+		entry->path, entry->plain->size,
+		(entry->gzip != NULL ? entry->gzip->size : 0),
+		(entry->brotli != NULL ? entry->brotli->size : 0));
+	return entry;
+
+uncached:
+	if (cache->n_uncached >= US_STATIC_CACHE_MAX_UNCACHED) {
+		goto error; // Random request paths must not grow the cache forever
+	}
+	US_DELETE(entry->plain, _static_blob_unref);
+	++cache->n_uncached;
+	US_LIST_APPEND(cache->entries, entry);
+	return entry;
+
+error:
+	_static_entry_destroy(entry);
+	return NULL;
+}
+
+static bool _static_watch(us_static_cache_s *cache, const char *path) {
+	// Следим за каталогом, а не за файлом: редакторы и деплой часто
+	// заменяют файл целиком через rename(), и вотч на файл бы потерялся.
+	// Для ненайденного файла берем ближайший существующий каталог,
+	// чтобы заметить создание недостающих подкаталогов.
+	char *const dir_path = us_strdup(path);
+	const uz root_len = strlen(cache->root_path);
+	bool ok = false;
+	char *slash;
+	while ((slash = strrchr(dir_path, '/')) != NULL && (uz)(slash - dir_path) >= root_len) {
+		*slash = '\0';
+		if (inotify_add_watch(cache->inotify_fd, dir_path,
+			IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+			| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF) >= 0
+		) {
+			ok = true;
+			break;
+		}
+		if (errno != ENOENT && errno != ENOTDIR) {
+			US_LOG_PERROR("HTTP: Can't watch static directory %s", dir_path);
+			break;
+		}
+	}
+	free(dir_path);
+	return ok;
+}
+
+static uz _static_variant_size(const char *path, const struct stat *fresh_st) {
+	// Ноль, если сжатого варианта нет, он устарел или слишком большой
+	struct stat st;
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > US_STATIC_CACHE_MAX_FILE_SIZE) {
+		return 0;
+	}
+	if (
+		st.st_mtim.tv_sec < fresh_st->st_mtim.tv_sec
+		|| (st.st_mtim.tv_sec == fresh_st->st_mtim.tv_sec && st.st_mtim.tv_nsec < fresh_st->st_mtim.tv_nsec)
+	) {
+		US_LOG_VERBOSE("HTTP: Ignoring stale precompressed static file %s", path);
+		return 0;
+	}
+	return st.st_size;
+}
+
+static void _static_entry_destroy(us_static_entry_s *entry) {
+	US_DELETE(entry->plain, _static_blob_unref);
+	US_DELETE(entry->gzip, _static_blob_unref);
+	US_DELETE(entry->brotli, _static_blob_unref);
+	free(entry->path);
+	free(entry->req_path);
+	free(entry);
+}
+
+static us_static_blob_s *_static_blob_load(const char *path, const struct stat *fresh_st, struct stat *st) {
+	// Если задан fresh_st, то это сжатый вариант, который должен быть не старше исходника
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (fresh_st == NULL) {
+			US_LOG_PERROR("HTTP: Can't open found static file %s", path);
+		}
+		return NULL;
+	}
+
+	us_static_blob_s *blob = NULL;
+	if (fstat(fd, st) < 0) {
+		US_LOG_PERROR("HTTP: Can't stat() static file %s", path);
+		goto error;
+	}
+	if (!S_ISREG(st->st_mode) || st->st_size > US_STATIC_CACHE_MAX_FILE_SIZE) {
+		goto error;
+	}
+	if (fresh_st != NULL && (
+		st->st_mtim.tv_sec < fresh_st->st_mtim.tv_sec
+		|| (st->st_mtim.tv_sec == fresh_st->st_mtim.tv_sec && st->st_mtim.tv_nsec < fresh_st->st_mtim.tv_nsec)
+	)) {
+		US_LOG_VERBOSE("HTTP: Ignoring stale precompressed static file %s", path);
+		goto error;
+	}
+
+	US_A((blob = malloc(sizeof(us_static_blob_s) + st->st_size)) != NULL);
+	blob->refs = 1;
+	blob->size = 0;
+	while (blob->size < (uz)st->st_size) {
+		const ssize_t retval = read(fd, blob->data + blob->size, st->st_size - blob->size);
+		if (retval <= 0) {
+			US_LOG_PERROR("HTTP: Can't read static file %s", path);
+			goto error;
+		}
+		blob->size += retval;
+	}
+	US_CLOSE_FD(fd);
+	return blob;
+
+error:
+	US_DELETE(blob, free);
+	close(fd);
+	return NULL;
+}
+
+static us_static_blob_s *_static_blob_gzip(const us_static_blob_s *plain) {
+	z_stream z = {0};
+	// 15 + 16: окно 32K и обертка gzip вместо zlib для Content-Encoding: gzip
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		US_LOG_ERROR("HTTP: Can't initialize gzip for the static cache");
+		return NULL;
+	}
+	const uLong bound = deflateBound(&z, plain->size);
+
+	us_static_blob_s *blob;
+	US_A((blob = malloc(sizeof(us_static_blob_s) + bound)) != NULL);
+	blob->refs = 1;
+	z.next_in = (Bytef*)plain->data;
+	z.avail_in = plain->size;
+	z.next_out = blob->data;
+	z.avail_out = bound;
+	const int retval = deflate(&z, Z_FINISH);
+	blob->size = z.total_out;
+	deflateEnd(&z);
+
+	if (retval != Z_STREAM_END || blob->size >= plain->size) {
+		free(blob);
+		return NULL;
+	}
+	US_A((blob = realloc(blob, sizeof(us_static_blob_s) + blob->size)) != NULL);
+	return blob;
+}
+
+static void _static_blob_unref(us_static_blob_s *blob) {
+	US_A(blob->refs > 0);
+	if (--blob->refs == 0) {
+		free(blob);
+	}
+}
+
+static void _static_blob_cleanup(const void *data, size_t data_len, void *v_blob) {
+	(void)data;
+	(void)data_len;
+	_static_blob_unref(v_blob);
+}
+
+static void _static_inotify_callback(int fd, short what, void *v_cache) {
+	(void)what;
+	us_static_cache_s *const cache = v_cache;
+
+	// Подробности событий не важны, любое изменение сбрасывает кеш целиком:
+	// статика меняется редко, а так не нужно следить за связью вотчей и файлов.
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	while (read(fd, events, sizeof(events)) > 0) {
+		changed = true;
+	}
+	if (changed && cache->entries != NULL) {
+		US_LOG_VERBOSE("HTTP: Static files changed, clearing the cache");
+		_static_cache_clear(cache);
+	}
+}
+
+static void _static_cache_clear(us_static_cache_s *cache) {
+	US_LIST_ITERATE(cache->entries, entry, { // cppcheck-suppress constStatement
+		US_LIST_REMOVE(cache->entries, entry);
+		_static_entry_destroy(entry);
+	});
+	cache->size = 0;
+	cache->n_uncached = 0;
+}
@@ -22,5 +22,54 @@
 
 #pragma once
 
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "../../libs/types.h"
+#include "../../libs/list.h"
+
+
+#define US_STATIC_CACHE_MAX_FILE_SIZE	(4 * 1024 * 1024)
+#define US_STATIC_CACHE_MAX_SIZE		(64 * 1024 * 1024)
+#define US_STATIC_CACHE_MAX_UNCACHED	1024
+#define US_STATIC_CACHE_MIN_GZIP_SIZE	256
+
+
+typedef struct {
+	uint	refs;
+	uz		size;
+	u8		data[];
+} us_static_blob_s;
+
+typedef struct us_static_entry_sx {
+	char				*req_path;
+	char				*path; // NULL if the file is not found
+	const char			*mime_type;
+	us_static_blob_s	*plain; // NULL if the file is not found, too big or the cache is full
+	us_static_blob_s	*gzip; // Precompressed file.gz, if exists and fresh, or compressed on load
+	us_static_blob_s	*brotli; // Same for file.br
+	char				etag[64];
+	char				etag_gzip[64];
+	char				etag_brotli[64];
+	char				last_modified[64];
+
+	US_LIST_DECLARE;
+} us_static_entry_s;
+
+typedef struct {
+	char				*root_path;
+	int					inotify_fd;
+	struct event		*inotify_event;
+	us_static_entry_s	*entries;
+	uz					size;
+	uint				n_uncached;
+} us_static_cache_s;
+
 
 char *us_find_static_file_path(const char *root_path, const char *req_path);
+
+us_static_cache_s *us_static_cache_init(struct event_base *base, const char *root_path);
+void us_static_cache_destroy(us_static_cache_s *cache);
+
+const us_static_entry_s *us_static_cache_get(us_static_cache_s *cache, const char *req_path);
+void us_static_blob_add_to_evbuffer(us_static_blob_s *blob, struct evbuffer *buf);
@@ -0,0 +1,164 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "thumbs.h"
+
+#include <pthread.h>
+#include <event2/event.h>
+
+#include "../../libs/types.h"
+#include "../../libs/tools.h"
+#include "../../libs/threading.h"
+#include "../../libs/logging.h"
+#include "../../libs/frame.h"
+#include "../../libs/unjpeg.h"
+
+#include "../encoders/cpu/encoder.h"
+#include "../sched.h"
+
+
+static void *_thumbs_thread(void *v_thumbs);
+
+
+us_thumbs_s *us_thumbs_init(struct event *done_ev) {
+	us_thumbs_s *thumbs;
+	US_CALLOC(thumbs, 1);
+	thumbs->done_ev = done_ev;
+	US_MUTEX_INIT(thumbs->mutex);
+	US_COND_INIT(thumbs->cond);
+	thumbs->src = us_frame_init();
+	for (uint i = 0; i < US_THUMBS_N; ++i) {
+		thumbs->ready[i].jpeg = us_frame_init();
+	}
+	thumbs->work_src = us_frame_init();
+	thumbs->rgb = us_frame_init();
+	thumbs->jpeg = us_frame_init();
+	return thumbs;
+}
+
+void us_thumbs_destroy(us_thumbs_s *thumbs) {
+	if (thumbs->started) {
+		US_MUTEX_LOCK(thumbs->mutex);
+		thumbs->stop = true;
+		US_COND_SIGNAL(thumbs->cond);
+		US_MUTEX_UNLOCK(thumbs->mutex);
+		US_THREAD_JOIN(thumbs->tid);
+	}
+	us_frame_destroy(thumbs->jpeg);
+	us_frame_destroy(thumbs->rgb);
+	us_frame_destroy(thumbs->work_src);
+	for (uint i = 0; i < US_THUMBS_N; ++i) {
+		us_frame_destroy(thumbs->ready[i].jpeg);
+	}
+	us_frame_destroy(thumbs->src);
+	US_COND_DESTROY(thumbs->cond);
+	US_MUTEX_DESTROY(thumbs->mutex);
+	free(thumbs);
+}
+
+uint us_thumbs_get_index(uint thumb) {
+	US_A(thumb == 2 || thumb == 4 || thumb == 8);
+	return (thumb == 2 ? 0 : (thumb == 4 ? 1 : 2));
+}
+
+void us_thumbs_request(us_thumbs_s *thumbs, const us_frame_s *frame, u64 frame_id, uint thumb, uint quality) {
+	// Поток запускается только при первом запросе миниатюры
+	if (!thumbs->started) {
+		US_THREAD_CREATE(thumbs->tid, _thumbs_thread, thumbs);
+		thumbs->started = true;
+	}
+
+	const uint bit = 1 << us_thumbs_get_index(thumb);
+	US_MUTEX_LOCK(thumbs->mutex);
+	if (thumbs->src_id != frame_id) {
+		// Воркер еще не взял предыдущий кадр, он уже не нужен
+		us_frame_copy(frame, thumbs->src);
+		thumbs->src_id = frame_id;
+		thumbs->src_quality = quality;
+		thumbs->wanted = 0;
+	}
+	if (thumbs->ready[us_thumbs_get_index(thumb)].frame_id != frame_id) {
+		thumbs->wanted |= bit;
+		US_COND_SIGNAL(thumbs->cond);
+	}
+	US_MUTEX_UNLOCK(thumbs->mutex);
+}
+
+bool us_thumbs_get(us_thumbs_s *thumbs, uint thumb, u64 after_id, us_frame_s *dest, u64 *frame_id) {
+	bool found = false;
+	US_MUTEX_LOCK(thumbs->mutex);
+	const us_thumb_s *const th = &thumbs->ready[us_thumbs_get_index(thumb)];
+	if (th->jpeg->used > 0 && th->frame_id != after_id) {
+		us_frame_copy(th->jpeg, dest);
+		*frame_id = th->frame_id;
+		found = true;
+	}
+	US_MUTEX_UNLOCK(thumbs->mutex);
+	return found;
+}
+
+static void *_thumbs_thread(void *v_thumbs) {
+	US_THREAD_SETTLE("http_thumb");
+	us_sched_apply(&us_g_sched.encoder);
+	us_thumbs_s *const thumbs = v_thumbs;
+
+	while (true) {
+		US_MUTEX_LOCK(thumbs->mutex);
+		US_COND_WAIT_FOR((thumbs->stop || thumbs->wanted != 0), thumbs->cond, thumbs->mutex);
+		if (thumbs->stop) {
+			US_MUTEX_UNLOCK(thumbs->mutex);
+			break;
+		}
+		// Забираем кадр себе, чтобы не держать мьютекс на время кодирования
+		us_frame_copy(thumbs->src, thumbs->work_src);
+		const u64 work_id = thumbs->src_id;
+		const uint quality = thumbs->src_quality;
+		const uint wanted = thumbs->wanted;
+		thumbs->wanted = 0;
+		US_MUTEX_UNLOCK(thumbs->mutex);
+
+		for (uint index = 0; index < US_THUMBS_N; ++index) {
+			if (!(wanted & (1 << index))) {
+				continue;
+			}
+			// Уменьшаем уже закодированный кадр в DCT
+			const uint thumb = 2 << index;
+			const ldf begin_ts = us_get_now_monotonic();
+			if (us_unjpeg_scaled(thumbs->work_src, thumbs->rgb, true, thumb) < 0) {
+				break;
+			}
+			us_cpu_encoder_compress(thumbs->rgb, thumbs->jpeg, quality);
+			thumbs->jpeg->online = thumbs->work_src->online;
+
+			US_MUTEX_LOCK(thumbs->mutex);
+			us_thumb_s *const th = &thumbs->ready[index];
+			us_frame_copy(thumbs->jpeg, th->jpeg);
+			th->frame_id = work_id;
+			US_MUTEX_UNLOCK(thumbs->mutex);
+
+			US_LOG_DEBUG("HTTP: Thumbnail 1/%u: %ux%u, time=%.06Lf",
+				thumb, thumbs->jpeg->width, thumbs->jpeg->height, us_get_now_monotonic() - begin_ts);
+		}
+		event_active(thumbs->done_ev, 0, 0);
+	}
+	return NULL;
+}
@@ -0,0 +1,67 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <pthread.h>
+#include <event2/event.h>
+
+#include "../../libs/types.h"
+#include "../../libs/frame.h"
+
+
+#define US_THUMBS_N 3 // 1/2, 1/4, 1/8
+
+
+typedef struct {
+	u64			frame_id; // Of the source frame
+	us_frame_s	*jpeg;
+} us_thumb_s;
+
+typedef struct {
+	struct event	*done_ev; // Activated when a thumbnail is ready
+
+	pthread_t		tid;
+	bool			started;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	bool			stop;
+
+	us_frame_s		*src; // Requested by HTTP
+	u64				src_id;
+	uint			src_quality;
+	uint			wanted; // Bitmask of the scales for src
+	us_thumb_s		ready[US_THUMBS_N];
+
+	// Worker only
+	us_frame_s		*work_src;
+	us_frame_s		*rgb;
+	us_frame_s		*jpeg;
+} us_thumbs_s;
+
+
+us_thumbs_s *us_thumbs_init(struct event *done_ev);
+void us_thumbs_destroy(us_thumbs_s *thumbs);
+
+uint us_thumbs_get_index(uint thumb);
+void us_thumbs_request(us_thumbs_s *thumbs, const us_frame_s *frame, u64 frame_id, uint thumb, uint quality);
+bool us_thumbs_get(us_thumbs_s *thumbs, uint thumb, u64 after_id, us_frame_s *dest, u64 *frame_id);
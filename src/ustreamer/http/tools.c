@@ -22,7 +22,10 @@
 
 #include "tools.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -117,6 +120,51 @@ char *us_evhttp_get_hostport(struct evhttp_request *req) {
 	return hostport;
 }
 
+bool us_evhttp_is_encoding_accepted(struct evhttp_request *req, const char *encoding) {
+	// Разбираем заголовок вида "gzip;q=0.5, br, *;q=0". Кодировка подходит,
+	// если у нее самой, а при ее отсутствии у "*", значение q больше нуля.
+	const char *ptr = us_evhttp_get_header(req, "Accept-Encoding");
+	if (ptr == NULL) {
+		return false;
+	}
+
+	const uz encoding_len = strlen(encoding);
+	int explicit = -1;
+	int wildcard = -1;
+	while (*ptr != '\0') {
+		while (*ptr == ' ' || *ptr == '\t' || *ptr == ',') {
+			++ptr;
+		}
+		const char *const name = ptr;
+		while (*ptr != '\0' && *ptr != ',' && *ptr != ';' && *ptr != ' ' && *ptr != '\t') {
+			++ptr;
+		}
+		const uz name_len = ptr - name;
+
+		double q = 1;
+		while (*ptr != '\0' && *ptr != ',') {
+			if (*ptr == ';') {
+				++ptr;
+				while (*ptr == ' ' || *ptr == '\t') {
+					++ptr;
+				}
+				if ((ptr[0] == 'q' || ptr[0] == 'Q') && ptr[1] == '=') {
+					q = strtod(ptr + 2, NULL);
+				}
+			} else {
+				++ptr;
+			}
+		}
+
+		if (name_len == encoding_len && !strncasecmp(name, encoding, name_len)) {
+			explicit = (q > 0);
+		} else if (name_len == 1 && name[0] == '*') {
+			wildcard = (q > 0);
+		}
+	}
+	return (explicit >= 0 ? explicit > 0 : wildcard > 0);
+}
+
 bool us_evkeyvalq_get_true(struct evkeyvalq *params, const char *key) {
 	const char *value_str = evhttp_find_header(params, key);
 	if (value_str != NULL) {
@@ -139,6 +187,19 @@ char *us_evkeyvalq_get_string(struct evkeyvalq *params, const char *key) {
 	return NULL;
 }
 
+uint us_evkeyvalq_get_uint(struct evkeyvalq *params, const char *key, uint def) {
+	const char *const value_str = evhttp_find_header(params, key);
+	if (value_str != NULL && value_str[0] != '\0') {
+		char *end;
+		errno = 0;
+		const unsigned long value = strtoul(value_str, &end, 10);
+		if (errno == 0 && *end == '\0' && value <= UINT_MAX && value_str[0] != '-') {
+			return value;
+		}
+	}
+	return def;
+}
+
 char *us_bufferevent_format_reason(short what) {
 	char *reason;
 	US_CALLOC(reason, 2048);
@@ -34,8 +34,10 @@ evutil_socket_t us_evhttp_bind_unix(struct evhttp *http, const char *path, bool
 
 const char *us_evhttp_get_header(struct evhttp_request *req, const char *key);
 char *us_evhttp_get_hostport(struct evhttp_request *req);
+bool us_evhttp_is_encoding_accepted(struct evhttp_request *req, const char *encoding);
 
 bool us_evkeyvalq_get_true(struct evkeyvalq *params, const char *key);
 char *us_evkeyvalq_get_string(struct evkeyvalq *params, const char *key);
+uint us_evkeyvalq_get_uint(struct evkeyvalq *params, const char *key, uint def);
 
 char *us_bufferevent_format_reason(short what);
@@ -0,0 +1,194 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "ws.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/buffer.h>
+
+#include "../../libs/types.h"
+#include "../../libs/tools.h"
+#include "../../libs/base64.h"
+
+
+static void _ws_sha1(const u8 *data, uz size, u8 *digest);
+
+
+char *us_ws_make_accept(const char *key) {
+	// https://datatracker.ietf.org/doc/html/rfc6455#section-4.2.2
+	char *raw;
+	US_ASPRINTF(raw, "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", key);
+	u8 digest[20];
+	_ws_sha1((const u8*)raw, strlen(raw), digest);
+	free(raw);
+
+	char *accept = NULL;
+	us_base64_encode(digest, 20, &accept, NULL);
+	return accept;
+}
+
+void us_ws_add_header(struct evbuffer *buf, us_ws_opcode_e opcode, uz size) {
+	// Сервер всегда шлет немаскированные фреймы целиком, без фрагментации
+	u8 header[10];
+	uz header_size = 2;
+	header[0] = 0x80 | opcode;
+	if (size < 126) {
+		header[1] = size;
+	} else if (size <= 0xFFFF) {
+		header[1] = 126;
+		header[2] = size >> 8;
+		header[3] = size;
+		header_size = 4;
+	} else {
+		header[1] = 127;
+		for (uint index = 0; index < 8; ++index) {
+			header[2 + index] = (u64)size >> (56 - index * 8);
+		}
+		header_size = 10;
+	}
+	US_A(!evbuffer_add(buf, header, header_size));
+}
+
+int us_ws_read_message(struct evbuffer *buf, us_ws_opcode_e *opcode, u8 *data, uz max_size, uz *size) {
+	// Возвращает 1, если сообщение прочитано, 0, если данных пока мало, и -1 при ошибке протокола.
+	// От клиента принимаются только короткие сообщения в одном фрейме.
+
+	const uz available = evbuffer_get_length(buf);
+	u8 header[14];
+	const uz peeked = evbuffer_copyout(buf, header, US_MIN(available, sizeof(header)));
+	if (peeked < 2) {
+		return 0;
+	}
+
+	if ((header[0] & 0x70) || !(header[0] & 0x80) || !(header[1] & 0x80)) {
+		return -1; // RSV, фрагментация или немаскированный фрейм от клиента
+	}
+
+	u64 payload_size = header[1] & 0x7F;
+	uz header_size = 2;
+	if (payload_size == 126) {
+		header_size = 4;
+	} else if (payload_size == 127) {
+		header_size = 10;
+	}
+	if (peeked < header_size + 4) {
+		return 0;
+	}
+	if (header_size > 2) {
+		payload_size = 0;
+		for (uz index = 2; index < header_size; ++index) {
+			payload_size = (payload_size << 8) | header[index];
+		}
+	}
+	if (payload_size > max_size) {
+		return -1;
+	}
+
+	u8 mask[4];
+	memcpy(mask, header + header_size, 4);
+	header_size += 4;
+	if (available < header_size + payload_size) {
+		return 0;
+	}
+
+	US_A(!evbuffer_drain(buf, header_size));
+	US_A(evbuffer_remove(buf, data, payload_size) == (int)payload_size);
+	for (uz index = 0; index < payload_size; ++index) {
+		data[index] ^= mask[index % 4];
+	}
+	*opcode = header[0] & 0x0F;
+	*size = payload_size;
+	return 1;
+}
+
+static void _ws_sha1(const u8 *data, uz size, u8 *digest) {
+	// SHA-1 нужен только для рукопожатия, поэтому без оптимизаций
+
+#	define ROL(x_value, x_bits) (((x_value) << (x_bits)) | ((x_value) >> (32 - (x_bits))))
+
+	u32 h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+	const u64 bits = (u64)size * 8;
+	const uz padded_size = ((size + 8) / 64 + 1) * 64;
+
+	for (uz offset = 0; offset < padded_size; offset += 64) {
+		u32 w[80];
+		for (uint index = 0; index < 64; ++index) {
+			const uz pos = offset + index;
+			u8 octet;
+			if (pos < size) {
+				octet = data[pos];
+			} else if (pos == size) {
+				octet = 0x80;
+			} else if (pos >= padded_size - 8) {
+				octet = bits >> ((padded_size - 1 - pos) * 8);
+			} else {
+				octet = 0;
+			}
+			if (index % 4 == 0) {
+				w[index / 4] = 0;
+			}
+			w[index / 4] |= (u32)octet << ((3 - index % 4) * 8);
+		}
+		for (uint index = 16; index < 80; ++index) {
+			w[index] = ROL(w[index - 3] ^ w[index - 8] ^ w[index - 14] ^ w[index - 16], 1);
+		}
+
+		u32 a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (uint index = 0; index < 80; ++index) {
+			u32 f;
+			u32 k;
+			if (index < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			} else if (index < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			} else if (index < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			const u32 tmp = ROL(a, 5) + f + e + k + w[index];
+			e = d;
+			d = c;
+			c = ROL(b, 30);
+			b = a;
+			a = tmp;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+
+	for (uint index = 0; index < 20; ++index) {
+		digest[index] = h[index / 4] >> ((3 - index % 4) * 8);
+	}
+
+#	undef ROL
+}
@@ -0,0 +1,42 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <event2/buffer.h>
+
+#include "../../libs/types.h"
+
+
+typedef enum {
+	US_WS_OP_CONT = 0x0,
+	US_WS_OP_TEXT = 0x1,
+	US_WS_OP_BINARY = 0x2,
+	US_WS_OP_CLOSE = 0x8,
+	US_WS_OP_PING = 0x9,
+	US_WS_OP_PONG = 0xA,
+} us_ws_opcode_e;
+
+
+char *us_ws_make_accept(const char *key);
+void us_ws_add_header(struct evbuffer *buf, us_ws_opcode_e opcode, uz size);
+int us_ws_read_message(struct evbuffer *buf, us_ws_opcode_e *opcode, u8 *data, uz max_size, uz *size);
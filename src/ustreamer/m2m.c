@@ -48,9 +48,11 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 	uint gop,
 	uint quality,
 	bool allow_dma,
-	bool boost);
+	bool boost,
+	bool intra_refresh);
 
 static void _m2m_encoder_ensure(us_m2m_encoder_s *enc, const us_frame_s *frame);
+static void _m2m_encoder_enable_intra_refresh(us_m2m_encoder_s *enc);
 
 static int _m2m_encoder_init_buffers(
 	us_m2m_encoder_s *enc,
@@ -62,11 +64,21 @@ static int _m2m_encoder_init_buffers(
 
 static void _m2m_encoder_cleanup(us_m2m_encoder_s *enc);
 
+static int _m2m_encoder_compress(
+	us_m2m_encoder_s *enc,
+	const us_frame_s *src,
+	us_frame_s *dest,
+	bool force_key,
+	bool hold);
+
 static int _m2m_encoder_compress_raw(
 	us_m2m_encoder_s *enc,
 	const us_frame_s *src,
 	us_frame_s *dest,
-	bool force_key);
+	bool force_key,
+	bool hold);
+
+static int _m2m_encoder_release_raw(us_m2m_encoder_s *enc);
 
 
 #define _LOG_ERROR(x_msg, ...)		US_LOG_ERROR("%s: " x_msg, enc->name, ##__VA_ARGS__)
@@ -76,9 +88,12 @@ static int _m2m_encoder_compress_raw(
 #define _LOG_DEBUG(x_msg, ...)		US_LOG_DEBUG("%s: " x_msg, enc->name, ##__VA_ARGS__)
 
 
-us_m2m_encoder_s *us_m2m_h264_encoder_init(const char *name, const char *path, uint bitrate, uint gop, bool boost) {
+us_m2m_encoder_s *us_m2m_h264_encoder_init(
+	const char *name, const char *path,
+	uint bitrate, uint gop, bool boost, bool intra_refresh
+) {
 	bitrate *= 1000; // From Kbps
-	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_H264, bitrate, gop, 0, true, boost);
+	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_H264, bitrate, gop, 0, true, boost, intra_refresh);
 }
 
 us_m2m_encoder_s *us_m2m_mjpeg_encoder_init(const char *name, const char *path, uint quality) {
@@ -89,12 +104,12 @@ us_m2m_encoder_s *us_m2m_mjpeg_encoder_init(const char *name, const char *path,
 	bitrate = step * round(bitrate / step);
 	bitrate *= 1000; // From Kbps
 	US_A(bitrate > 0);
-	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_MJPEG, bitrate, 0, 0, true, false);
+	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_MJPEG, bitrate, 0, 0, true, false, false);
 }
 
 us_m2m_encoder_s *us_m2m_jpeg_encoder_init(const char *name, const char *path, uint quality) {
 	// FIXME: DMA не работает
-	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_JPEG, 0, 0, quality, false, false);
+	return _m2m_encoder_init(name, path, V4L2_PIX_FMT_JPEG, 0, 0, quality, false, false, false);
 }
 
 void us_m2m_encoder_destroy(us_m2m_encoder_s *enc) {
@@ -106,8 +121,53 @@ void us_m2m_encoder_destroy(us_m2m_encoder_s *enc) {
 }
 
 int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key) {
+	return _m2m_encoder_compress(enc, src, dest, force_key, false);
+}
+
+const us_frame_s *us_m2m_encoder_compress_hold(us_m2m_encoder_s *enc, const us_frame_s *src, bool force_key) {
+	// Результат остается в mmap-буфере энкодера до вызова us_m2m_encoder_release().
+	// Фрейм принадлежит энкодеру, его нельзя освобождать или изменять.
+	if (_m2m_encoder_compress(enc, src, &enc->run->held, force_key, true) < 0) {
+		return NULL;
+	}
+	return &enc->run->held;
+}
+
+void us_m2m_encoder_release(us_m2m_encoder_s *enc) {
+	if (_m2m_encoder_release_raw(enc) < 0) {
+		_m2m_encoder_cleanup(enc);
+		_LOG_ERROR("Encoder destroyed due an error (release)");
+	}
+}
+
+void us_m2m_encoder_set_bitrate(us_m2m_encoder_s *enc, uint bitrate) {
+	us_m2m_encoder_runtime_s *const run = enc->run;
+	enc->bitrate = bitrate * 1000; // From Kbps, will be used on the next preparing
+	if (run->ready) {
+		// Битрейт H264-энкодера можно менять на лету без переинициализации
+		struct v4l2_control ctl = {0};
+		ctl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+		ctl.value = enc->bitrate;
+		_LOG_DEBUG("Changing bitrate to %u ...", enc->bitrate);
+		if (us_xioctl(run->fd, VIDIOC_S_CTRL, &ctl) < 0) {
+			_LOG_PERROR("Can't change bitrate");
+		}
+	}
+}
+
+static int _m2m_encoder_compress(
+	us_m2m_encoder_s *enc,
+	const us_frame_s *src,
+	us_frame_s *dest,
+	bool force_key,
+	bool hold
+) {
 	us_m2m_encoder_runtime_s *const run = enc->run;
 
+	if (run->held_index >= 0) {
+		us_m2m_encoder_release(enc);
+	}
+
 	uint dest_format = enc->out_format;
 	switch (enc->out_format) {
 		case V4L2_PIX_FMT_JPEG:
@@ -117,10 +177,12 @@ int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_fra
 			dest_format = V4L2_PIX_FMT_JPEG;
 			break;
 		case V4L2_PIX_FMT_H264:
+			// С intra refresh картинка обновляется и после паузы, так что IDR
+			// по перерыву в кадрах не нужен и дал бы тот самый всплеск битрейта
 			force_key = (
 				force_key
 				|| run->last_online != src->online
-				|| run->last_encode_ts + 0.5 < us_get_now_monotonic()
+				|| (!run->intra_refresh && run->last_encode_ts + 0.5 < us_get_now_monotonic())
 			);
 			break;
 	}
@@ -134,7 +196,7 @@ int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_fra
 
 	_LOG_DEBUG("Compressing new frame; force_key=%d ...", force_key);
 
-	if (_m2m_encoder_compress_raw(enc, src, dest, force_key) < 0) {
+	if (_m2m_encoder_compress_raw(enc, src, dest, force_key, hold) < 0) {
 		_m2m_encoder_cleanup(enc);
 		_LOG_ERROR("Encoder destroyed due an error (compress)");
 		return -1;
@@ -158,7 +220,8 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 	uint gop,
 	uint quality,
 	bool allow_dma,
-	bool boost
+	bool boost,
+	bool intra_refresh
 ) {
 	US_LOG_INFO("%s: Initializing encoder ...", name);
 
@@ -166,6 +229,8 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 	US_CALLOC(run, 1);
 	run->last_online = -1;
 	run->fd = -1;
+	run->held_index = -1;
+	run->held.dma_fd = -1;
 
 	us_m2m_encoder_s *enc;
 	US_CALLOC(enc, 1);
@@ -181,6 +246,7 @@ static us_m2m_encoder_s *_m2m_encoder_init(
 	enc->quality = quality;
 	enc->allow_dma = allow_dma;
 	enc->boost = boost;
+	enc->intra_refresh = intra_refresh;
 	enc->run = run;
 	return enc;
 }
@@ -253,6 +319,9 @@ static void _m2m_encoder_ensure(us_m2m_encoder_s *enc, const us_frame_s *frame)
 		SET_OPTION(V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER,	1);
 		SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_MIN_QP,			16);
 		SET_OPTION(V4L2_CID_MPEG_VIDEO_H264_MAX_QP,			32);
+		if (enc->intra_refresh) {
+			_m2m_encoder_enable_intra_refresh(enc);
+		}
 	} else if (enc->out_format == V4L2_PIX_FMT_MJPEG) {
 		SET_OPTION(V4L2_CID_MPEG_VIDEO_BITRATE,				enc->bitrate);
 	} else if (enc->out_format == V4L2_PIX_FMT_JPEG) {
@@ -364,6 +433,54 @@ error:
 	_LOG_ERROR("Encoder destroyed due an error (prepare)");
 }
 
+static void _m2m_encoder_enable_intra_refresh(us_m2m_encoder_s *enc) {
+	// Это не фатально: если драйвер не умеет, то просто остаемся на обычных IDR
+	us_m2m_encoder_runtime_s *const run = enc->run;
+	const uint period = (enc->gop > 0 ? enc->gop : 30);
+
+#	define TRY_OPTION(x_cid, x_value) ({ \
+			struct v4l2_control m_ctl = {0}; \
+			m_ctl.id = x_cid; \
+			m_ctl.value = x_value; \
+			_LOG_DEBUG("Configuring option " #x_cid " ..."); \
+			(us_xioctl(run->fd, VIDIOC_S_CTRL, &m_ctl) == 0); \
+		})
+
+#	ifdef V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE
+	if (
+		TRY_OPTION(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE, V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD_TYPE_CYCLIC)
+		&& TRY_OPTION(V4L2_CID_MPEG_VIDEO_INTRA_REFRESH_PERIOD, period)
+	) {
+		run->intra_refresh = true;
+	}
+#	endif
+	if (!run->intra_refresh) {
+		// Старый интерфейс: сколько макроблоков обновлять в каждом кадре
+		const uint mbs = (us_align_size(run->p_width, 16) / 16) * (us_align_size(run->p_height, 16) / 16);
+		if (TRY_OPTION(V4L2_CID_MPEG_VIDEO_CYCLIC_INTRA_REFRESH_MB, US_MAX((mbs + period - 1) / period, (uint)1))) {
+			run->intra_refresh = true;
+		}
+	}
+
+	if (run->intra_refresh) {
+		// Полные IDR теперь нужны только на старте потока, так что делаем
+		// их период максимальным. Ноль у разных драйверов значит разное.
+		struct v4l2_queryctrl query = {0};
+		query.id = V4L2_CID_MPEG_VIDEO_H264_I_PERIOD;
+		if (
+			us_xioctl(run->fd, VIDIOC_QUERYCTRL, &query) < 0
+			|| !TRY_OPTION(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, query.maximum)
+		) {
+			_LOG_INFO("Can't disable periodic IDR, keeping gop=%u", enc->gop);
+		}
+		_LOG_INFO("Using cyclic intra refresh: period=%u", period);
+	} else {
+		_LOG_ERROR("Intra refresh is not supported by the encoder, using periodic IDR");
+	}
+
+#	undef TRY_OPTION
+}
+
 static int _m2m_encoder_init_buffers(
 	us_m2m_encoder_s *enc,
 	const char *name,
@@ -475,7 +592,13 @@ static void _m2m_encoder_cleanup(us_m2m_encoder_s *enc) {
 		run->fd = -1;
 	}
 
+	run->held_index = -1;
+	run->held.data = NULL;
+	run->held.used = 0;
+	run->held.allocated = 0;
+
 	run->last_online = -1;
+	run->intra_refresh = false;
 	run->ready = false;
 
 	if (say) {
@@ -487,11 +610,13 @@ static int _m2m_encoder_compress_raw(
 	us_m2m_encoder_s *enc,
 	const us_frame_s *src,
 	us_frame_s *dest,
-	bool force_key
+	bool force_key,
+	bool hold
 ) {
 	us_m2m_encoder_runtime_s *const run = enc->run;
 
 	US_A(run->ready);
+	US_A(run->held_index < 0);
 
 	if (force_key) {
 		struct v4l2_control ctl = {0};
@@ -588,12 +713,25 @@ static int _m2m_encoder_compress_raw(
 				// входному (с тем же таймстампом).
 				_LOG_DEBUG("Need to retry OUTPUT buffer due timestamp mismatch");
 			} else {
-				us_frame_set_data(dest, run->out_bufs[out_buf.index].data, out_plane.bytesused);
+				if (hold) {
+					// Не копируем, а отдаем наружу сам буфер до us_m2m_encoder_release()
+					dest->data = run->out_bufs[out_buf.index].data;
+					dest->allocated = run->out_bufs[out_buf.index].allocated;
+					dest->used = out_plane.bytesused;
+				} else {
+					us_frame_set_data(dest, run->out_bufs[out_buf.index].data, out_plane.bytesused);
+				}
 				dest->key = out_buf.flags & V4L2_BUF_FLAG_KEYFRAME;
 				dest->gop = enc->gop;
 				done = true;
 			}
 
+			if (done && hold) {
+				_LOG_DEBUG("Holding OUTPUT buffer=%u ...", out_buf.index);
+				run->held_index = out_buf.index;
+				break;
+			}
+
 			_LOG_DEBUG("Releasing OUTPUT buffer=%u ...", out_buf.index);
 			_E_XIOCTL(VIDIOC_QBUF, &out_buf, "Can't release OUTPUT buffer=%u", out_buf.index);
 
@@ -608,4 +746,33 @@ error: // Mostly for _E_XIOCTL
 	return -1;
 }
 
+static int _m2m_encoder_release_raw(us_m2m_encoder_s *enc) {
+	us_m2m_encoder_runtime_s *const run = enc->run;
+
+	if (run->held_index < 0) {
+		return 0;
+	}
+	US_A(run->ready);
+
+	struct v4l2_buffer out_buf = {0};
+	struct v4l2_plane out_plane = {0};
+	out_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	out_buf.memory = V4L2_MEMORY_MMAP;
+	out_buf.index = run->held_index;
+	out_buf.length = 1;
+	out_buf.m.planes = &out_plane;
+
+	run->held_index = -1;
+	run->held.data = NULL;
+	run->held.used = 0;
+	run->held.allocated = 0;
+
+	_LOG_DEBUG("Releasing held OUTPUT buffer=%u ...", out_buf.index);
+	_E_XIOCTL(VIDIOC_QBUF, &out_buf, "Can't release held OUTPUT buffer=%u", out_buf.index);
+	return 0;
+
+error: // Mostly for _E_XIOCTL
+	return -1;
+}
+
 #undef _E_XIOCTL
@@ -46,8 +46,12 @@ typedef struct {
 	bool	p_dma;
 
 	bool	ready;
+	bool	intra_refresh;
 	int		last_online;
 	ldf		last_encode_ts;
+
+	int			held_index;
+	us_frame_s	held;
 } us_m2m_encoder_runtime_s;
 
 typedef struct {
@@ -59,14 +63,21 @@ typedef struct {
 	uint	quality;
 	bool	allow_dma;
 	bool	boost;
+	bool	intra_refresh;
 
 	us_m2m_encoder_runtime_s *run;
 } us_m2m_encoder_s;
 
 
-us_m2m_encoder_s *us_m2m_h264_encoder_init(const char *name, const char *path, uint bitrate, uint gop, bool boost);
+us_m2m_encoder_s *us_m2m_h264_encoder_init(
+	const char *name, const char *path,
+	uint bitrate, uint gop, bool boost, bool intra_refresh);
 us_m2m_encoder_s *us_m2m_mjpeg_encoder_init(const char *name, const char *path, uint quality);
 us_m2m_encoder_s *us_m2m_jpeg_encoder_init(const char *name, const char *path, uint quality);
 void us_m2m_encoder_destroy(us_m2m_encoder_s *enc);
 
 int us_m2m_encoder_compress(us_m2m_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, bool force_key);
+const us_frame_s *us_m2m_encoder_compress_hold(us_m2m_encoder_s *enc, const us_frame_s *src, bool force_key);
+void us_m2m_encoder_release(us_m2m_encoder_s *enc);
+
+void us_m2m_encoder_set_bitrate(us_m2m_encoder_s *enc, uint bitrate);
@@ -33,6 +33,8 @@
 
 #include "options.h"
 #include "encoder.h"
+#include "workers.h"
+#include "sched.h"
 #include "stream.h"
 #include "http/server.h"
 #ifdef WITH_GPIO
@@ -40,8 +42,20 @@
 #endif
 
 
-static us_stream_s	*_g_stream = NULL;
-static us_server_s	*_g_server = NULL;
+typedef struct {
+	const char		*name;
+	us_capture_s	*cap;
+	us_encoder_s	*enc;
+	us_stream_s		*stream;
+	pthread_t		tid;
+} _extra_s;
+
+
+static us_stream_s			*_g_stream = NULL;
+static us_server_s			*_g_server = NULL;
+static _extra_s				_g_extras[US_SERVER_MAX_MOUNTS] = {0};
+static uint					_g_n_extras = 0;
+static us_workers_group_s	*_g_workers_group = NULL;
 
 
 static void _block_thread_signals(void) {
@@ -55,14 +69,25 @@ static void _block_thread_signals(void) {
 static void *_stream_loop_thread(void *arg) {
 	(void)arg;
 	US_THREAD_SETTLE("stream");
+	us_sched_apply(&us_g_sched.capture);
 	_block_thread_signals();
 	us_stream_loop(_g_stream);
 	return NULL;
 }
 
+static void *_extra_stream_loop_thread(void *v_extra) {
+	const _extra_s *const extra = v_extra;
+	US_THREAD_SETTLE("stream-%s", extra->name);
+	us_sched_apply(&us_g_sched.capture);
+	_block_thread_signals();
+	us_stream_loop(extra->stream);
+	return NULL;
+}
+
 static void *_server_loop_thread(void *arg) {
 	(void)arg;
 	US_THREAD_SETTLE("http");
+	us_sched_apply(&us_g_sched.http);
 	_block_thread_signals();
 	us_server_loop(_g_server);
 	return NULL;
@@ -73,9 +98,96 @@ static void _signal_handler(int signum) {
 	US_LOG_INFO_NOLOCK("===== Stopping by %s =====", name);
 	free(name);
 	us_stream_loop_break(_g_stream);
+	for (uint i = 0; i < _g_n_extras; ++i) {
+		us_stream_loop_break(_g_extras[i].stream);
+	}
 	us_server_loop_break(_g_server);
 }
 
+static void _extras_init(const us_options_s *opts, const us_capture_s *cap, us_encoder_s *enc, const us_stream_s *stream) {
+	if (opts->n_extras == 0) {
+		return;
+	}
+
+	// --workers становится общим лимитом на все устройства
+	_g_workers_group = us_workers_group_init(enc->n_workers);
+	enc->group = _g_workers_group;
+
+	for (uint i = 0; i < opts->n_extras; ++i) {
+		const us_options_extra_s *const opt = &opts->extras[i];
+		_extra_s *const extra = &_g_extras[i];
+		extra->name = opt->name;
+
+		// Все, кроме пути, наследуется от основного устройства
+		us_capture_s *const x_cap = us_capture_init();
+		x_cap->path = opt->path;
+		x_cap->input = cap->input;
+		x_cap->width = cap->width;
+		x_cap->height = cap->height;
+		x_cap->format = cap->format;
+		x_cap->format_swap_rgb = cap->format_swap_rgb;
+		x_cap->jpeg_quality = cap->jpeg_quality;
+		x_cap->standard = cap->standard;
+		x_cap->io_method = cap->io_method;
+		x_cap->dv_timings = cap->dv_timings;
+		x_cap->n_bufs = cap->n_bufs;
+		x_cap->min_frame_size = cap->min_frame_size;
+		x_cap->allow_truncated_frames = cap->allow_truncated_frames;
+		x_cap->persistent = cap->persistent;
+		x_cap->timeout = cap->timeout;
+		*x_cap->ctl = *cap->ctl;
+		extra->cap = x_cap;
+
+		us_encoder_s *const x_enc = us_encoder_init();
+		x_enc->type = enc->type;
+		x_enc->n_workers = enc->n_workers;
+		x_enc->n_min_workers = enc->n_min_workers;
+		x_enc->m2m_path = enc->m2m_path;
+		x_enc->aq_min_quality = enc->aq_min_quality;
+		x_enc->aq_kbps = enc->aq_kbps;
+		x_enc->aq_fps = enc->aq_fps;
+		x_enc->group = _g_workers_group;
+		extra->enc = x_enc;
+
+		// Выход по отсутствию клиентов и уведомления родителя остаются за основным стримом
+		us_stream_s *const x_stream = us_stream_init(x_cap, x_enc);
+		x_stream->secondary = true;
+		x_stream->desired_fps = stream->desired_fps;
+		x_stream->slowdown = stream->slowdown;
+		x_stream->idle_stop = stream->idle_stop;
+		x_stream->idle_release = stream->idle_release;
+		x_stream->error_delay = stream->error_delay;
+		x_stream->exit_on_device_error = stream->exit_on_device_error;
+		x_stream->jpeg_sink = opt->jpeg_sink;
+		x_stream->raw_sink = opt->raw_sink;
+		x_stream->h264_sink = opt->h264_sink;
+		x_stream->h264_encoder = stream->h264_encoder;
+		x_stream->h264_bitrate = stream->h264_bitrate;
+		x_stream->h264_gop = stream->h264_gop;
+		x_stream->h264_m2m_path = stream->h264_m2m_path;
+		x_stream->h264_boost = stream->h264_boost;
+		x_stream->h264_zero_copy = stream->h264_zero_copy;
+		x_stream->h264_intra_refresh = stream->h264_intra_refresh;
+		x_stream->h264_idle_release = stream->h264_idle_release;
+		us_stream_update_blank(x_stream, x_cap);
+		extra->stream = x_stream;
+
+		us_server_add_mount(_g_server, x_stream, opt->name);
+		++_g_n_extras;
+	}
+}
+
+static void _extras_destroy(void) {
+	for (uint i = 0; i < _g_n_extras; ++i) {
+		_extra_s *const extra = &_g_extras[i];
+		us_stream_destroy(extra->stream);
+		us_encoder_destroy(extra->enc);
+		us_capture_destroy(extra->cap);
+	}
+	_g_n_extras = 0;
+	US_DELETE(_g_workers_group, us_workers_group_destroy);
+}
+
 int main(int argc, char *argv[]) {
 	US_A(argc >= 0);
 	int exit_code = 0;
@@ -91,13 +203,17 @@ int main(int argc, char *argv[]) {
 
 	if ((exit_code = us_options_parse(opts, cap, enc, _g_stream, _g_server)) == 0) {
 		us_stream_update_blank(_g_stream, cap);
+		_extras_init(opts, cap, enc, _g_stream);
 #		ifdef WITH_GPIO
 		us_gpio_init();
 #		endif
 
 		us_install_signals_handler(_signal_handler, true);
 
-		if ((exit_code = us_server_listen(_g_server)) == 0) {
+		if (
+			(exit_code = us_sched_init()) == 0
+			&& (exit_code = us_server_listen(_g_server)) == 0
+		) {
 #			ifdef WITH_GPIO
 			us_gpio_set_prog_running(true);
 #			endif
@@ -105,8 +221,14 @@ int main(int argc, char *argv[]) {
 			pthread_t stream_loop_tid;
 			pthread_t server_loop_tid;
 			US_THREAD_CREATE(stream_loop_tid, _stream_loop_thread, NULL);
+			for (uint i = 0; i < _g_n_extras; ++i) {
+				US_THREAD_CREATE(_g_extras[i].tid, _extra_stream_loop_thread, &_g_extras[i]);
+			}
 			US_THREAD_CREATE(server_loop_tid, _server_loop_thread, NULL);
 			US_THREAD_JOIN(server_loop_tid);
+			for (uint i = 0; i < _g_n_extras; ++i) {
+				US_THREAD_JOIN(_g_extras[i].tid);
+			}
 			US_THREAD_JOIN(stream_loop_tid);
 		}
 
@@ -117,6 +239,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	us_server_destroy(_g_server);
+	_extras_destroy();
 	us_stream_destroy(_g_stream);
 	us_encoder_destroy(enc);
 	us_capture_destroy(cap);
@@ -45,6 +45,7 @@
 #endif
 
 #include "encoder.h"
+#include "sched.h"
 #include "stream.h"
 #include "http/server.h"
 #ifdef WITH_GPIO
@@ -89,9 +90,16 @@ enum _US_OPT_VALUES {
 
 	// Longs only
 
-	_O_DEVICE_TIMEOUT = 10000,
+	_O_IDLE_STOP = 10000,
+	_O_IDLE_RELEASE,
+	_O_DEVICE_TIMEOUT,
 	_O_DEVICE_ERROR_DELAY,
+	_O_EXTRA_DEVICE,
 	_O_FORMAT_SWAP_RGB,
+	_O_MIN_WORKERS,
+	_O_QUALITY_MIN,
+	_O_QUALITY_TARGET_KBPS,
+	_O_QUALITY_TARGET_FPS,
 	_O_M2M_DEVICE,
 	_O_MEDIA_DEVICE,
 	_O_MEDIA_ENTITY_NAME,
@@ -117,6 +125,7 @@ enum _US_OPT_VALUES {
 	_O_ALLOW_ORIGIN,
 	_O_INSTANCE_ID,
 	_O_TCP_NODELAY,
+	_O_TCP_NOTSENT_LOWAT,
 	_O_SERVER_TIMEOUT,
 
 #	define ADD_SINK(x_prefix) \
@@ -128,10 +137,15 @@ enum _US_OPT_VALUES {
 	ADD_SINK(JPEG_SINK)
 	ADD_SINK(RAW_SINK)
 	ADD_SINK(H264_SINK)
+	_O_H264_ENCODER,
 	_O_H264_BITRATE,
 	_O_H264_GOP,
 	_O_H264_M2M_DEVICE,
 	_O_H264_BOOST,
+	_O_H264_ZERO_COPY,
+	_O_H264_INTRA_REFRESH,
+	_O_H264_IDLE_RELEASE,
+	_O_H264_LAYER,
 #	undef ADD_SINK
 
 #	ifdef WITH_V4P
@@ -156,6 +170,12 @@ enum _US_OPT_VALUES {
 #	endif
 	_O_NOTIFY_PARENT,
 
+	_O_CPUS_CAPTURE,
+	_O_CPUS_ENCODER,
+	_O_CPUS_HTTP,
+	_O_CAPTURE_RT_PRIORITY,
+	_O_MLOCK,
+
 	_O_LOG_LEVEL,
 	_O_PERF,
 	_O_VERBOSE,
@@ -187,8 +207,15 @@ static const struct option _LONG_OPTS[] = {
 	{"blank",					required_argument,	NULL,	_O_BLANK},
 	{"last-as-blank",			required_argument,	NULL,	_O_LAST_AS_BLANK},
 	{"slowdown",				no_argument,		NULL,	_O_SLOWDOWN},
+	{"idle-stop",				required_argument,	NULL,	_O_IDLE_STOP},
+	{"idle-release",			required_argument,	NULL,	_O_IDLE_RELEASE},
 	{"device-timeout",			required_argument,	NULL,	_O_DEVICE_TIMEOUT},
 	{"device-error-delay",		required_argument,	NULL,	_O_DEVICE_ERROR_DELAY},
+	{"extra-device",			required_argument,	NULL,	_O_EXTRA_DEVICE},
+	{"min-workers",				required_argument,	NULL,	_O_MIN_WORKERS},
+	{"quality-min",				required_argument,	NULL,	_O_QUALITY_MIN},
+	{"quality-target-kbps",		required_argument,	NULL,	_O_QUALITY_TARGET_KBPS},
+	{"quality-target-fps",		required_argument,	NULL,	_O_QUALITY_TARGET_FPS},
 	{"m2m-device",				required_argument,	NULL,	_O_M2M_DEVICE},
 	{"media-device",			required_argument,	NULL,	_O_MEDIA_DEVICE},
 	{"media-entity-name",		required_argument,	NULL,	_O_MEDIA_ENTITY_NAME},
@@ -224,6 +251,7 @@ static const struct option _LONG_OPTS[] = {
 	{"instance-id",				required_argument,	NULL,	_O_INSTANCE_ID},
 	{"fake-resolution",			required_argument,	NULL,	_O_FAKE_RESOLUTION},
 	{"tcp-nodelay",				no_argument,		NULL,	_O_TCP_NODELAY},
+	{"tcp-notsent-lowat",		required_argument,	NULL,	_O_TCP_NOTSENT_LOWAT},
 	{"server-timeout",			required_argument,	NULL,	_O_SERVER_TIMEOUT},
 
 #	define ADD_SINK(x_opt, x_prefix) \
@@ -237,10 +265,15 @@ static const struct option _LONG_OPTS[] = {
 	ADD_SINK("h264", H264_SINK)
 #	undef ADD_SINK
 	// Extra opts for H.264
+	{"h264-encoder",			required_argument,	NULL,	_O_H264_ENCODER},
 	{"h264-bitrate",			required_argument,	NULL,	_O_H264_BITRATE},
 	{"h264-gop",				required_argument,	NULL,	_O_H264_GOP},
 	{"h264-m2m-device",			required_argument,	NULL,	_O_H264_M2M_DEVICE},
 	{"h264-boost",				no_argument,		NULL,	_O_H264_BOOST},
+	{"h264-zero-copy",			no_argument,		NULL,	_O_H264_ZERO_COPY},
+	{"h264-intra-refresh",		no_argument,		NULL,	_O_H264_INTRA_REFRESH},
+	{"h264-idle-release",		required_argument,	NULL,	_O_H264_IDLE_RELEASE},
+	{"h264-layer",				required_argument,	NULL,	_O_H264_LAYER},
 	// Compatibility
 	{"sink",					required_argument,	NULL,	_O_JPEG_SINK},
 	{"sink-mode",				required_argument,	NULL,	_O_JPEG_SINK_MODE},
@@ -270,6 +303,12 @@ static const struct option _LONG_OPTS[] = {
 #	endif
 	{"notify-parent",			no_argument,		NULL,	_O_NOTIFY_PARENT},
 
+	{"cpus-capture",			required_argument,	NULL,	_O_CPUS_CAPTURE},
+	{"cpus-encoder",			required_argument,	NULL,	_O_CPUS_ENCODER},
+	{"cpus-http",				required_argument,	NULL,	_O_CPUS_HTTP},
+	{"capture-rt-priority",		required_argument,	NULL,	_O_CAPTURE_RT_PRIORITY},
+	{"mlock",					no_argument,		NULL,	_O_MLOCK},
+
 	{"log-level",				required_argument,	NULL,	_O_LOG_LEVEL},
 	{"perf",					no_argument,		NULL,	_O_PERF},
 	{"verbose",					no_argument,		NULL,	_O_VERBOSE},
@@ -287,6 +326,9 @@ static const struct option _LONG_OPTS[] = {
 
 static int _parse_resolution(const char *str, uint *width, uint *height, bool limited);
 static int _check_instance_id(const char *str);
+static int _parse_h264_layer(char *str, const char **name, uint *bitrate, uint *fps, uint *scale);
+static int _parse_extra_device(char *str, char **name, char **path);
+static char *_make_extra_sink_name(const char *obj, const char *name);
 
 static void _features(void);
 
@@ -316,6 +358,18 @@ void us_options_destroy(us_options_s *opts) {
 	US_DELETE(opts->jpeg_sink, us_memsink_destroy);
 	US_DELETE(opts->raw_sink, us_memsink_destroy);
 	US_DELETE(opts->h264_sink, us_memsink_destroy);
+	for (uint i = 0; i < US_STREAM_MAX_H264_LAYERS; ++i) {
+		US_DELETE(opts->h264_layer_sinks[i], us_memsink_destroy);
+	}
+	for (uint i = 0; i < opts->n_extras; ++i) {
+		us_options_extra_s *const extra = &opts->extras[i];
+		US_DELETE(extra->jpeg_sink, us_memsink_destroy);
+		US_DELETE(extra->raw_sink, us_memsink_destroy);
+		US_DELETE(extra->h264_sink, us_memsink_destroy);
+		US_DELETE(extra->jpeg_sink_name, free);
+		US_DELETE(extra->raw_sink_name, free);
+		US_DELETE(extra->h264_sink_name, free);
+	}
 #	ifdef WITH_V4P
 	US_DELETE(opts->drm, us_drm_destroy);
 #	endif
@@ -415,6 +469,12 @@ int us_options_parse(
 	ADD_SINK(h264_sink);
 #	undef ADD_SINK
 
+	const char *h264_layer_names[US_STREAM_MAX_H264_LAYERS] = {0};
+	uint h264_layer_bitrates[US_STREAM_MAX_H264_LAYERS] = {0};
+	uint h264_layer_fps[US_STREAM_MAX_H264_LAYERS] = {0};
+	uint h264_layer_scales[US_STREAM_MAX_H264_LAYERS] = {0};
+	uint n_h264_layers = 0;
+
 #	ifdef WITH_SETPROCTITLE
 	const char *process_name_prefix = NULL;
 #	endif
@@ -447,8 +507,35 @@ int us_options_parse(
 			case _O_BLANK:				break; // Deprecated
 			case _O_LAST_AS_BLANK:		break; // Deprecated
 			case _O_SLOWDOWN:			OPT_SET(stream->slowdown, true);
+			case _O_IDLE_STOP:			OPT_NUMBER("--idle-stop", stream->idle_stop, 0, 86400, 0);
+			case _O_IDLE_RELEASE:		OPT_NUMBER("--idle-release", stream->idle_release, 0, 86400, 0);
 			case _O_DEVICE_TIMEOUT:		OPT_NUMBER("--device-timeout", cap->timeout, 1, 60, 0);
 			case _O_DEVICE_ERROR_DELAY:	OPT_NUMBER("--device-error-delay", stream->error_delay, 1, 60, 0);
+			case _O_EXTRA_DEVICE:
+				if (opts->n_extras >= US_SERVER_MAX_MOUNTS) {
+					printf("Too many extra devices, max=%u\n", US_SERVER_MAX_MOUNTS);
+					return -1;
+				}
+				if (_parse_extra_device(
+					optarg,
+					&opts->extras[opts->n_extras].name,
+					&opts->extras[opts->n_extras].path
+				) < 0) {
+					printf("Invalid extra device '%s', it should be like: <name>:</dev/path>\n", optarg);
+					return -1;
+				}
+				for (uint i = 0; i < opts->n_extras; ++i) {
+					if (!strcmp(opts->extras[i].name, opts->extras[opts->n_extras].name)) {
+						printf("Duplicate extra device name: %s\n", opts->extras[i].name);
+						return -1;
+					}
+				}
+				++opts->n_extras;
+				break;
+			case _O_MIN_WORKERS:		OPT_NUMBER("--min-workers", enc->n_min_workers, 1, 32, 0);
+			case _O_QUALITY_MIN:		OPT_NUMBER("--quality-min", enc->aq_min_quality, 1, 100, 0);
+			case _O_QUALITY_TARGET_KBPS:	OPT_NUMBER("--quality-target-kbps", enc->aq_kbps, 0, 1000000, 0);
+			case _O_QUALITY_TARGET_FPS:	OPT_NUMBER("--quality-target-fps", enc->aq_fps, 0, US_VIDEO_MAX_FPS, 0);
 			case _O_M2M_DEVICE:			OPT_SET(enc->m2m_path, optarg);
 			case _O_MEDIA_DEVICE:		OPT_SET(cap->media_path, optarg);
 			case _O_MEDIA_ENTITY_NAME:	OPT_SET(cap->media_entity_name, optarg);
@@ -504,6 +591,7 @@ int us_options_parse(
 				server->instance_id = optarg;
 				break;
 			case _O_TCP_NODELAY:		OPT_SET(server->tcp_nodelay, true);
+			case _O_TCP_NOTSENT_LOWAT:	OPT_NUMBER("--tcp-notsent-lowat", server->tcp_notsent_lowat, 0, 1024 * 1024, 0);
 			case _O_SERVER_TIMEOUT:		OPT_NUMBER("--server-timeout", server->timeout, 1, 60, 0);
 
 #			define ADD_SINK(x_opt, x_lp, x_up) \
@@ -516,10 +604,31 @@ int us_options_parse(
 			ADD_SINK("raw", raw_sink, RAW_SINK)
 			ADD_SINK("h264", h264_sink, H264_SINK)
 #			undef ADD_SINK
+			case _O_H264_ENCODER:			OPT_PARSE_ENUM("H264 encoder type", stream->h264_encoder, us_stream_parse_h264_encoder, US_STREAM_H264_ENCODERS_STR);
 			case _O_H264_BITRATE:			OPT_NUMBER("--h264-bitrate", stream->h264_bitrate, 25, 20000, 0);
 			case _O_H264_GOP:				OPT_NUMBER("--h264-gop", stream->h264_gop, 0, 60, 0);
 			case _O_H264_M2M_DEVICE:		OPT_SET(stream->h264_m2m_path, optarg);
 			case _O_H264_BOOST:				OPT_SET(stream->h264_boost, true);
+			case _O_H264_ZERO_COPY:			OPT_SET(stream->h264_zero_copy, true);
+			case _O_H264_INTRA_REFRESH:		OPT_SET(stream->h264_intra_refresh, true);
+			case _O_H264_IDLE_RELEASE:		OPT_NUMBER("--h264-idle-release", stream->h264_idle_release, 0, 86400, 0);
+			case _O_H264_LAYER:
+				if (n_h264_layers >= US_STREAM_MAX_H264_LAYERS) {
+					printf("Too many H264 layers, max=%u\n", US_STREAM_MAX_H264_LAYERS);
+					return -1;
+				}
+				if (_parse_h264_layer(
+					optarg,
+					&h264_layer_names[n_h264_layers],
+					&h264_layer_bitrates[n_h264_layers],
+					&h264_layer_fps[n_h264_layers],
+					&h264_layer_scales[n_h264_layers]
+				) < 0) {
+					printf("Invalid H264 layer '%s', it should be like: <name>,<kbps>[,<fps>[,<1|2|4|8>]]\n", optarg);
+					return -1;
+				}
+				++n_h264_layers;
+				break;
 
 #			ifdef WITH_V4P
 			case _O_V4P:
@@ -550,6 +659,12 @@ int us_options_parse(
 #			endif
 			case _O_NOTIFY_PARENT:			OPT_SET(stream->notify_parent, true);
 
+			case _O_CPUS_CAPTURE:			OPT_SET(us_g_sched.capture.cpus, optarg);
+			case _O_CPUS_ENCODER:			OPT_SET(us_g_sched.encoder.cpus, optarg);
+			case _O_CPUS_HTTP:				OPT_SET(us_g_sched.http.cpus, optarg);
+			case _O_CAPTURE_RT_PRIORITY:	OPT_NUMBER("--capture-rt-priority", us_g_sched.capture.rt_priority, 0, 99, 0);
+			case _O_MLOCK:					OPT_SET(us_g_sched.mlock, true);
+
 			case _O_LOG_LEVEL:			OPT_NUMBER("--log-level", us_g_log_level, US_LOG_LEVEL_INFO, US_LOG_LEVEL_DEBUG, 0);
 			case _O_PERF:				OPT_SET(us_g_log_level, US_LOG_LEVEL_PERF);
 			case _O_VERBOSE:			OPT_SET(us_g_log_level, US_LOG_LEVEL_VERBOSE);
@@ -566,6 +681,23 @@ int us_options_parse(
 		}
 	}
 
+	if (stream->idle_release > 0 && stream->idle_stop == 0) {
+		printf("--idle-release requires --idle-stop\n");
+		return -1;
+	}
+
+	if (stream->h264_zero_copy && stream->h264_encoder != US_STREAM_H264_ENCODER_M2M) {
+		printf("--h264-zero-copy requires the M2M H264 encoder\n");
+		return -1;
+	}
+
+	if (opts->n_extras > 0 && enc->n_min_workers * (opts->n_extras + 1) > enc->n_workers) {
+		// --workers общий на все устройства, минимумы должны в него влезать
+		printf("--min-workers=%u for each of %u devices exceeds the shared --workers=%u\n",
+			enc->n_min_workers, opts->n_extras + 1, enc->n_workers);
+		return -1;
+	}
+
 	US_LOG_INFO("Starting PiKVM uStreamer %s ...", US_VERSION);
 
 #	define ADD_SINK(x_label, x_prefix) { \
@@ -587,6 +719,54 @@ int us_options_parse(
 	ADD_SINK("H264", h264_sink);
 #	undef ADD_SINK
 
+	for (uint i = 0; i < opts->n_extras; ++i) {
+		// Синки дополнительных устройств получают имя устройства перед суффиксом
+		us_options_extra_s *const extra = &opts->extras[i];
+#		define ADD_SINK(x_label, x_prefix) { \
+				if (us_str_is_ok(x_prefix##_name)) { \
+					extra->x_prefix##_name = _make_extra_sink_name(x_prefix##_name, extra->name); \
+					extra->x_prefix = us_memsink_init_opened( \
+						x_label, \
+						extra->x_prefix##_name, \
+						true, \
+						x_prefix##_mode, \
+						x_prefix##_rm, \
+						x_prefix##_client_ttl, \
+						x_prefix##_timeout \
+					); \
+				} \
+			}
+		ADD_SINK("JPEG", jpeg_sink);
+		ADD_SINK("RAW", raw_sink);
+		ADD_SINK("H264", h264_sink);
+#		undef ADD_SINK
+	}
+
+	if (n_h264_layers > 0 && opts->h264_sink == NULL) {
+		printf("H264 layers require --h264-sink\n");
+		return -1;
+	}
+	for (uint i = 0; i < n_h264_layers; ++i) {
+		// Слои наследуют параметры основного H264-синка
+		static const char *const labels[US_STREAM_MAX_H264_LAYERS] = {"H264-L1", "H264-L2", "H264-L3"};
+		opts->h264_layer_sinks[i] = us_memsink_init_opened(
+			labels[i],
+			h264_layer_names[i],
+			true,
+			h264_sink_mode,
+			h264_sink_rm,
+			h264_sink_client_ttl,
+			h264_sink_timeout);
+		if (opts->h264_layer_sinks[i] == NULL) {
+			// Без слоя клиенты молча получат меньше вариантов, чем заказано
+			printf("Can't open H264 layer sink '%s'\n", h264_layer_names[i]);
+			return -1;
+		}
+		us_stream_add_h264_layer(
+			stream, opts->h264_layer_sinks[i],
+			h264_layer_bitrates[i], h264_layer_fps[i], h264_layer_scales[i]);
+	}
+
 #	ifdef WITH_SETPROCTITLE
 	if (process_name_prefix != NULL) {
 		us_process_set_name_prefix(opts->argc, opts->argv, process_name_prefix);
@@ -634,6 +814,68 @@ static int _check_instance_id(const char *str) {
 	return 0;
 }
 
+static int _parse_h264_layer(char *str, const char **name, uint *bitrate, uint *fps, uint *scale) {
+	// Двоеточие может быть в суффиксе имени синка, поэтому разделяем запятыми
+	char *const bitrate_ptr = strchr(str, ',');
+	if (bitrate_ptr == NULL || bitrate_ptr == str) {
+		return -1;
+	}
+	uint tmp_bitrate;
+	uint tmp_fps = 0;
+	uint tmp_scale = 1;
+	char tail;
+	const int count = sscanf(bitrate_ptr + 1, "%u,%u,%u%c", &tmp_bitrate, &tmp_fps, &tmp_scale, &tail);
+	if (
+		count < 1 || count > 3
+		|| tmp_bitrate < 25 || tmp_bitrate > 20000 || tmp_fps > 120
+		|| (tmp_scale != 1 && tmp_scale != 2 && tmp_scale != 4 && tmp_scale != 8)
+	) {
+		return -1;
+	}
+	*bitrate_ptr = '\0';
+	*name = str;
+	*bitrate = tmp_bitrate;
+	*fps = tmp_fps;
+	*scale = tmp_scale;
+	return 0;
+}
+
+static int _parse_extra_device(char *str, char **name, char **path) {
+	// Имя становится префиксом URL, поэтому ограничиваем его простыми символами
+	char *const path_ptr = strchr(str, ':');
+	if (path_ptr == NULL || path_ptr == str || path_ptr[1] == '\0') {
+		return -1;
+	}
+	*path_ptr = '\0';
+	for (const char *ptr = str; *ptr; ++ptr) {
+		if (!(isascii(*ptr) && (isalpha(*ptr) || isdigit(*ptr) || *ptr == '_' || *ptr == '-'))) {
+			return -1;
+		}
+	}
+	*name = str;
+	*path = path_ptr + 1;
+	return 0;
+}
+
+static char *_make_extra_sink_name(const char *obj, const char *name) {
+	// kvmd::ustreamer::jpeg -> kvmd::ustreamer::<name>::jpeg, sink.jpeg -> sink.<name>.jpeg
+	const char *ptr = strrchr(obj, ':');
+	const char *sep = ":";
+	if (ptr == NULL) {
+		ptr = strrchr(obj, '.');
+		sep = ".";
+	} else if (ptr > obj && ptr[-1] == ':') {
+		sep = "::";
+	}
+	char *str;
+	if (ptr == NULL) {
+		US_ASPRINTF(str, "%s.%s", obj, name);
+	} else {
+		US_ASPRINTF(str, "%.*s%s%s%s", (int)(ptr - obj + 1), obj, name, sep, ptr + 1);
+	}
+	return str;
+}
+
 static void _features(void) {
 #	ifdef MK_WITH_PYTHON
 	puts("+ WITH_PYTHON");
@@ -653,6 +895,12 @@ static void _features(void) {
 	puts("- WITH_V4P");
 #	endif
 
+#	ifdef MK_WITH_X264
+	puts("+ WITH_X264");
+#	else
+	puts("- WITH_X264");
+#	endif
+
 #	ifdef MK_WITH_GPIO
 	puts("+ WITH_GPIO");
 #	else
@@ -740,9 +988,36 @@ static void _help(
 	SAY("    -K|--last-as-blank <sec>  ──────────── It doesn't do anything. Still here for compatibility.\n");
 	SAY("    -l|--slowdown  ─────────────────────── Slowdown capturing to 1 FPS or less when no stream or sink clients");
 	SAY("                                           are connected. Useful to reduce CPU consumption. Default: disabled.\n");
+	SAY("    --idle-stop <sec>  ─────────────────── Stop the V4L2 streaming if there have been no stream or sink clients");
+	SAY("                                           in the last N seconds and resume it on the first one. The device,");
+	SAY("                                           the buffers and the encoders are kept ready. Default: 0 (disabled).\n");
+	SAY("    --idle-release <sec>  ──────────────── Free the device buffers after N seconds of the idle stop.");
+	SAY("                                           Makes the resume a bit slower. Requires --idle-stop.");
+	SAY("                                           Default: 0 (disabled).\n");
 	SAY("    --device-timeout <sec>  ────────────── Timeout for device querying. Default: %u.\n", cap->timeout);
 	SAY("    --device-error-delay <sec>  ────────── Delay before trying to connect to the device again");
 	SAY("                                           after an error (timeout for example). Default: %u.\n", stream->error_delay);
+	SAY("    --extra-device <name>:</dev/path>  ─── Capture one more device in the same process and serve it");
+	SAY("                                           under /<name>/ (/<name>/stream, /<name>/snapshot and so on).");
+	SAY("                                           Capturing, encoding and H264 options are the same as for --device.");
+	SAY("                                           Sinks get the name before the suffix: foo::jpeg -> foo::<name>::jpeg.");
+	SAY("                                           --workers becomes the limit for all devices together, and the pool");
+	SAY("                                           of each device grows from --min-workers (default: 1) under load");
+	SAY("                                           taking no more than a fair share if the others need workers too.");
+	SAY("                                           Can be specified up to %u times. Default: disabled.\n", US_SERVER_MAX_MOUNTS);
+	SAY("    --min-workers <N>  ─────────────────── The minimum number of worker threads. If it's less than --workers,");
+	SAY("                                           the pool grows up to --workers under load and shrinks back");
+	SAY("                                           when the encoding keeps up with the frame rate.");
+	SAY("                                           With --extra-device it applies to each device, and the sum");
+	SAY("                                           must fit into --workers. Default: the same as --workers (no scaling).\n");
+	SAY("    --quality-min <N>  ─────────────────── Lower bound of the adaptive JPEG quality. The upper bound is --quality.");
+	SAY("                                           Default: %u.\n", enc->aq_min_quality);
+	SAY("    --quality-target-kbps <N>  ─────────── Adapt JPEG quality on the fly to fit this bitrate in Kbps.");
+	SAY("                                           Also lowers the quality when clients can't keep up.");
+	SAY("                                           Only for CPU encoder. Default: disabled.\n");
+	SAY("    --quality-target-fps <N>  ──────────── Adapt JPEG quality on the fly so the workers can encode");
+	SAY("                                           this number of frames per second. Only for CPU encoder.");
+	SAY("                                           Default: disabled.\n");
 	SAY("    --m2m-device </dev/path>  ──────────── Path to V4L2 M2M encoder device. Default: auto select.\n");
 	SAY("    --media-device </dev/path>  ────────── Path to V4L2 /dev/media* device for setting subdevices");
 	SAY("                                           (currently necessary for RPi5). Default: unset.\n");
@@ -786,6 +1061,10 @@ static void _help(
 	SAY("    -R|--fake-resolution <WxH>  ─ Override image resolution for the /state. Default: disabled.\n");
 	SAY("    --tcp-nodelay  ────────────── Set TCP_NODELAY flag to the client /stream socket. Only for TCP socket.");
 	SAY("                                  Default: disabled.\n");
+	SAY("    --tcp-notsent-lowat <bytes>  ─ Set TCP_NOTSENT_LOWAT to the client /stream socket and size its send");
+	SAY("                                  buffer by the frame size, so that the kernel doesn't queue stale frames");
+	SAY("                                  and the client gets the newest one when the socket drains.");
+	SAY("                                  Can be overridden by the /stream?notsent_lowat=N. Default: disabled.\n");
 	SAY("    --allow-origin <str>  ─────── Set Access-Control-Allow-Origin header. Default: disabled.\n");
 	SAY("    --instance-id <str>  ──────── A short string identifier to be displayed in the /state handle.");
 	SAY("                                  It must satisfy regexp ^[a-zA-Z0-9\\./+_-]*$. Default: an empty string.\n");
@@ -804,10 +1083,27 @@ static void _help(
 	ADD_SINK("RAW", "raw")
 	ADD_SINK("H264", "h264")
 #	undef ADD_SINK
+	SAY("    --h264-encoder <type>  ───────── H264 encoder type: %s. X264 is a software encoder", US_STREAM_H264_ENCODERS_STR);
+	SAY("                                     for hosts without an M2M device, requires WITH_X264. Default: %s.\n", us_stream_h264_encoder_to_string(stream->h264_encoder));
 	SAY("    --h264-bitrate <kbps>  ───────── H264 bitrate in Kbps. Default: %u.\n", stream->h264_bitrate);
 	SAY("    --h264-gop <N>  ──────────────── Interval between keyframes. Default: %u.\n", stream->h264_gop);
 	SAY("    --h264-m2m-device </dev/path>  ─ Path to V4L2 M2M encoder device. Default: auto select.\n");
 	SAY("    --h264-boost  ────────────────── Increase encoder performance on PiKVM V4. Default: disabled.\n");
+	SAY("    --h264-zero-copy  ────────────── Send H264 frames to the sink directly from the encoder buffer.");
+	SAY("                                     The buffer is held until the frame is published.");
+	SAY("                                     Only for the M2M encoder. Default: disabled.\n");
+	SAY("    --h264-intra-refresh  ────────── Use cyclic intra refresh over --h264-gop frames instead of periodic");
+	SAY("                                     keyframes to avoid bitrate spikes. Keyframes requested by sink");
+	SAY("                                     clients are sent at most every 2 seconds. Default: disabled.\n");
+	SAY("    --h264-idle-release <sec>  ───── Free the H264 encoders and their buffers if there have been no");
+	SAY("                                     H264 sink clients in the last N seconds. They are recreated");
+	SAY("                                     on the first client, starting with a keyframe. Default: 0 (disabled).\n");
+	SAY("    --h264-layer <name,kbps[,fps[,div]]>  ─ Add a simulcast layer with its own encoder, bitrate, FPS limit");
+	SAY("                                     and resolution to the sink <name>. The source is downscaled by div");
+	SAY("                                     (1, 2, 4 or 8; MJPEG right in the decoder), so 1080p with div=2 gives");
+	SAY("                                     a 540p rendition. FPS 0 means no extra limit. Layers share the other");
+	SAY("                                     --h264-* and sink options. Requires --h264-sink.");
+	SAY("                                     Can be specified up to %u times. Default: disabled.\n", US_STREAM_MAX_H264_LAYERS);
 #	ifdef WITH_V4P
 	SAY("Passthrough options for PiKVM V4:");
 	SAY("═════════════════════════════════");
@@ -838,6 +1134,20 @@ static void _help(
 	SAY("    --notify-parent  ────────────── Send SIGUSR2 to the parent process when the stream parameters are changed.");
 	SAY("                                    Checking changes is performed for the online flag and image resolution.\n");
 #	endif
+	SAY("Threading options:");
+	SAY("══════════════════");
+	SAY("    --cpus-capture <list>  ──────── Pin the capture threads to the CPU list like 0,2-3. Default: any CPU.\n");
+	SAY("    --cpus-encoder <list>  ──────── Pin the JPEG workers and the H264 and other encoding threads");
+	SAY("                                    to the CPU list. Default: any CPU.\n");
+	SAY("    --cpus-http <list>  ─────────── Pin the HTTP server thread to the CPU list. Default: any CPU.\n");
+	SAY("    --capture-rt-priority <N>  ──── Run the capture threads with SCHED_FIFO policy and this priority.");
+	SAY("                                    Requires CAP_SYS_NICE or RLIMIT_RTPRIO. Default: 0 (disabled).\n");
+	SAY("    --mlock  ────────────────────── Lock all current and future process memory including the capture");
+	SAY("                                    buffers to avoid page faults. Every touched page stays in RAM:");
+	SAY("                                    the capture buffers, the JPEG ring and the encoder frames,");
+	SAY("                                    usually tens of megabytes for 1080p and more with extra devices.");
+	SAY("                                    Requires CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK.");
+	SAY("                                    Default: disabled.\n");
 	SAY("Logging options:");
 	SAY("════════════════");
 	SAY("    --log-level <N>  ──── Verbosity level of messages from 0 (info) to 3 (debug).");
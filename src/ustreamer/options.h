@@ -34,6 +34,17 @@
 #include "http/server.h"
 
 
+typedef struct {
+	char			*name;
+	char			*path;
+	char			*jpeg_sink_name;
+	us_memsink_s	*jpeg_sink;
+	char			*raw_sink_name;
+	us_memsink_s	*raw_sink;
+	char			*h264_sink_name;
+	us_memsink_s	*h264_sink;
+} us_options_extra_s;
+
 typedef struct {
 	uint			argc;
 	char			**argv;
@@ -41,6 +52,9 @@ typedef struct {
 	us_memsink_s	*jpeg_sink;
 	us_memsink_s	*raw_sink;
 	us_memsink_s	*h264_sink;
+	us_memsink_s	*h264_layer_sinks[US_STREAM_MAX_H264_LAYERS];
+	us_options_extra_s	extras[US_SERVER_MAX_MOUNTS];
+	uint			n_extras;
 #	ifdef WITH_V4P
 	us_drm_s		*drm;
 #	endif
@@ -0,0 +1,201 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "sched.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "../libs/types.h"
+#include "../libs/tools.h"
+#include "../libs/logging.h"
+
+
+us_sched_s us_g_sched = {
+#	define MAKE_GROUP(x_role) { \
+		.role = x_role, \
+		.cpus = "", \
+		.rt_priority = 0, \
+	}
+	.capture = MAKE_GROUP("capture"),
+	.encoder = MAKE_GROUP("encoder"),
+	.http = MAKE_GROUP("http"),
+#	undef MAKE_GROUP
+
+	.mlock = false,
+
+	.enabled = false,
+	.locked = false,
+};
+
+
+static int _sched_group_init(us_sched_group_s *group, const cpu_set_t *allowed);
+static int _parse_cpus(const char *str, cpu_set_t *set);
+
+
+int us_sched_init(void) {
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		US_LOG_PERROR("SCHED: Can't get the process CPU affinity");
+		return -1;
+	}
+
+	if (
+		_sched_group_init(&us_g_sched.capture, &allowed) < 0
+		|| _sched_group_init(&us_g_sched.encoder, &allowed) < 0
+		|| _sched_group_init(&us_g_sched.http, &allowed) < 0
+	) {
+		return -1;
+	}
+
+	if (us_g_sched.enabled) {
+#		define LOG_GROUP(x_group) { \
+				US_LOG_INFO("SCHED: Placement of %s threads: cpus=%s, policy=%s, priority=%u", \
+					x_group.role, (us_str_is_ok(x_group.cpus) ? x_group.cpus : "any"), \
+					(x_group.rt_priority > 0 ? "FIFO" : "OTHER"), x_group.rt_priority); \
+			}
+		LOG_GROUP(us_g_sched.capture);
+		LOG_GROUP(us_g_sched.encoder);
+		LOG_GROUP(us_g_sched.http);
+#		undef LOG_GROUP
+	}
+
+	if (us_g_sched.mlock) {
+		// MCL_FUTURE захватывает и буферы, которые будут смаплены при открытии устройств.
+		// С MCL_ONFAULT страница закрепляется при первом обращении, а не сразу при маппинге,
+		// иначе в RAM целиком попали бы все стеки потоков и арены malloc.
+		int flags = MCL_CURRENT | MCL_FUTURE;
+#		ifdef MCL_ONFAULT
+		flags |= MCL_ONFAULT;
+#		endif
+		int retval = mlockall(flags);
+#		ifdef MCL_ONFAULT
+		if (retval < 0 && errno == EINVAL) { // Linux < 4.4
+			retval = mlockall(MCL_CURRENT | MCL_FUTURE);
+		}
+#		endif
+		if (retval < 0) {
+			US_LOG_PERROR("SCHED: Can't lock the process memory");
+			return -1;
+		}
+		US_LOG_INFO("SCHED: Process memory is locked");
+		us_g_sched.locked = true;
+	}
+	return 0;
+}
+
+void us_sched_apply(us_sched_group_s *group) {
+	if (!us_g_sched.enabled) {
+		return;
+	}
+
+	// Новые потоки наследуют привязку и политику создателя, поэтому
+	// их надо явно выставлять даже для групп без настроек.
+	int err;
+	if ((err = pthread_setaffinity_np(pthread_self(), sizeof(group->set), &group->set)) != 0) {
+		errno = err;
+		US_LOG_PERROR("SCHED: Can't set CPU affinity for the %s thread", group->role);
+	}
+
+	const struct sched_param param = {.sched_priority = group->rt_priority};
+	const int policy = (group->rt_priority > 0 ? SCHED_FIFO : SCHED_OTHER);
+	if ((err = pthread_setschedparam(pthread_self(), policy, &param)) != 0) {
+		errno = err;
+		US_LOG_PERROR("SCHED: Can't set scheduling policy for the %s thread", group->role);
+	} else if (group->rt_priority > 0) {
+		atomic_store(&group->rt_active, true);
+	}
+}
+
+static int _sched_group_init(us_sched_group_s *group, const cpu_set_t *allowed) {
+	atomic_init(&group->rt_active, false);
+	memcpy(&group->set, allowed, sizeof(group->set));
+
+	if (us_str_is_ok(group->cpus)) {
+		cpu_set_t set;
+		if (_parse_cpus(group->cpus, &set) < 0) {
+			US_LOG_ERROR("SCHED: Invalid CPU list for the %s threads: %s", group->role, group->cpus);
+			return -1;
+		}
+		cpu_set_t check;
+		CPU_AND(&check, &set, allowed);
+		if (!CPU_EQUAL(&check, &set)) {
+			US_LOG_ERROR("SCHED: Some CPUs for the %s threads are not available: %s", group->role, group->cpus);
+			return -1;
+		}
+		memcpy(&group->set, &set, sizeof(group->set));
+		us_g_sched.enabled = true;
+	}
+
+	if (group->rt_priority > 0) {
+		const int max = sched_get_priority_max(SCHED_FIFO);
+		if (group->rt_priority > (uint)max) {
+			US_LOG_ERROR("SCHED: Too high RT priority for the %s threads: %u > %d",
+				group->role, group->rt_priority, max);
+			return -1;
+		}
+		us_g_sched.enabled = true;
+	}
+
+	return 0;
+}
+
+static int _parse_cpus(const char *str, cpu_set_t *set) {
+	// Формат как в taskset: 0,2-3
+	CPU_ZERO(set);
+	while (*str != '\0') {
+		char *end;
+		errno = 0;
+		const long first = strtol(str, &end, 10);
+		if (end == str || errno != 0 || first < 0 || first >= CPU_SETSIZE) {
+			return -1;
+		}
+		long last = first;
+		str = end;
+		if (*str == '-') {
+			++str;
+			last = strtol(str, &end, 10);
+			if (end == str || errno != 0 || last < first || last >= CPU_SETSIZE) {
+				return -1;
+			}
+			str = end;
+		}
+		for (long cpu = first; cpu <= last; ++cpu) {
+			CPU_SET(cpu, set);
+		}
+		if (*str == ',') {
+			++str;
+			if (*str == '\0') {
+				return -1;
+			}
+		} else if (*str != '\0') {
+			return -1;
+		}
+	}
+	return (CPU_COUNT(set) > 0 ? 0 : -1);
+}
@@ -0,0 +1,57 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include <sched.h>
+
+#include "../libs/types.h"
+
+
+typedef struct {
+	const char	*role;
+	char		*cpus;
+	uint		rt_priority;
+
+	cpu_set_t	set;
+	atomic_bool	rt_active;
+} us_sched_group_s;
+
+typedef struct {
+	us_sched_group_s	capture;
+	us_sched_group_s	encoder;
+	us_sched_group_s	http;
+
+	bool	mlock;
+
+	bool	enabled;
+	bool	locked;
+} us_sched_s;
+
+
+extern us_sched_s us_g_sched;
+
+
+int us_sched_init(void);
+void us_sched_apply(us_sched_group_s *group);
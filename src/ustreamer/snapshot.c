@@ -0,0 +1,366 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "snapshot.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <linux/videodev2.h>
+
+#include "../libs/types.h"
+#include "../libs/tools.h"
+#include "../libs/threading.h"
+#include "../libs/logging.h"
+#include "../libs/frame.h"
+#include "../libs/unjpeg.h"
+
+#include "encoders/cpu/encoder.h"
+
+
+static int _snapshot_encode(us_snapshot_s *snap, const us_snapshot_job_s *job, uint quality, us_frame_s *dest);
+static int _snapshot_resize(const us_frame_s *src, us_frame_s *dest, uint width);
+static bool _snapshot_read_line(const us_frame_s *src, uint y, u8 *line);
+static void _snapshot_cache_put(us_snapshot_s *snap, const us_snapshot_job_s *job, const us_frame_s *jpeg);
+
+
+us_snapshot_s *us_snapshot_init(void) {
+	us_snapshot_s *snap;
+	US_CALLOC(snap, 1);
+	US_MUTEX_INIT(snap->mutex);
+	atomic_init(&snap->wants_raw, false);
+	snap->raw_id = us_get_now_id(); // Для ETag, как и у основного кадра
+	snap->raw = us_frame_init();
+	snap->tmp_rgb = us_frame_init();
+	snap->tmp_resized = us_frame_init();
+	snap->tmp_dest = us_frame_init();
+	for (uint i = 0; i < US_SNAPSHOT_CACHE_SIZE; ++i) {
+		snap->cache[i].jpeg = us_frame_init();
+	}
+	return snap;
+}
+
+void us_snapshot_destroy(us_snapshot_s *snap) {
+	for (uint i = 0; i < US_SNAPSHOT_CACHE_SIZE; ++i) {
+		us_frame_destroy(snap->cache[i].jpeg);
+	}
+	us_frame_destroy(snap->tmp_dest);
+	us_frame_destroy(snap->tmp_resized);
+	us_frame_destroy(snap->tmp_rgb);
+	us_frame_destroy(snap->raw);
+	US_MUTEX_DESTROY(snap->mutex);
+	free(snap);
+}
+
+bool us_snapshot_request(us_snapshot_s *snap, uint quality, uint width, u64 *raw_id) {
+	US_MUTEX_LOCK(snap->mutex);
+	bool found = false;
+	for (uint i = 0; i < snap->n_jobs; ++i) {
+		if (snap->jobs[i].quality == quality && snap->jobs[i].width == width) {
+			found = true;
+			break;
+		}
+	}
+	if (!found) {
+		if (snap->n_jobs >= US_SNAPSHOT_MAX_JOBS) {
+			US_MUTEX_UNLOCK(snap->mutex);
+			return false;
+		}
+		snap->jobs[snap->n_jobs].quality = quality;
+		snap->jobs[snap->n_jobs].width = width;
+		++snap->n_jobs;
+	}
+	// Клиент ждет кадр, захваченный после запроса, то есть с большим номером
+	*raw_id = snap->raw_id;
+	atomic_store(&snap->wants_raw, true);
+	US_MUTEX_UNLOCK(snap->mutex);
+	return true;
+}
+
+bool us_snapshot_get(
+	us_snapshot_s *snap, uint quality, uint width,
+	u64 after_id, ldf min_grab_ts, us_frame_s *dest, u64 *raw_id) {
+
+	bool found = false;
+	US_MUTEX_LOCK(snap->mutex);
+	for (uint i = 0; i < US_SNAPSHOT_CACHE_SIZE; ++i) {
+		us_snapshot_entry_s *const entry = &snap->cache[i];
+		if (
+			entry->jpeg->used > 0
+			&& entry->quality == quality && entry->width == width
+			&& entry->raw_id > after_id
+			&& entry->jpeg->grab_begin_ts >= min_grab_ts
+		) {
+			entry->used_ts = us_get_now_monotonic();
+			us_frame_copy(entry->jpeg, dest);
+			*raw_id = entry->raw_id;
+			found = true;
+			break;
+		}
+	}
+	US_MUTEX_UNLOCK(snap->mutex);
+	return found;
+}
+
+bool us_snapshot_wants_raw(us_snapshot_s *snap) {
+	return atomic_load(&snap->wants_raw);
+}
+
+void us_snapshot_retain_raw(us_snapshot_s *snap, const us_frame_s *raw) {
+	// Копируем без блокировки, сырой кадр принадлежит только воркеру
+	us_frame_copy(raw, snap->raw);
+
+	US_MUTEX_LOCK(snap->mutex);
+	++snap->raw_id;
+	snap->work_raw_id = snap->raw_id;
+	memcpy(snap->work, snap->jobs, sizeof(snap->jobs));
+	snap->n_work = snap->n_jobs;
+	snap->n_jobs = 0;
+	atomic_store(&snap->wants_raw, false);
+	US_MUTEX_UNLOCK(snap->mutex);
+}
+
+void us_snapshot_process(us_snapshot_s *snap, uint quality) {
+	for (uint i = 0; i < snap->n_work; ++i) {
+		const us_snapshot_job_s *const job = &snap->work[i];
+		const ldf begin_ts = us_get_now_monotonic();
+		if (_snapshot_encode(snap, job, quality, snap->tmp_dest) < 0) {
+			US_LOG_ERROR("SNAPSHOT: Can't encode quality=%u, width=%u", job->quality, job->width);
+			continue;
+		}
+		_snapshot_cache_put(snap, job, snap->tmp_dest);
+		US_LOG_VERBOSE("SNAPSHOT: Encoded quality=%u, width=%u: %ux%u, %zu bytes, time=%.3Lf",
+			job->quality, job->width, snap->tmp_dest->width, snap->tmp_dest->height,
+			snap->tmp_dest->used, us_get_now_monotonic() - begin_ts);
+	}
+	snap->n_work = 0;
+}
+
+static int _snapshot_encode(us_snapshot_s *snap, const us_snapshot_job_s *job, uint quality, us_frame_s *dest) {
+	const us_frame_s *src = snap->raw;
+	const bool resize = (job->width > 0 && job->width < src->width);
+	if (job->quality > 0) {
+		quality = job->quality;
+	}
+
+	if (us_is_jpeg(src->format)) {
+		if (!resize && job->quality == 0) {
+			// Ни размер, ни качество не меняются, перекодирование ничего не даст
+			us_frame_copy(src, dest);
+			return 0;
+		}
+
+		// Грубую часть уменьшения делаем бесплатно в DCT при декодировании
+		uint scale = 1;
+		while (resize && scale < 8 && src->width / (scale * 2) >= job->width) {
+			scale *= 2;
+		}
+		if (us_unjpeg_scaled(src, snap->tmp_rgb, true, scale) < 0) {
+			return -1;
+		}
+		src = snap->tmp_rgb;
+	}
+
+	if (resize && src->width > job->width) {
+		// Сырые форматы уменьшаются сразу в RGB, так что JPEG кодируется один раз
+		if (_snapshot_resize(src, snap->tmp_resized, job->width) < 0) {
+			return -1;
+		}
+		src = snap->tmp_resized;
+	}
+	us_cpu_encoder_compress(src, dest, quality);
+	return 0;
+}
+
+static int _snapshot_resize(const us_frame_s *src, us_frame_s *dest, uint width) {
+	// Усреднение по площади, для уменьшения этого достаточно
+	const uint height = US_MAX((uint)((u64)src->height * width / src->width), (uint)1);
+
+	u8 *line;
+	US_CALLOC(line, (uz)src->width * 3);
+	uint *sums;
+	US_CALLOC(sums, (uz)width * 3);
+
+	US_FRAME_COPY_META(src, dest);
+	dest->format = V4L2_PIX_FMT_RGB24;
+	dest->width = width;
+	dest->height = height;
+	dest->stride = width * 3;
+	us_frame_realloc_data(dest, (uz)dest->stride * height);
+	dest->used = (uz)dest->stride * height;
+
+	int retval = 0;
+	for (uint dy = 0; dy < height; ++dy) {
+		const uint y0 = (u64)dy * src->height / height;
+		const uint y1 = US_MAX((uint)((u64)(dy + 1) * src->height / height), y0 + 1);
+
+		memset(sums, 0, sizeof(uint) * width * 3);
+		for (uint y = y0; y < y1; ++y) {
+			if (!_snapshot_read_line(src, y, line)) {
+				retval = -1;
+				goto done;
+			}
+			for (uint dx = 0; dx < width; ++dx) {
+				const uint x0 = (u64)dx * src->width / width;
+				const uint x1 = US_MAX((uint)((u64)(dx + 1) * src->width / width), x0 + 1);
+				for (uint x = x0; x < x1; ++x) {
+					sums[dx * 3] += line[x * 3];
+					sums[dx * 3 + 1] += line[x * 3 + 1];
+					sums[dx * 3 + 2] += line[x * 3 + 2];
+				}
+			}
+		}
+
+		u8 *const out = dest->data + (uz)dy * dest->stride;
+		for (uint dx = 0; dx < width; ++dx) {
+			const uint x0 = (u64)dx * src->width / width;
+			const uint x1 = US_MAX((uint)((u64)(dx + 1) * src->width / width), x0 + 1);
+			const uint count = (y1 - y0) * (x1 - x0);
+			out[dx * 3] = sums[dx * 3] / count;
+			out[dx * 3 + 1] = sums[dx * 3 + 1] / count;
+			out[dx * 3 + 2] = sums[dx * 3 + 2] / count;
+		}
+	}
+
+done:
+	free(sums);
+	free(line);
+	return retval;
+}
+
+static bool _snapshot_read_line(const us_frame_s *src, uint y, u8 *line) {
+	// Разворачивает строку любого формата CPU-энкодера в RGB24
+#	define CLAMP(x_value) ((u8)US_MIN(US_MAX((x_value), 0), 255))
+#	define PUT_YUV(x_y, x_u, x_v) { \
+			const int m_y = (x_y); \
+			const int m_u = (int)(x_u) - 128; \
+			const int m_v = (int)(x_v) - 128; \
+			line[x * 3] = CLAMP(m_y + ((359 * m_v) >> 8)); \
+			line[x * 3 + 1] = CLAMP(m_y - ((88 * m_u + 183 * m_v) >> 8)); \
+			line[x * 3 + 2] = CLAMP(m_y + ((454 * m_u) >> 8)); \
+		}
+
+	const uint stride = src->stride;
+	const u8 *const data = src->data + (uz)y * stride;
+
+	switch (src->format) {
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY:
+			for (uint x = 0; x < src->width; ++x) {
+				const u8 *const pair = data + (x >> 1) * 4;
+				const bool is_odd_pixel = x & 1;
+				if (src->format == V4L2_PIX_FMT_YUYV) {
+					PUT_YUV(pair[is_odd_pixel ? 2 : 0], pair[1], pair[3]);
+				} else if (src->format == V4L2_PIX_FMT_YVYU) {
+					PUT_YUV(pair[is_odd_pixel ? 2 : 0], pair[3], pair[1]);
+				} else {
+					PUT_YUV(pair[is_odd_pixel ? 3 : 1], pair[0], pair[2]);
+				}
+			}
+			break;
+
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YVU420: {
+			const uz luma_size = (uz)stride * src->height;
+			const uz chroma_size = (src->used - luma_size) >> 1;
+			const u8 *chroma1 = src->data + luma_size + (uz)(y >> 1) * (stride >> 1);
+			const u8 *chroma2 = chroma1 + chroma_size;
+			if (src->format == V4L2_PIX_FMT_YVU420) {
+				const u8 *const tmp = chroma1;
+				chroma1 = chroma2;
+				chroma2 = tmp;
+			}
+			for (uint x = 0; x < src->width; ++x) {
+				PUT_YUV(data[x], chroma1[x >> 1], chroma2[x >> 1]);
+			}
+			break;
+		}
+
+		case V4L2_PIX_FMT_GREY:
+			for (uint x = 0; x < src->width; ++x) {
+				line[x * 3] = line[x * 3 + 1] = line[x * 3 + 2] = data[x];
+			}
+			break;
+
+		case V4L2_PIX_FMT_RGB565:
+			for (uint x = 0; x < src->width; ++x) {
+				const u8 *const px = data + x * 2;
+				const uint two_byte = (px[1] << 8) + px[0];
+				line[x * 3] = px[1] & 248; // Red
+				line[x * 3 + 1] = (u8)((two_byte & 2016) >> 3); // Green
+				line[x * 3 + 2] = (px[0] & 31) * 8; // Blue
+			}
+			break;
+
+		case V4L2_PIX_FMT_RGB24:
+			memcpy(line, data, (uz)src->width * 3);
+			break;
+
+		case V4L2_PIX_FMT_BGR24:
+			for (uint x = 0; x < src->width; ++x) {
+				line[x * 3] = data[x * 3 + 2];
+				line[x * 3 + 1] = data[x * 3 + 1];
+				line[x * 3 + 2] = data[x * 3];
+			}
+			break;
+
+		default: return false;
+	}
+	return true;
+
+#	undef PUT_YUV
+#	undef CLAMP
+}
+
+static void _snapshot_cache_put(us_snapshot_s *snap, const us_snapshot_job_s *job, const us_frame_s *jpeg) {
+	US_MUTEX_LOCK(snap->mutex);
+	// Та же пара параметров заменяется, иначе занимаем пустой слот или вытесняем давно не использованный
+	us_snapshot_entry_s *victim = NULL;
+	for (uint i = 0; i < US_SNAPSHOT_CACHE_SIZE; ++i) {
+		us_snapshot_entry_s *const entry = &snap->cache[i];
+		if (entry->jpeg->used > 0 && entry->quality == job->quality && entry->width == job->width) {
+			victim = entry;
+			break;
+		}
+	}
+	if (victim == NULL) {
+		victim = &snap->cache[0];
+		for (uint i = 0; i < US_SNAPSHOT_CACHE_SIZE; ++i) {
+			us_snapshot_entry_s *const entry = &snap->cache[i];
+			if (entry->jpeg->used == 0) {
+				victim = entry;
+				break;
+			}
+			if (entry->used_ts < victim->used_ts) {
+				victim = entry;
+			}
+		}
+	}
+	victim->quality = job->quality;
+	victim->width = job->width;
+	victim->raw_id = snap->work_raw_id;
+	victim->used_ts = us_get_now_monotonic();
+	us_frame_copy(jpeg, victim->jpeg);
+	US_MUTEX_UNLOCK(snap->mutex);
+}
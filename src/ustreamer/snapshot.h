@@ -0,0 +1,80 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "../libs/types.h"
+#include "../libs/frame.h"
+
+
+#define US_SNAPSHOT_MAX_JOBS	8
+#define US_SNAPSHOT_CACHE_SIZE	8
+
+
+typedef struct {
+	uint	quality;
+	uint	width;
+} us_snapshot_job_s;
+
+typedef struct {
+	uint		quality;
+	uint		width;
+	u64			raw_id;
+	ldf			used_ts; // For LRU
+	us_frame_s	*jpeg;
+} us_snapshot_entry_s;
+
+typedef struct {
+	pthread_mutex_t		mutex;
+	atomic_bool			wants_raw;
+
+	u64					raw_id;
+	us_snapshot_job_s	jobs[US_SNAPSHOT_MAX_JOBS]; // Requested by HTTP
+	uint				n_jobs;
+	us_snapshot_entry_s	cache[US_SNAPSHOT_CACHE_SIZE];
+
+	// Worker only
+	us_frame_s			*raw;
+	u64					work_raw_id;
+	us_snapshot_job_s	work[US_SNAPSHOT_MAX_JOBS];
+	uint				n_work;
+	us_frame_s			*tmp_rgb;
+	us_frame_s			*tmp_resized;
+	us_frame_s			*tmp_dest;
+} us_snapshot_s;
+
+
+us_snapshot_s *us_snapshot_init(void);
+void us_snapshot_destroy(us_snapshot_s *snap);
+
+bool us_snapshot_request(us_snapshot_s *snap, uint quality, uint width, u64 *raw_id);
+bool us_snapshot_get(
+	us_snapshot_s *snap, uint quality, uint width,
+	u64 after_id, ldf min_grab_ts, us_frame_s *dest, u64 *raw_id);
+
+bool us_snapshot_wants_raw(us_snapshot_s *snap);
+void us_snapshot_retain_raw(us_snapshot_s *snap, const us_frame_s *raw);
+void us_snapshot_process(us_snapshot_s *snap, uint quality);
@@ -23,12 +23,13 @@
 #include "stream.h"
 
 #include <stdlib.h>
+#include <strings.h>
 #include <stdatomic.h>
 #include <limits.h>
 #include <unistd.h>
 #include <errno.h>
-#include <math.h>
 
+#include <sched.h>
 #include <pthread.h>
 
 #include <event2/event.h> // jpeg_refresher
@@ -44,6 +45,7 @@
 #include "../libs/memsink.h"
 #include "../libs/capture.h"
 #include "../libs/unjpeg.h"
+#include "../libs/scale.h"
 #include "../libs/fpsi.h"
 #ifdef WITH_V4P
 #	include "../libs/drm/drm.h"
@@ -53,6 +55,8 @@
 #include "encoder.h"
 #include "workers.h"
 #include "m2m.h"
+#include "sched.h"
+#include "encoders/hw/encoder.h"
 #ifdef WITH_GPIO
 #	include "gpio/gpio.h"
 #endif
@@ -78,6 +82,7 @@ static void *_releaser_thread(void *v_ctx);
 static void *_jpeg_thread(void *v_ctx);
 static void *_raw_thread(void *v_ctx);
 static void *_h264_thread(void *v_ctx);
+static void *_snapshot_thread(void *v_ctx);
 #ifdef WITH_V4P
 static void *_drm_thread(void *v_ctx);
 #endif
@@ -85,15 +90,36 @@ static void *_drm_thread(void *v_ctx);
 static us_capture_hwbuf_s *_get_latest_hw(us_queue_s *q);
 
 static bool _stream_has_jpeg_clients_cached(us_stream_s *stream);
+static bool _stream_has_h264_layers_clients_cached(us_stream_s *stream);
 static bool _stream_has_any_clients_cached(us_stream_s *stream);
+static void _stream_update_sinks(us_stream_s *stream, bool with_h264);
+static void _stream_update_h264_sinks(us_stream_s *stream);
 static int _stream_init_loop(us_stream_s *stream);
+static int _stream_lock_released(us_stream_s *stream, pthread_mutex_t *release_mutex);
+static int _stream_renegotiate(us_stream_s *stream, pthread_mutex_t *release_mutex);
+static int _stream_idle(us_stream_s *stream, pthread_mutex_t *release_mutex, ldf *active_ts);
 static void _stream_update_captured_fpsi(us_stream_s *stream, const us_frame_s *frame, bool bump);
 #ifdef WITH_V4P
 static void _stream_drm_ensure_no_signal(us_stream_s *stream);
 #endif
-static void _stream_expose_jpeg(us_stream_s *stream, const us_frame_s *frame);
+static void _stream_expose_jpeg_job(us_stream_s *stream, us_worker_s *wr);
+static void _stream_expose_jpeg(us_stream_s *stream, const us_frame_s *frame, bool passthrough);
 static void _stream_expose_raw(us_stream_s *stream, const us_frame_s *frame);
+static void _stream_h264_init(us_stream_s *stream);
+static void _stream_h264_destroy(us_stream_s *stream);
+static bool _stream_h264_ensure(us_stream_s *stream);
+static bool _stream_h264_check_fps(
+	us_stream_s *stream, const us_m2m_encoder_s *enc, uint fps,
+	us_pacer_s *pacer, const us_frame_s *frame, const char *name);
+static const us_frame_s *_stream_h264_get_src(us_stream_s *stream, const us_frame_s *frame);
+static const us_frame_s *_stream_h264_get_layer_src(
+	us_stream_s *stream, us_stream_h264_layer_s *layer, const us_frame_s *frame);
 static void _stream_encode_expose_h264(us_stream_s *stream, const us_frame_s *frame, bool force_key);
+static void _stream_encode_expose_h264_layer(
+	us_stream_s *stream, us_stream_h264_layer_s *layer, const us_frame_s *frame, bool force_key);
+static bool _stream_h264_get_adapted_bitrate(uint base, uint current, uint wanted, uint *bitrate);
+static void _stream_adapt_h264_bitrate(us_stream_s *stream, uint wanted);
+static void _stream_adapt_h264_layer_bitrate(us_stream_s *stream, us_stream_h264_layer_s *layer, uint wanted);
 static void _stream_check_suicide(us_stream_s *stream);
 
 
@@ -104,15 +130,24 @@ us_stream_s *us_stream_init(us_capture_s *cap, us_encoder_s *enc) {
 	http->drm_fpsi = us_fpsi_init("DRM", true);
 #	endif
 	http->h264_fpsi = us_fpsi_init("H264", true);
+	atomic_init(&http->h264_bitrate, 0);
+	atomic_init(&http->h264_released, false);
+	http->jpeg_encoded_fpsi = us_fpsi_init("JPEG-ENCODED", false);
+	http->jpeg_wasted_fpsi = us_fpsi_init("JPEG-WASTED", false);
+	http->jpeg_paced_fpsi = us_fpsi_init("JPEG-PACED", false);
 	US_RING_INIT_WITH_ITEMS(http->jpeg_ring, 4, us_frame_init);
 	atomic_init(&http->has_clients, false);
 	atomic_init(&http->snapshot_requested, 0);
+	http->snapshot = us_snapshot_init();
 	atomic_init(&http->last_req_ts, 0);
+	atomic_init(&http->idle, false);
+	atomic_init(&http->clients_backlog, 0);
 	http->captured_fpsi = us_fpsi_init("STREAM-CAPTURED", true);
 
 	us_stream_runtime_s *run;
 	US_CALLOC(run, 1);
 	atomic_init(&run->stop, false);
+	atomic_init(&run->h264_resumed, false);
 	run->blank = us_blank_init();
 	run->http = http;
 
@@ -137,9 +172,16 @@ void us_stream_update_blank(us_stream_s *stream, const us_capture_s *cap) {
 }
 
 void us_stream_destroy(us_stream_s *stream) {
+	for (uint i = 0; i < stream->n_h264_layers; ++i) {
+		us_fpsi_destroy(stream->h264_layers[i].fpsi);
+	}
 	us_fpsi_destroy(stream->run->http->captured_fpsi);
 	US_RING_DELETE_WITH_ITEMS(stream->run->http->jpeg_ring, us_frame_destroy);
 	us_fpsi_destroy(stream->run->http->h264_fpsi);
+	us_fpsi_destroy(stream->run->http->jpeg_encoded_fpsi);
+	us_fpsi_destroy(stream->run->http->jpeg_wasted_fpsi);
+	us_fpsi_destroy(stream->run->http->jpeg_paced_fpsi);
+	us_snapshot_destroy(stream->run->http->snapshot);
 #	ifdef WITH_V4P
 	us_fpsi_destroy(stream->run->http->drm_fpsi);
 #	endif
@@ -149,6 +191,20 @@ void us_stream_destroy(us_stream_s *stream) {
 	free(stream);
 }
 
+int us_stream_add_h264_layer(us_stream_s *stream, us_memsink_s *sink, uint bitrate, uint fps, uint scale) {
+	if (stream->n_h264_layers >= US_STREAM_MAX_H264_LAYERS) {
+		return -1;
+	}
+	us_stream_h264_layer_s *const layer = &stream->h264_layers[stream->n_h264_layers];
+	layer->sink = sink;
+	layer->bitrate = bitrate;
+	layer->fps = fps;
+	layer->scale = scale;
+	layer->fpsi = us_fpsi_init(sink->name, true);
+	++stream->n_h264_layers;
+	return 0;
+}
+
 void us_stream_loop(us_stream_s *stream) {
 	us_stream_runtime_s *const run = stream->run;
 	us_capture_s *const cap = stream->cap;
@@ -156,15 +212,7 @@ void us_stream_loop(us_stream_s *stream) {
 	atomic_store(&run->http->last_req_ts, us_get_now_monotonic());
 
 	if (stream->h264_sink != NULL) {
-		run->h264_enc = us_m2m_h264_encoder_init(
-			"H264",
-			stream->h264_m2m_path,
-			stream->h264_bitrate,
-			stream->h264_gop,
-			stream->h264_boost);
-
-		run->h264_tmp_src = us_frame_init();
-		run->h264_dest = us_frame_init();
+		_stream_h264_init(stream);
 	}
 
 	while (!_stream_init_loop(stream)) {
@@ -185,18 +233,20 @@ void us_stream_loop(us_stream_s *stream) {
 			US_THREAD_CREATE(ctx->tid, _releaser_thread, ctx);
 		}
 
-#		define CREATE_WORKER(x_cond, x_ctx, x_thread, x_capacity) \
-			_worker_context_s *x_ctx = NULL; \
-			if (x_cond) { \
+#		define START_WORKER(x_ctx, x_thread, x_capacity) { \
 				US_CALLOC(x_ctx, 1); \
 				x_ctx->q = us_queue_init(x_capacity); \
 				x_ctx->stream = stream; \
 				x_ctx->stop = &threads_stop; \
 				US_THREAD_CREATE(x_ctx->tid, (x_thread), x_ctx); \
 			}
+#		define CREATE_WORKER(x_cond, x_ctx, x_thread, x_capacity) \
+			_worker_context_s *x_ctx = NULL; \
+			if (x_cond) START_WORKER(x_ctx, x_thread, x_capacity);
 		CREATE_WORKER(true, jpeg_ctx, _jpeg_thread, cap->run->n_bufs);
 		CREATE_WORKER((stream->raw_sink != NULL), raw_ctx, _raw_thread, 2);
 		CREATE_WORKER((stream->h264_sink != NULL), h264_ctx, _h264_thread, cap->run->n_bufs);
+		CREATE_WORKER(false, snapshot_ctx, _snapshot_thread, 1); // Started by the first HQ snapshot request
 #		ifdef WITH_V4P
 		CREATE_WORKER((stream->drm != NULL), drm_ctx, _drm_thread, cap->run->n_bufs);
 #		endif
@@ -205,18 +255,30 @@ void us_stream_loop(us_stream_s *stream) {
 		US_LOG_INFO("Capturing ...");
 
 		uint slowdown_count = 0;
+		ldf active_ts = us_get_now_monotonic();
 		while (!atomic_load(&run->stop) && !atomic_load(&threads_stop)) {
+			if (_stream_idle(stream, &release_mutex, &active_ts) < 0) {
+				goto close;
+			}
+
 			us_capture_hwbuf_s *hw;
 			switch (us_capture_hwbuf_grab(cap, &hw)) {
 				case 0 ... INT_MAX: break; // Grabbed buffer number
 				case US_ERROR_NO_DATA: continue; // Broken frame
+				case US_ERROR_SOURCE_CHANGED:
+					if (_stream_renegotiate(stream, &release_mutex) == 0) {
+						continue; // Threads and encoders are kept alive
+					}
+					goto close;
 				default: goto close; // Any error
 			}
 
 			_stream_update_captured_fpsi(stream, &hw->raw, true);
 
 #			ifdef WITH_GPIO
-			us_gpio_set_stream_online(true);
+			if (!stream->secondary) {
+				us_gpio_set_stream_online(true);
+			}
 #			endif
 
 #			define QUEUE_HW(x_ctx) if (x_ctx != NULL) { \
@@ -229,6 +291,12 @@ void us_stream_loop(us_stream_s *stream) {
 #			ifdef WITH_V4P
 			QUEUE_HW(drm_ctx);
 #			endif
+			if (us_snapshot_wants_raw(run->http->snapshot)) {
+				if (snapshot_ctx == NULL) {
+					START_WORKER(snapshot_ctx, _snapshot_thread, 1);
+				}
+				QUEUE_HW(snapshot_ctx);
+			}
 #			undef QUEUE_HW
 			us_queue_put(releasers[hw->buf.index].q, hw, 0); // Plan to release
 
@@ -244,6 +312,7 @@ void us_stream_loop(us_stream_s *stream) {
 		}
 
 	close:
+#		undef START_WORKER
 		atomic_store(&threads_stop, true);
 
 #		define DELETE_WORKER(x_ctx) if (x_ctx != NULL) { \
@@ -254,6 +323,7 @@ void us_stream_loop(us_stream_s *stream) {
 #		ifdef WITH_V4P
 		DELETE_WORKER(drm_ctx);
 #		endif
+		DELETE_WORKER(snapshot_ctx);
 		DELETE_WORKER(h264_ctx);
 		DELETE_WORKER(raw_ctx);
 		DELETE_WORKER(jpeg_ctx);
@@ -267,6 +337,7 @@ void us_stream_loop(us_stream_s *stream) {
 		US_MUTEX_DESTROY(release_mutex);
 
 		atomic_store(&threads_stop, false);
+		atomic_store(&run->http->idle, false);
 
 		us_encoder_close(stream->enc);
 		us_capture_close(cap);
@@ -276,17 +347,32 @@ void us_stream_loop(us_stream_s *stream) {
 		}
 	}
 
-	US_DELETE(run->h264_enc, us_m2m_encoder_destroy);
-	US_DELETE(run->h264_tmp_src, us_frame_destroy);
-	US_DELETE(run->h264_dest, us_frame_destroy);
+	_stream_h264_destroy(stream);
 }
 
 void us_stream_loop_break(us_stream_s *stream) {
 	atomic_store(&stream->run->stop, true);
 }
 
+int us_stream_parse_h264_encoder(const char *str) {
+	if (!strcasecmp(str, "M2M")) {
+		return US_STREAM_H264_ENCODER_M2M;
+	}
+#	ifdef WITH_X264
+	if (!strcasecmp(str, "X264")) {
+		return US_STREAM_H264_ENCODER_X264;
+	}
+#	endif
+	return -1;
+}
+
+const char *us_stream_h264_encoder_to_string(us_stream_h264_encoder_e encoder) {
+	return (encoder == US_STREAM_H264_ENCODER_X264 ? "X264" : "M2M");
+}
+
 static void *_releaser_thread(void *v_ctx) {
 	US_THREAD_SETTLE("str_rel")
+	us_sched_apply(&us_g_sched.capture);
 	_releaser_context_s *ctx = v_ctx;
 
 	while (!atomic_load(ctx->stop)) {
@@ -317,33 +403,26 @@ done:
 
 static void *_jpeg_thread(void *v_ctx) {
 	US_THREAD_SETTLE("str_jpeg")
+	us_sched_apply(&us_g_sched.encoder);
 	_worker_context_s *ctx = v_ctx;
 	us_stream_s *stream = ctx->stream;
 
-	uint take = 1;
-	uint step = 1;
+	us_pacer_s pacer = {0};
 
-	ldf grab_after_ts = 0;
-	uint fluency_passed = 0;
+	us_encoder_type_e type;
+	uint quality;
+	us_encoder_get_runtime_params(stream->enc, &type, &quality);
+	// HW-энкодер ничего не кодирует, так что для него пула воркеров нет вовсе
+	const bool passthrough = (type == US_ENCODER_TYPE_HW);
+	US_A(passthrough == (stream->enc->run->pool == NULL));
 
 	while (!atomic_load(ctx->stop)) {
-		us_worker_s *const wr = us_workers_pool_wait(stream->enc->run->pool);
-		us_encoder_job_s *const job = wr->job;
-
-		if (job->hw != NULL) {
-			us_capture_hwbuf_decref(job->hw);
-			job->hw = NULL;
-			if (wr->job_failed) {
-				// pass
-			} else if (wr->job_timely) {
-				_stream_expose_jpeg(stream, job->dest);
-				if (atomic_load(&stream->run->http->snapshot_requested) > 0) { // Process real snapshots
-					atomic_fetch_sub(&stream->run->http->snapshot_requested, 1);
-				}
-				US_LOG_PERF("JPEG: ##### Encoded JPEG exposed; worker=%s, latency=%.3Lf",
-					wr->name, us_get_now_monotonic() - job->dest->grab_begin_ts);
-			} else {
-				US_LOG_PERF("JPEG: ----- Encoded JPEG dropped; worker=%s", wr->name);
+		us_worker_s *wr = NULL;
+		if (!passthrough) {
+			wr = us_workers_pool_wait(stream->enc->run->pool);
+			_stream_expose_jpeg_job(stream, wr);
+			if (us_workers_pool_autoscale(stream->enc->run->pool, wr)) {
+				continue; // The worker was stopped
 			}
 		}
 
@@ -359,33 +438,31 @@ static void *_jpeg_thread(void *v_ctx) {
 			continue;
 		}
 
-		if (stream->desired_fps > 0) {
-			const uint captured_fps = us_fpsi_get(stream->run->http->captured_fpsi, NULL);
-			take = ceilf((float)captured_fps / (float)stream->desired_fps);
-			if (step < take) {
-				US_LOG_DEBUG("JPEG: Passed encoding for FPS limit: step=%u, take=%u", step, take);
-				++step;
-				us_capture_hwbuf_decref(hw);
-				continue;
-			} else {
-				step = 1;
-			}
+		if (!us_pacer_check(&pacer, stream->desired_fps, hw->raw.grab_begin_ts)) {
+			US_LOG_DEBUG("JPEG: Passed encoding for FPS limit");
+			us_capture_hwbuf_decref(hw);
+			continue;
 		}
 
-		const ldf now_ts = us_get_now_monotonic();
-		if (now_ts < grab_after_ts) {
-			fluency_passed += 1;
-			US_LOG_VERBOSE("JPEG: Passed %u frames for fluency: now=%.03Lf, grab_after=%.03Lf",
-				fluency_passed, now_ts, grab_after_ts);
+		if (passthrough) {
+			_stream_expose_jpeg(stream, &hw->raw, true);
+			us_fpsi_update(stream->run->http->jpeg_paced_fpsi, true, NULL);
+			if (atomic_load(&stream->run->http->snapshot_requested) > 0) {
+				atomic_fetch_sub(&stream->run->http->snapshot_requested, 1);
+			}
+			US_LOG_PERF("JPEG: ##### Passthrough JPEG exposed; buffer=%u, latency=%.3Lf",
+				hw->buf.index, us_get_now_monotonic() - hw->raw.grab_begin_ts);
 			us_capture_hwbuf_decref(hw);
 			continue;
 		}
-		fluency_passed = 0;
 
-		const ldf fluency_delay = us_workers_pool_get_fluency_delay(stream->enc->run->pool, wr);
-		grab_after_ts = now_ts + fluency_delay;
-		US_LOG_VERBOSE("JPEG: Fluency: delay=%.03Lf, grab_after=%.03Lf", fluency_delay, grab_after_ts);
+		if (!us_workers_pool_schedule(stream->enc->run->pool, wr, hw->raw.grab_begin_ts)) {
+			// Кадр все равно был бы выброшен, не тратим на него время
+			us_capture_hwbuf_decref(hw);
+			continue;
+		}
 
+		us_encoder_job_s *const job = wr->job;
 		job->hw = hw;
 		us_workers_pool_assign(stream->enc->run->pool, wr);
 		US_LOG_DEBUG("JPEG: Assigned new frame in buffer=%d to worker=%s", hw->buf.index, wr->name);
@@ -393,8 +470,35 @@ static void *_jpeg_thread(void *v_ctx) {
 	return NULL;
 }
 
+static void _stream_expose_jpeg_job(us_stream_s *stream, us_worker_s *wr) {
+	us_encoder_job_s *const job = wr->job;
+	if (job->hw == NULL) {
+		return;
+	}
+
+	us_capture_hwbuf_decref(job->hw);
+	job->hw = NULL;
+	us_fpsi_update(stream->run->http->jpeg_encoded_fpsi, !wr->job_failed, NULL);
+	us_fpsi_update(stream->run->http->jpeg_wasted_fpsi, (!wr->job_failed && !wr->job_timely), NULL);
+	if (wr->job_failed) {
+		// pass
+	} else if (wr->job_timely) {
+		_stream_expose_jpeg(stream, job->dest, false);
+		us_fpsi_update(stream->run->http->jpeg_paced_fpsi, true, NULL); // Считаем выставленные, а не пропущенные пейсером
+		us_encoder_adapt_quality(stream->enc, job->dest, atomic_load(&stream->run->http->clients_backlog));
+		if (atomic_load(&stream->run->http->snapshot_requested) > 0) { // Process real snapshots
+			atomic_fetch_sub(&stream->run->http->snapshot_requested, 1);
+		}
+		US_LOG_PERF("JPEG: ##### Encoded JPEG exposed; worker=%s, latency=%.3Lf",
+			wr->name, us_get_now_monotonic() - job->dest->grab_begin_ts);
+	} else {
+		US_LOG_PERF("JPEG: ----- Encoded JPEG dropped; worker=%s", wr->name);
+	}
+}
+
 static void *_raw_thread(void *v_ctx) {
 	US_THREAD_SETTLE("str_raw");
+	us_sched_apply(&us_g_sched.encoder);
 	_worker_context_s *ctx = v_ctx;
 
 	while (!atomic_load(ctx->stop)) {
@@ -415,50 +519,89 @@ static void *_raw_thread(void *v_ctx) {
 
 static void *_h264_thread(void *v_ctx) {
 	US_THREAD_SETTLE("str_h264");
+	us_sched_apply(&us_g_sched.encoder);
 	_worker_context_s *ctx = v_ctx;
 	us_stream_s *stream = ctx->stream;
 
-	uint take = 1;
-	uint step = 1;
+	us_pacer_s pacer = {0};
 
 	while (!atomic_load(ctx->stop)) {
 		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->q);
 		if (hw == NULL) {
+			// Во время простоя кадров нет, но синки H264 проверяем только мы,
+			// и энкодеры все равно надо освобождать и пересоздавать.
+			if (!atomic_load(&stream->run->http->h264_released)) {
+				_stream_update_h264_sinks(stream); // Иначе это сделает _stream_h264_ensure()
+			}
+			_stream_h264_ensure(stream);
+			continue;
+		}
+		if (atomic_exchange(&stream->run->h264_resumed, false)) {
+			// Энкодер помнит кадры до паузы, так что клиентам нужен ключевой кадр
+			stream->run->h264_key_requested = true;
+			for (uint i = 0; i < stream->n_h264_layers; ++i) {
+				stream->h264_layers[i].key_requested = true;
+			}
+		}
+		if (!_stream_h264_ensure(stream)) {
+			US_LOG_VERBOSE("H264: Passed encoding because the encoders are released");
+			us_capture_hwbuf_decref(hw);
 			continue;
 		}
 
 		if (!us_memsink_server_check(stream->h264_sink, NULL)) {
 			US_LOG_VERBOSE("H264: Passed encoding because nobody is watching");
-			goto decref;
-		}
-
-		uint fps_limit = stream->run->h264_enc->run->fps_limit;
-		if (stream->desired_fps > 0 && (fps_limit == 0 || stream->desired_fps < fps_limit)) {
-			fps_limit = stream->desired_fps;
-		}
-		if (fps_limit > 0) {
-			const uint captured_fps = us_fpsi_get(stream->run->http->captured_fpsi, NULL);
-			take = ceilf((float)captured_fps / (float)fps_limit);
-			if (step < take) {
-				US_LOG_DEBUG("H264: Passed encoding for FPS limit: step=%u, take=%u", step, take);
-				++step;
-				goto decref;
-			} else {
-				step = 1;
-			}
+			_stream_adapt_h264_bitrate(stream, 0); // Ушедшие клиенты больше ничего не просят
+		} else if (_stream_h264_check_fps(stream, stream->run->h264_enc, 0, &pacer, &hw->raw, "H264")) {
+			_stream_encode_expose_h264(ctx->stream, &hw->raw, false);
 		}
 
-		_stream_encode_expose_h264(ctx->stream, &hw->raw, false);
+		// Слои кодируются следом из того же буфера, JPEG при этом декодируется один раз
+		for (uint i = 0; i < stream->n_h264_layers; ++i) {
+			us_stream_h264_layer_s *const layer = &stream->h264_layers[i];
+			if (!us_memsink_server_check(layer->sink, NULL)) {
+				US_LOG_VERBOSE("%s: Passed encoding because nobody is watching", layer->sink->name);
+				_stream_adapt_h264_layer_bitrate(stream, layer, 0);
+			} else if (_stream_h264_check_fps(stream, layer->enc, layer->fps, &layer->pacer, &hw->raw, layer->sink->name)) {
+				_stream_encode_expose_h264_layer(stream, layer, &hw->raw, false);
+			}
+		}
 
-	decref:
 		us_capture_hwbuf_decref(hw);
 	}
 	return NULL;
 }
 
+static void *_snapshot_thread(void *v_ctx) {
+	US_THREAD_SETTLE("str_snap");
+	us_sched_apply(&us_g_sched.encoder);
+	_worker_context_s *ctx = v_ctx;
+	us_snapshot_s *const snap = ctx->stream->run->http->snapshot;
+
+	// Снапшоты по запросу не должны отнимать время у основного кодирования
+	const struct sched_param param = {0};
+	const int err = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	if (err != 0) {
+		errno = err;
+		US_LOG_PERROR("SNAPSHOT: Can't set idle scheduling policy");
+	}
+
+	while (!atomic_load(ctx->stop)) {
+		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->q);
+		if (hw == NULL) {
+			continue;
+		}
+		us_snapshot_retain_raw(snap, &hw->raw);
+		us_capture_hwbuf_decref(hw); // Буфер захвата не держим на время кодирования
+		us_snapshot_process(snap, ctx->stream->cap->jpeg_quality);
+	}
+	return NULL;
+}
+
 #ifdef WITH_V4P
 static void *_drm_thread(void *v_ctx) {
 	US_THREAD_SETTLE("str_drm");
+	us_sched_apply(&us_g_sched.encoder);
 	_worker_context_s *ctx = v_ctx;
 	us_stream_s *stream = ctx->stream;
 
@@ -541,17 +684,49 @@ static bool _stream_has_jpeg_clients_cached(us_stream_s *stream) {
 	);
 }
 
+static bool _stream_has_h264_layers_clients_cached(us_stream_s *stream) {
+	for (uint i = 0; i < stream->n_h264_layers; ++i) {
+		if (atomic_load(&stream->h264_layers[i].sink->has_clients)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 static bool _stream_has_any_clients_cached(us_stream_s *stream) {
 	return (
 		_stream_has_jpeg_clients_cached(stream)
 		|| (stream->h264_sink != NULL && atomic_load(&stream->h264_sink->has_clients))
+		|| _stream_has_h264_layers_clients_cached(stream)
 		|| (stream->raw_sink != NULL && atomic_load(&stream->raw_sink->has_clients))
+		|| us_snapshot_wants_raw(stream->run->http->snapshot) // HQ or resized snapshots
 #		ifdef WITH_V4P
 		|| (stream->drm != NULL)
 #		endif
 	);
 }
 
+static void _stream_update_sinks(us_stream_s *stream, bool with_h264) {
+	if (stream->jpeg_sink != NULL) {
+		us_memsink_server_check(stream->jpeg_sink, NULL);
+	}
+	if (stream->raw_sink != NULL) {
+		us_memsink_server_check(stream->raw_sink, NULL);
+	}
+	if (with_h264) {
+		_stream_update_h264_sinks(stream);
+	}
+}
+
+static void _stream_update_h264_sinks(us_stream_s *stream) {
+	if (stream->h264_sink != NULL) {
+		us_memsink_server_check(stream->h264_sink, NULL);
+		for (uint i = 0; i < stream->n_h264_layers; ++i) {
+			us_memsink_server_check(stream->h264_layers[i].sink, NULL);
+		}
+	}
+}
+
 static int _stream_init_loop(us_stream_s *stream) {
 	us_stream_runtime_s *const run = stream->run;
 
@@ -560,23 +735,22 @@ static int _stream_init_loop(us_stream_s *stream) {
 		const char *blank_reason = "< NO LIVE VIDEO >";
 
 #		ifdef WITH_GPIO
-		us_gpio_set_stream_online(false);
+		if (!stream->secondary) {
+			us_gpio_set_stream_online(false);
+		}
 #		endif
 
 		// Флаги has_clients у синков не обновляются сами по себе, поэтому обновим их
 		// на каждой итерации старта стрима. После старта этим будут заниматься воркеры.
-#		define UPDATE_SINK(x_sink) if (x_sink != NULL) { us_memsink_server_check(x_sink, NULL); }
-		UPDATE_SINK(stream->jpeg_sink);
-		UPDATE_SINK(stream->raw_sink);
-		UPDATE_SINK(stream->h264_sink);
-#		undef UPDATE_SINK
+		_stream_update_sinks(stream, true);
 
 		_stream_check_suicide(stream);
 
 		stream->cap->dma_export = (
 			stream->enc->type == US_ENCODER_TYPE_M2M_VIDEO
 			|| stream->enc->type == US_ENCODER_TYPE_M2M_IMAGE
-			|| stream->h264_sink != NULL
+			// x264 читает кадры из mmap, DMA-BUF нужен только для импорта в M2M
+			|| (stream->h264_sink != NULL && stream->h264_encoder == US_STREAM_H264_ENCODER_M2M)
 #			ifdef WITH_V4P
 			|| stream->drm != NULL
 #			endif
@@ -661,9 +835,15 @@ static int _stream_init_loop(us_stream_s *stream) {
 				us_blank_draw(run->blank, blank_reason, width, height);
 
 				_stream_update_captured_fpsi(stream, run->blank->raw, false);
-				_stream_expose_jpeg(stream, run->blank->jpeg);
+				_stream_expose_jpeg(stream, run->blank->jpeg, false);
 				_stream_expose_raw(stream, run->blank->raw);
-				_stream_encode_expose_h264(stream, run->blank->raw, true);
+				// Воркеры еще не запущены, так что энкодеры H264 здесь только наши
+				if (_stream_h264_ensure(stream)) {
+					_stream_encode_expose_h264(stream, run->blank->raw, true);
+					for (uint layer = 0; layer < stream->n_h264_layers; ++layer) {
+						_stream_encode_expose_h264_layer(stream, &stream->h264_layers[layer], run->blank->raw, true);
+					}
+				}
 
 #				ifdef WITH_V4P
 				_stream_drm_ensure_no_signal(stream);
@@ -675,6 +855,121 @@ static int _stream_init_loop(us_stream_s *stream) {
 	return -1;
 }
 
+static int _stream_lock_released(us_stream_s *stream, pthread_mutex_t *release_mutex) {
+	// Ждем, пока все буферы вернутся драйверу, и выходим с захваченным мьютексом
+	const us_capture_runtime_s *const cr = stream->cap->run;
+
+	const ldf deadline_ts = us_get_now_monotonic() + 1;
+	while (!atomic_load(&stream->run->stop)) {
+		US_MUTEX_LOCK(*release_mutex);
+		bool busy = false;
+		for (uint i = 0; i < cr->n_bufs; ++i) {
+			busy = (busy || cr->bufs[i].grabbed);
+		}
+		if (!busy) {
+			return 0;
+		}
+		US_MUTEX_UNLOCK(*release_mutex);
+
+		if (us_get_now_monotonic() > deadline_ts) {
+			US_LOG_ERROR("Can't wait for the capture buffers to be released");
+			break;
+		}
+		usleep(5 * 1000);
+	}
+	return -1;
+}
+
+static int _stream_renegotiate(us_stream_s *stream, pthread_mutex_t *release_mutex) {
+	// При смене разрешения источника не разбираем весь конвейер: потоки, пул JPEG
+	// и M2M-энкодеры остаются жить, а последние перенастроятся сами, только если
+	// действительно поменялась геометрия кадра. Нужно лишь дождаться, пока все
+	// буферы вернутся драйверу, иначе их нельзя будет переразметить.
+#	ifdef WITH_V4P
+	if (stream->drm != NULL) {
+		return -1; // DRM imports the capture buffers on open, so it needs the full restart
+	}
+#	endif
+
+	if (_stream_lock_released(stream, release_mutex) < 0) {
+		return -1;
+	}
+	const int retval = us_capture_renegotiate(stream->cap);
+	US_MUTEX_UNLOCK(*release_mutex);
+	return retval;
+}
+
+static int _stream_idle(us_stream_s *stream, pthread_mutex_t *release_mutex, ldf *active_ts) {
+	// Без клиентов останавливаем захват, но устройство, потоки, пул JPEG и энкодеры
+	// H.264 остаются готовыми к работе, так что первый клиент получит кадр сразу
+	// после STREAMON, а не после полного открытия устройства.
+	us_stream_runtime_s *const run = stream->run;
+
+	if (stream->idle_stop == 0) {
+		return 0;
+	}
+	if (_stream_has_any_clients_cached(stream)) {
+		*active_ts = us_get_now_monotonic();
+		return 0;
+	}
+	const ldf idle_ts = us_get_now_monotonic();
+	if (*active_ts + stream->idle_stop > idle_ts) {
+		return 0;
+	}
+
+	US_LOG_INFO("No stream or sink clients found in last %u seconds, going idle ...", stream->idle_stop);
+	if (_stream_lock_released(stream, release_mutex) < 0) {
+		return -1;
+	}
+	int retval = us_capture_pause(stream->cap, false);
+	US_MUTEX_UNLOCK(*release_mutex);
+	if (retval < 0) {
+		return -1;
+	}
+	atomic_store(&run->http->idle, true);
+
+	bool released = false;
+	while (true) {
+		if (atomic_load(&run->stop)) {
+			return -1; // The capture will be closed anyway
+		}
+
+		// Воркеры не видят кадров и не проверяют синки, так что делаем это сами.
+		// Синки H264 не трогаем: memsink не потокобезопасен, а их проверяет воркер H264.
+		_stream_update_sinks(stream, (stream->h264_sink == NULL));
+		_stream_check_suicide(stream);
+		if (_stream_has_any_clients_cached(stream)) {
+			break;
+		}
+
+		if (!released && stream->idle_release > 0 && idle_ts + stream->idle_release < us_get_now_monotonic()) {
+			US_MUTEX_LOCK(*release_mutex);
+			retval = us_capture_pause(stream->cap, true);
+			US_MUTEX_UNLOCK(*release_mutex);
+			if (retval < 0) {
+				return -1;
+			}
+			released = true;
+		}
+		usleep(100 * 1000);
+	}
+
+	const ldf wakeup_ts = us_get_now_monotonic();
+	US_MUTEX_LOCK(*release_mutex);
+	retval = us_capture_resume(stream->cap);
+	US_MUTEX_UNLOCK(*release_mutex);
+	if (retval < 0) {
+		return -1;
+	}
+	atomic_store(&run->http->idle, false);
+
+	atomic_store(&run->h264_resumed, true); // Ключевой кадр запросит поток H264
+
+	*active_ts = us_get_now_monotonic();
+	US_LOG_INFO("Woke up from idle in %.3Lf seconds", *active_ts - wakeup_ts);
+	return 0;
+}
+
 static void _stream_update_captured_fpsi(us_stream_s *stream, const us_frame_s *frame, bool bump) {
 	us_stream_runtime_s *const run = stream->run;
 
@@ -713,7 +1008,7 @@ close:
 }
 #endif
 
-static void _stream_expose_jpeg(us_stream_s *stream, const us_frame_s *frame) {
+static void _stream_expose_jpeg(us_stream_s *stream, const us_frame_s *frame, bool passthrough) {
 	us_stream_runtime_s *const run = stream->run;
 
 	int ri;
@@ -724,12 +1019,19 @@ static void _stream_expose_jpeg(us_stream_s *stream, const us_frame_s *frame) {
 	}
 
 	us_frame_s *const dest = run->http->jpeg_ring->items[ri];
-	us_frame_copy(frame, dest);
-	us_ring_producer_release(run->http->jpeg_ring, ri);
-	event_active(run->http->jpeg_refresher, 0, 0);
+	if (passthrough) {
+		// Единственная копия: из буфера захвата сразу в кольцо, DHT вставляется по пути.
+		// Держать сам буфер захвата до отправки клиентам нельзя - это застопорит захват.
+		us_hw_encoder_compress(frame, dest);
+	} else {
+		us_frame_copy(frame, dest);
+	}
 	if (stream->jpeg_sink != NULL) {
+		// До освобождения слота: после него HTTP может забрать фрейм себе
 		us_memsink_server_put(stream->jpeg_sink, dest, NULL);
 	}
+	us_ring_producer_release(run->http->jpeg_ring, ri);
+	event_active(run->http->jpeg_refresher, 0, 0);
 }
 
 static void _stream_expose_raw(us_stream_s *stream, const us_frame_s *frame) {
@@ -738,6 +1040,177 @@ static void _stream_expose_raw(us_stream_s *stream, const us_frame_s *frame) {
 	}
 }
 
+static void _stream_h264_init(us_stream_s *stream) {
+	us_stream_runtime_s *const run = stream->run;
+
+	if (stream->h264_encoder == US_STREAM_H264_ENCODER_X264) {
+#		ifdef WITH_X264
+		run->h264_x264_enc = us_x264_encoder_init(
+			"H264",
+			stream->h264_bitrate,
+			stream->h264_gop,
+			stream->desired_fps,
+			stream->h264_intra_refresh);
+#		endif
+	} else {
+		run->h264_enc = us_m2m_h264_encoder_init(
+			"H264",
+			stream->h264_m2m_path,
+			stream->h264_bitrate,
+			stream->h264_gop,
+			stream->h264_boost,
+			stream->h264_intra_refresh);
+	}
+
+	run->h264_tmp_src = us_frame_init();
+	run->h264_dest = us_frame_init();
+	run->h264_bitrate = stream->h264_bitrate;
+	atomic_store(&run->http->h264_bitrate, stream->h264_bitrate);
+
+	for (uint i = 0; i < stream->n_h264_layers; ++i) {
+		us_stream_h264_layer_s *const layer = &stream->h264_layers[i];
+		if (stream->h264_encoder == US_STREAM_H264_ENCODER_X264) {
+#			ifdef WITH_X264
+			layer->x264_enc = us_x264_encoder_init(
+				layer->sink->name,
+				layer->bitrate,
+				stream->h264_gop,
+				(layer->fps > 0 ? layer->fps : stream->desired_fps),
+				stream->h264_intra_refresh);
+#			endif
+		} else {
+			// Каждому слою свой контекст M2M, исходный буфер импортируется через DMA
+			layer->enc = us_m2m_h264_encoder_init(
+				layer->sink->name,
+				stream->h264_m2m_path,
+				layer->bitrate,
+				stream->h264_gop,
+				stream->h264_boost,
+				stream->h264_intra_refresh);
+		}
+		layer->src = us_frame_init();
+		layer->dest = us_frame_init();
+		atomic_store(&layer->current_bitrate, layer->bitrate);
+	}
+	run->h264_active_ts = us_get_now_monotonic();
+	atomic_store(&run->http->h264_released, false);
+}
+
+static void _stream_h264_destroy(us_stream_s *stream) {
+	us_stream_runtime_s *const run = stream->run;
+
+	US_DELETE(run->h264_enc, us_m2m_encoder_destroy);
+#	ifdef WITH_X264
+	US_DELETE(run->h264_x264_enc, us_x264_encoder_destroy);
+#	endif
+	US_DELETE(run->h264_tmp_src, us_frame_destroy);
+	US_DELETE(run->h264_dest, us_frame_destroy);
+
+	for (uint i = 0; i < stream->n_h264_layers; ++i) {
+		us_stream_h264_layer_s *const layer = &stream->h264_layers[i];
+		US_DELETE(layer->enc, us_m2m_encoder_destroy);
+#		ifdef WITH_X264
+		US_DELETE(layer->x264_enc, us_x264_encoder_destroy);
+#		endif
+		US_DELETE(layer->src, us_frame_destroy);
+		US_DELETE(layer->dest, us_frame_destroy);
+	}
+	atomic_store(&run->http->h264_released, true);
+}
+
+static bool _stream_h264_ensure(us_stream_s *stream) {
+	// Незанятый энкодер M2M держит свои буферы, а на платах с небольшой памятью это заметно.
+	// Поэтому после простоя всех синков H264 освобождаем энкодеры, а с первым клиентом
+	// создаем их заново и начинаем с ключевого кадра.
+	us_stream_runtime_s *const run = stream->run;
+
+	if (stream->h264_sink == NULL) {
+		return false;
+	}
+	if (stream->h264_idle_release == 0) {
+		return true;
+	}
+
+	const bool released = atomic_load(&run->http->h264_released);
+	if (released) {
+		// Пока энкодеров нет, воркер не проверяет синки, так что делаем это здесь
+		_stream_update_h264_sinks(stream);
+	}
+
+	const ldf now_ts = us_get_now_monotonic();
+	if (atomic_load(&stream->h264_sink->has_clients) || _stream_has_h264_layers_clients_cached(stream)) {
+		run->h264_active_ts = now_ts;
+		if (released) {
+			US_LOG_INFO("H264: Recreating encoders for a new client ...");
+			_stream_h264_init(stream);
+			run->h264_key_requested = true;
+			for (uint i = 0; i < stream->n_h264_layers; ++i) {
+				stream->h264_layers[i].key_requested = true;
+			}
+		}
+		return true;
+	}
+	if (!released && run->h264_active_ts + stream->h264_idle_release < now_ts) {
+		US_LOG_INFO("H264: No sink clients found in last %u seconds, releasing encoders ...",
+			stream->h264_idle_release);
+		_stream_h264_destroy(stream);
+		return false;
+	}
+	return !released;
+}
+
+static bool _stream_h264_check_fps(
+	us_stream_s *stream, const us_m2m_encoder_s *enc, uint fps,
+	us_pacer_s *pacer, const us_frame_s *frame, const char *name) {
+
+	uint fps_limit = (enc != NULL ? enc->run->fps_limit : 0);
+	if (stream->desired_fps > 0 && (fps_limit == 0 || stream->desired_fps < fps_limit)) {
+		fps_limit = stream->desired_fps;
+	}
+	if (fps > 0 && (fps_limit == 0 || fps < fps_limit)) {
+		fps_limit = fps;
+	}
+	if (!us_pacer_check(pacer, fps_limit, frame->grab_begin_ts)) {
+		US_LOG_DEBUG("%s: Passed encoding for FPS limit: %u", name, fps_limit);
+		return false;
+	}
+	return true;
+}
+
+static const us_frame_s *_stream_h264_get_src(us_stream_s *stream, const us_frame_s *frame) {
+	if (!us_is_jpeg(frame->format)) {
+		return frame;
+	}
+	us_frame_s *const src = stream->run->h264_tmp_src;
+	// Основной поток и слои берут один и тот же декодированный кадр
+	if (src->used > 0 && src->grab_begin_ts == frame->grab_begin_ts) {
+		return src;
+	}
+	if (us_unjpeg_yuv420(frame, src) < 0) {
+		src->used = 0;
+		return NULL;
+	}
+	return src;
+}
+
+static const us_frame_s *_stream_h264_get_layer_src(
+	us_stream_s *stream, us_stream_h264_layer_s *layer, const us_frame_s *frame) {
+
+	if (layer->scale == 1) {
+		return _stream_h264_get_src(stream, frame);
+	}
+	const us_frame_s *const full = stream->run->h264_tmp_src;
+	if (us_is_jpeg(frame->format) && full->used > 0 && full->grab_begin_ts == frame->grab_begin_ts) {
+		// Основной поток уже разжал этот кадр, уменьшить его дешевле, чем разжимать снова
+		frame = full;
+	}
+	if (us_scale_yuv420(frame, layer->src, layer->scale) < 0) {
+		layer->src->used = 0;
+		return NULL;
+	}
+	return layer->src;
+}
+
 static void _stream_encode_expose_h264(us_stream_s *stream, const us_frame_s *frame, bool force_key) {
 	if (stream->h264_sink == NULL) {
 		return;
@@ -746,27 +1219,151 @@ static void _stream_encode_expose_h264(us_stream_s *stream, const us_frame_s *fr
 	us_stream_runtime_s *run = stream->run;
 
 	us_fpsi_meta_s meta = {.online = false};
-	if (us_is_jpeg(frame->format)) {
-		if (us_unjpeg(frame, run->h264_tmp_src, true) < 0) {
-			goto done;
-		}
-		frame = run->h264_tmp_src;
+	if ((frame = _stream_h264_get_src(stream, frame)) == NULL) {
+		goto done;
 	}
 	if (run->h264_key_requested) {
-		US_LOG_INFO("H264: Requested keyframe by a sink client");
-		run->h264_key_requested = false;
-		force_key = true;
+		// С intra refresh клиент восстанавливается сам за период обновления,
+		// поэтому запросы IDR выполняем не чаще раза в пару секунд.
+		// Невыполненный запрос остается в wants синка до ключевого кадра.
+		// Флаг снимается только когда ключевой кадр действительно ушел в синк.
+		if (!stream->h264_intra_refresh || run->h264_key_ts + 2 < us_get_now_monotonic()) {
+			US_LOG_INFO("H264: Requested keyframe by a sink client");
+			force_key = true;
+		}
 	}
-	if (!us_m2m_encoder_compress(run->h264_enc, frame, run->h264_dest, force_key)) {
-		us_memsink_wants_s wants = {0};
+	// Если синк был занят, то wants не прочитаются, и битрейт останется прежним
+	us_memsink_wants_s wants = {.bitrate = run->h264_wanted_bitrate};
+	bool key = false;
+	if (stream->h264_encoder == US_STREAM_H264_ENCODER_X264) {
+#		ifdef WITH_X264
+		if (!us_x264_encoder_compress(run->h264_x264_enc, frame, run->h264_dest, force_key)) {
+			meta.online = !us_memsink_server_put(stream->h264_sink, run->h264_dest, &wants);
+			key = run->h264_dest->key;
+		}
+#		endif
+	} else if (stream->h264_zero_copy) {
+		// Отдаем в синк прямо из буфера энкодера и возвращаем его только после этого
+		const us_frame_s *const dest = us_m2m_encoder_compress_hold(run->h264_enc, frame, force_key);
+		if (dest != NULL) {
+			meta.online = !us_memsink_server_put(stream->h264_sink, dest, &wants);
+			key = dest->key;
+			us_m2m_encoder_release(run->h264_enc);
+		}
+	} else if (!us_m2m_encoder_compress(run->h264_enc, frame, run->h264_dest, force_key)) {
 		meta.online = !us_memsink_server_put(stream->h264_sink, run->h264_dest, &wants);
-		run->h264_key_requested = wants.key;
+		key = run->h264_dest->key;
 	}
+	run->h264_key_requested |= wants.key;
+	if (meta.online && key) {
+		run->h264_key_requested = false;
+		run->h264_key_ts = us_get_now_monotonic();
+	}
+	_stream_adapt_h264_bitrate(stream, wants.bitrate);
 
 done:
 	us_fpsi_update(run->http->h264_fpsi, meta.online, &meta);
 }
 
+static void _stream_encode_expose_h264_layer(
+	us_stream_s *stream, us_stream_h264_layer_s *layer, const us_frame_s *frame, bool force_key) {
+
+	us_fpsi_meta_s meta = {.online = false};
+	if ((frame = _stream_h264_get_layer_src(stream, layer, frame)) == NULL) {
+		goto done;
+	}
+	if (layer->key_requested) {
+		if (!stream->h264_intra_refresh || layer->key_ts + 2 < us_get_now_monotonic()) {
+			US_LOG_INFO("%s: Requested keyframe by a sink client", layer->sink->name);
+			force_key = true;
+		}
+	}
+	us_memsink_wants_s wants = {.bitrate = layer->wanted_bitrate};
+	bool key = false;
+	if (stream->h264_encoder == US_STREAM_H264_ENCODER_X264) {
+#		ifdef WITH_X264
+		if (!us_x264_encoder_compress(layer->x264_enc, frame, layer->dest, force_key)) {
+			meta.online = !us_memsink_server_put(layer->sink, layer->dest, &wants);
+			key = layer->dest->key;
+		}
+#		endif
+	} else if (stream->h264_zero_copy) {
+		const us_frame_s *const dest = us_m2m_encoder_compress_hold(layer->enc, frame, force_key);
+		if (dest != NULL) {
+			meta.online = !us_memsink_server_put(layer->sink, dest, &wants);
+			key = dest->key;
+			us_m2m_encoder_release(layer->enc);
+		}
+	} else if (!us_m2m_encoder_compress(layer->enc, frame, layer->dest, force_key)) {
+		meta.online = !us_memsink_server_put(layer->sink, layer->dest, &wants);
+		key = layer->dest->key;
+	}
+	layer->key_requested |= wants.key;
+	if (meta.online && key) {
+		layer->key_requested = false;
+		layer->key_ts = us_get_now_monotonic();
+	}
+	_stream_adapt_h264_layer_bitrate(stream, layer, wants.bitrate);
+
+done:
+	us_fpsi_update(layer->fpsi, meta.online, &meta);
+}
+
+static bool _stream_h264_get_adapted_bitrate(uint base, uint current, uint wanted, uint *bitrate) {
+	// Клиент может только понизить битрейт, но не ниже десятой части от заданного
+	*bitrate = base;
+	if (wanted > 0) {
+		const uint min_bitrate = US_MAX(base / 10, (uint)25);
+		*bitrate = US_MIN(US_MAX(wanted, min_bitrate), base);
+	}
+	return !(
+		*bitrate == current
+		// Не дергаем энкодер из-за мелких колебаний оценки
+		|| (*bitrate != base && abs((int)*bitrate - (int)current) < (int)current / 20)
+	);
+}
+
+static void _stream_adapt_h264_bitrate(us_stream_s *stream, uint wanted) {
+	us_stream_runtime_s *const run = stream->run;
+	run->h264_wanted_bitrate = wanted;
+
+	uint bitrate;
+	if (!_stream_h264_get_adapted_bitrate(stream->h264_bitrate, run->h264_bitrate, wanted, &bitrate)) {
+		return;
+	}
+
+	US_LOG_VERBOSE("H264: Changing bitrate by a sink client: %u -> %u Kbps", run->h264_bitrate, bitrate);
+	if (stream->h264_encoder == US_STREAM_H264_ENCODER_X264) {
+#		ifdef WITH_X264
+		us_x264_encoder_set_bitrate(run->h264_x264_enc, bitrate);
+#		endif
+	} else {
+		us_m2m_encoder_set_bitrate(run->h264_enc, bitrate);
+	}
+	run->h264_bitrate = bitrate;
+	atomic_store(&run->http->h264_bitrate, bitrate);
+}
+
+static void _stream_adapt_h264_layer_bitrate(us_stream_s *stream, us_stream_h264_layer_s *layer, uint wanted) {
+	layer->wanted_bitrate = wanted;
+
+	const uint current = atomic_load(&layer->current_bitrate);
+	uint bitrate;
+	if (!_stream_h264_get_adapted_bitrate(layer->bitrate, current, wanted, &bitrate)) {
+		return;
+	}
+
+	US_LOG_VERBOSE("%s: Changing bitrate by a sink client: %u -> %u Kbps", layer->sink->name, current, bitrate);
+	if (stream->h264_encoder == US_STREAM_H264_ENCODER_X264) {
+#		ifdef WITH_X264
+		us_x264_encoder_set_bitrate(layer->x264_enc, bitrate);
+#		endif
+	} else {
+		us_m2m_encoder_set_bitrate(layer->enc, bitrate);
+	}
+	atomic_store(&layer->current_bitrate, bitrate);
+}
+
 static void _stream_check_suicide(us_stream_s *stream) {
 	if (stream->exit_on_no_clients == 0) {
 		return;
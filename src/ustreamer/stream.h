@@ -35,6 +35,7 @@
 #include "../libs/memsink.h"
 #include "../libs/capture.h"
 #include "../libs/fpsi.h"
+#include "../libs/pacer.h"
 #ifdef WITH_V4P
 #	include "../libs/drm/drm.h"
 #endif
@@ -42,6 +43,45 @@
 #include "blank.h"
 #include "encoder.h"
 #include "m2m.h"
+#include "snapshot.h"
+#ifdef WITH_X264
+#	include "encoders/x264/encoder.h"
+#endif
+
+
+#ifdef WITH_X264
+#	define US_STREAM_H264_ENCODERS_STR "M2M, X264"
+#else
+#	define US_STREAM_H264_ENCODERS_STR "M2M"
+#endif
+
+typedef enum {
+	US_STREAM_H264_ENCODER_M2M,
+	US_STREAM_H264_ENCODER_X264,
+} us_stream_h264_encoder_e;
+
+#define US_STREAM_MAX_H264_LAYERS 3
+
+
+typedef struct {
+	us_memsink_s		*sink;
+	uint				bitrate;
+	uint				fps;
+	uint				scale; // Source resolution divider
+	us_fpsi_s			*fpsi;
+
+	us_m2m_encoder_s	*enc;
+#	ifdef WITH_X264
+	us_x264_encoder_s	*x264_enc;
+#	endif
+	us_frame_s			*src; // Scaled source
+	us_frame_s			*dest;
+	bool				key_requested;
+	ldf					key_ts;
+	uint				wanted_bitrate;
+	atomic_uint			current_bitrate; // Kbps, adapted by the sink clients
+	us_pacer_s			pacer;
+} us_stream_h264_layer_s;
 
 
 typedef struct {
@@ -52,12 +92,20 @@ typedef struct {
 
 	atomic_bool		h264_online;
 	us_fpsi_s		*h264_fpsi;
+	atomic_uint		h264_bitrate; // Kbps, current
+	atomic_bool		h264_released; // Encoders are freed by h264_idle_release
 
 	struct event	*jpeg_refresher;
 	us_ring_s		*jpeg_ring;
+	us_fpsi_s		*jpeg_encoded_fpsi;
+	us_fpsi_s		*jpeg_wasted_fpsi;
+	us_fpsi_s		*jpeg_paced_fpsi;
 	atomic_bool		has_clients;
 	atomic_uint		snapshot_requested;
+	us_snapshot_s	*snapshot; // High quality or resized
 	atomic_ullong	last_req_ts; // Seconds
+	atomic_bool		idle; // Capturing is paused by idle_stop
+	atomic_ullong	clients_backlog; // Bytes, the worst client
 	us_fpsi_s		*captured_fpsi;
 } us_stream_http_s;
 
@@ -65,9 +113,17 @@ typedef struct {
 	us_stream_http_s	*http;
 
 	us_m2m_encoder_s	*h264_enc;
+#	ifdef WITH_X264
+	us_x264_encoder_s	*h264_x264_enc;
+#	endif
 	us_frame_s			*h264_tmp_src;
 	us_frame_s			*h264_dest;
-	bool				h264_key_requested;
+	bool				h264_key_requested; // The fields of H264 are owned by the H264 thread
+	ldf					h264_key_ts;
+	ldf					h264_active_ts;
+	atomic_bool			h264_resumed; // Set by the stream thread after idle
+	uint				h264_bitrate;
+	uint				h264_wanted_bitrate;
 
 	us_blank_s			*blank;
 
@@ -81,8 +137,11 @@ typedef struct {
 	us_encoder_s	*enc;
 
 	uint			desired_fps;
+	bool			secondary; // Extra device: the process-wide GPIO belongs to the main one
 	bool			notify_parent;
 	bool			slowdown;
+	uint			idle_stop;
+	uint			idle_release;
 	uint			error_delay;
 	bool			exit_on_device_error;
 	uint			exit_on_no_clients;
@@ -91,10 +150,18 @@ typedef struct {
 	us_memsink_s	*raw_sink;
 
 	us_memsink_s	*h264_sink;
+	us_stream_h264_encoder_e	h264_encoder;
 	uint			h264_bitrate;
 	uint			h264_gop;
 	char			*h264_m2m_path;
 	bool			h264_boost;
+	bool			h264_zero_copy;
+	bool			h264_intra_refresh;
+	uint			h264_idle_release;
+
+	// Дополнительные слои симулкаста с тем же разрешением, но своим битрейтом и FPS
+	us_stream_h264_layer_s	h264_layers[US_STREAM_MAX_H264_LAYERS];
+	uint			n_h264_layers;
 
 #	ifdef WITH_V4P
 	us_drm_s		*drm;
@@ -107,6 +174,10 @@ typedef struct {
 us_stream_s *us_stream_init(us_capture_s *cap, us_encoder_s *enc);
 void us_stream_update_blank(us_stream_s *stream, const us_capture_s *cap);
 void us_stream_destroy(us_stream_s *stream);
+int us_stream_add_h264_layer(us_stream_s *stream, us_memsink_s *sink, uint bitrate, uint fps, uint scale);
 
 void us_stream_loop(us_stream_s *stream);
 void us_stream_loop_break(us_stream_s *stream);
+
+int us_stream_parse_h264_encoder(const char *str);
+const char *us_stream_h264_encoder_to_string(us_stream_h264_encoder_e encoder);
@@ -23,6 +23,7 @@
 #include "workers.h"
 
 #include <stdatomic.h>
+#include <math.h>
 
 #include <pthread.h>
 
@@ -32,30 +33,74 @@
 #include "../libs/logging.h"
 #include "../libs/list.h"
 
+#include "sched.h"
+
+
+static uint _group_grant(us_workers_pool_s *pool, uint wanted, ldf now_ts);
+static bool _group_is_starving(us_workers_pool_s *pool, ldf now_ts);
+static void _group_release(us_workers_pool_s *pool, uint count);
+
+static void _worker_start(us_workers_pool_s *pool, us_worker_s *wr);
+static void _worker_stop(us_workers_pool_s *pool, us_worker_s *wr);
 
 static void *_worker_thread(void *v_worker);
 
 
+us_workers_group_s *us_workers_group_init(uint n_slots) {
+	us_workers_group_s *group;
+	US_CALLOC(group, 1);
+	US_MUTEX_INIT(group->mutex);
+	group->n_slots = US_MAX(n_slots, (uint)1);
+	return group;
+}
+
+void us_workers_group_destroy(us_workers_group_s *group) {
+	US_A(group->n_pools == 0);
+	US_MUTEX_DESTROY(group->mutex);
+	free(group);
+}
+
 us_workers_pool_s *us_workers_pool_init(
 	const char *name,
 	const char *wr_prefix,
 	uint n_workers,
+	uint n_min_workers,
+	us_workers_group_s *group,
 	us_workers_pool_job_init_f job_init,
 	void *job_init_arg,
 	us_workers_pool_job_destroy_f job_destroy,
 	us_workers_pool_run_job_f run_job
 ) {
-	US_LOG_INFO("Creating pool %s with %u workers ...", name, n_workers);
+	n_min_workers = US_MAX(US_MIN(n_min_workers, n_workers), (uint)1);
+	if (n_min_workers < n_workers) {
+		US_LOG_INFO("Creating pool %s with %u...%u workers ...", name, n_min_workers, n_workers);
+	} else {
+		US_LOG_INFO("Creating pool %s with %u workers ...", name, n_workers);
+	}
 
 	us_workers_pool_s *pool;
 	US_CALLOC(pool, 1);
 	pool->name = name;
+	pool->job_init = job_init;
+	pool->job_init_arg = job_init_arg;
 	pool->job_destroy = job_destroy;
 	pool->run_job = run_job;
 
 	atomic_init(&pool->stop, false);
 
 	pool->n_workers = n_workers;
+	pool->n_min_workers = n_min_workers;
+
+	pool->group = group;
+	if (group != NULL) {
+		// Минимум воркеров запускается всегда. Сумма пользовательских минимумов
+		// не превышает общий лимит (проверяется при старте), сверх него
+		// может выйти только неявный минимум в один воркер на устройство.
+		US_MUTEX_LOCK(group->mutex);
+		group->n_used += n_min_workers;
+		group->n_pools += 1;
+		US_MUTEX_UNLOCK(group->mutex);
+	}
 
 	US_MUTEX_INIT(pool->free_workers_mutex);
 	US_COND_INIT(pool->free_workers_cond);
@@ -69,16 +114,19 @@ us_workers_pool_s *us_workers_pool_init(
 
 		US_MUTEX_INIT(wr->has_job_mutex);
 		atomic_init(&wr->has_job, false);
+		atomic_init(&wr->stop, false);
 		US_COND_INIT(wr->has_job_cond);
 
 		wr->pool = pool;
-		wr->job = job_init(job_init_arg);
 
-		US_THREAD_CREATE(wr->tid, _worker_thread, (void*)wr);
-		pool->free_workers += 1;
+		// Остальные воркеры запускаются по мере надобности
+		if (i < pool->n_min_workers) {
+			_worker_start(pool, wr);
+		}
 
 		US_LIST_APPEND(pool->workers, wr);
 	}
+	pool->enough_workers_ts = us_get_now_monotonic();
 	return pool;
 }
 
@@ -87,21 +135,30 @@ void us_workers_pool_destroy(us_workers_pool_s *pool) {
 
 	atomic_store(&pool->stop, true);
 	US_LIST_ITERATE(pool->workers, wr, { // cppcheck-suppress constStatement
-		US_MUTEX_LOCK(wr->has_job_mutex);
-		atomic_store(&wr->has_job, true); // Final job: die
-		US_MUTEX_UNLOCK(wr->has_job_mutex);
-		US_COND_SIGNAL(wr->has_job_cond);
+		if (wr->active) {
+			US_MUTEX_LOCK(wr->has_job_mutex);
+			atomic_store(&wr->has_job, true); // Final job: die
+			US_MUTEX_UNLOCK(wr->has_job_mutex);
+			US_COND_SIGNAL(wr->has_job_cond);
+
+			US_THREAD_JOIN(wr->tid);
+			pool->job_destroy(wr->job, false);
+		}
 
-		US_THREAD_JOIN(wr->tid);
 		US_MUTEX_DESTROY(wr->has_job_mutex);
 		US_COND_DESTROY(wr->has_job_cond);
 
-		pool->job_destroy(wr->job);
-
 		free(wr->name);
 		free(wr);
 	});
 
+	if (pool->group != NULL) {
+		_group_release(pool, pool->n_active_workers);
+		US_MUTEX_LOCK(pool->group->mutex);
+		pool->group->n_pools -= 1;
+		US_MUTEX_UNLOCK(pool->group->mutex);
+	}
+
 	US_MUTEX_DESTROY(pool->free_workers_mutex);
 	US_COND_DESTROY(pool->free_workers_cond);
 
@@ -116,8 +173,9 @@ us_worker_s *us_workers_pool_wait(us_workers_pool_s *pool) {
 	us_worker_s *found = NULL;
 	US_LIST_ITERATE(pool->workers, wr, { // cppcheck-suppress constStatement
 		if (
-			!atomic_load(&wr->has_job)
-			&& (found == NULL || found->job_start_ts <= wr->job_start_ts)
+			wr->active
+			&& !atomic_load(&wr->has_job)
+			&& (found == NULL || found->job_ts <= wr->job_ts)
 		) {
 			found = wr;
 		}
@@ -126,13 +184,71 @@ us_worker_s *us_workers_pool_wait(us_workers_pool_s *pool) {
 	US_LIST_REMOVE(pool->workers, found);
 	US_LIST_APPEND(pool->workers, found); // Перемещаем в конец списка
 
-	found->job_timely = (found->job_start_ts > pool->job_timely_ts);
+	found->job_timely = (found->job_ts > pool->job_timely_ts);
 	if (found->job_timely) {
-		pool->job_timely_ts = found->job_start_ts;
+		pool->job_timely_ts = found->job_ts;
 	}
 	return found;
 }
 
+bool us_workers_pool_schedule(us_workers_pool_s *pool, us_worker_s *wr, ldf job_ts) {
+	if (pool->last_offered_ts > 0 && job_ts > pool->last_offered_ts) {
+		const ldf interval = job_ts - pool->last_offered_ts;
+		pool->approx_job_interval = (pool->approx_job_interval == 0
+			? interval
+			: pool->approx_job_interval * 0.9 + interval * 0.1);
+	}
+	pool->last_offered_ts = job_ts;
+
+	const ldf now_ts = us_get_now_monotonic();
+	pool->last_demand_ts = now_ts;
+	const ldf finish_ts = now_ts + wr->approx_job_time;
+
+	// Кадры выставляются строго по порядку съемки, поэтому работа выкидывается,
+	// если более новый кадр закодируется раньше более старого. Чтобы этого не было:
+	//   - новый кадр не должен обогнать ни одну из уже идущих работ;
+	//   - следующий кадр не должен обогнать этот на самом быстром из других воркеров.
+	ldf busy_finish_ts = 0;
+	ldf next_finish_ts = -1;
+	US_LIST_ITERATE(pool->workers, other, { // cppcheck-suppress constStatement
+		if (other != wr && other->active) {
+			ldf free_ts = now_ts;
+			ldf job_time = other->job_predicted_time;
+			if (atomic_load(&other->has_job)) {
+				busy_finish_ts = US_MAX(busy_finish_ts, other->job_finish_ts);
+				free_ts = US_MAX(free_ts, other->job_finish_ts);
+			} else {
+				job_time = other->approx_job_time; // Safe to read from the free worker
+			}
+			if (job_time > 0) {
+				const ldf ts = US_MAX(free_ts, now_ts + pool->approx_job_interval) + job_time;
+				if (next_finish_ts < 0 || ts < next_finish_ts) {
+					next_finish_ts = ts;
+				}
+			}
+		}
+	});
+
+	if (wr->approx_job_time > 0) {
+		if (finish_ts < busy_finish_ts) {
+			US_LOG_VERBOSE("Pool %s: Skipped frame for %s: it would overtake a job in progress:"
+				" finish=%.03Lf, busy_finish=%.03Lf", pool->name, wr->name, finish_ts, busy_finish_ts);
+			return false;
+		}
+		if (next_finish_ts >= 0 && finish_ts > next_finish_ts) {
+			US_LOG_VERBOSE("Pool %s: Skipped frame for %s: the next frame would overtake it:"
+				" finish=%.03Lf, next_finish=%.03Lf", pool->name, wr->name, finish_ts, next_finish_ts);
+			return false;
+		}
+	}
+
+	wr->job_ts = job_ts;
+	wr->job_finish_ts = finish_ts;
+	wr->job_predicted_time = wr->approx_job_time;
+	pool->approx_job_time = pool->approx_job_time * 0.9 + wr->last_job_time * 0.1;
+	return true;
+}
+
 void us_workers_pool_assign(us_workers_pool_s *pool, us_worker_s *wr) {
 	US_MUTEX_LOCK(wr->has_job_mutex);
 	atomic_store(&wr->has_job, true);
@@ -144,22 +260,147 @@ void us_workers_pool_assign(us_workers_pool_s *pool, us_worker_s *wr) {
 	US_MUTEX_UNLOCK(pool->free_workers_mutex);
 }
 
-ldf us_workers_pool_get_fluency_delay(us_workers_pool_s *pool, const us_worker_s *wr) {
-	const ldf approx_job_time = pool->approx_job_time * 0.9 + wr->last_job_time * 0.1;
+bool us_workers_pool_autoscale(us_workers_pool_s *pool, us_worker_s *wr) {
+	if (pool->n_min_workers >= pool->n_workers) {
+		return false; // Fixed size
+	}
 
-	US_LOG_VERBOSE("Correcting pool's %s approx_job_time: %.3Lf -> %.3Lf (last_job_time=%.3Lf)",
-		pool->name, pool->approx_job_time, approx_job_time, wr->last_job_time);
+	const ldf now_ts = us_get_now_monotonic();
 
-	pool->approx_job_time = approx_job_time;
+	uint wanted = pool->n_min_workers;
+	if (pool->approx_job_interval > 0 && pool->last_demand_ts + 1 > now_ts) {
+		// Чтобы успевать за каждым кадром, нужно T/I воркеров плюс небольшой запас.
+		// Если воркеров не хватает, кадры предлагаются реже, интервал растет,
+		// и пул дорастает до нужного размера за несколько шагов.
+		wanted = ceill(pool->approx_job_time / pool->approx_job_interval * 1.25);
+	}
+	wanted = US_MAX(US_MIN(wanted, pool->n_workers), pool->n_min_workers);
+	if (wanted > pool->n_active_workers && pool->group != NULL) {
+		wanted = _group_grant(pool, wanted, now_ts);
+	}
 
-	// Среднее время работы размазывается на N воркеров
-	return (pool->approx_job_time / pool->n_workers);
+	if (wanted > pool->n_active_workers) {
+		US_LOG_INFO("Pool %s: Growing %u -> %u workers: job_time=%.3Lf, interval=%.3Lf",
+			pool->name, pool->n_active_workers, wanted, pool->approx_job_time, pool->approx_job_interval);
+		US_LIST_ITERATE(pool->workers, other, { // cppcheck-suppress constStatement
+			if (pool->n_active_workers >= wanted) {
+				break;
+			}
+			if (!other->active) {
+				_worker_start(pool, other);
+			}
+		});
+		pool->enough_workers_ts = now_ts;
+
+	} else if (wanted < pool->n_active_workers || _group_is_starving(pool, now_ts)) {
+		// Сокращаемся по одному и не чаще, чем раз в несколько секунд.
+		// Если другому пулу группы не хватает его честной доли, то отдаем быстрее.
+		const ldf delay = (wanted < pool->n_active_workers ? 5 : 1);
+		if (pool->enough_workers_ts + delay < now_ts && pool->n_active_workers > pool->n_min_workers) {
+			US_LOG_INFO("Pool %s: Shrinking %u -> %u workers: job_time=%.3Lf, interval=%.3Lf",
+				pool->name, pool->n_active_workers, pool->n_active_workers - 1,
+				pool->approx_job_time, pool->approx_job_interval);
+			_worker_stop(pool, wr);
+			pool->enough_workers_ts = now_ts;
+			return true;
+		}
+
+	} else {
+		pool->enough_workers_ts = now_ts;
+	}
+	return false;
+}
+
+static uint _group_grant(us_workers_pool_s *pool, uint wanted, ldf now_ts) {
+	// Резервирует слоты группы под новых воркеров и возвращает, до скольки можно вырасти
+	us_workers_group_s *const group = pool->group;
+	US_MUTEX_LOCK(group->mutex);
+	const uint n_free = (group->n_slots > group->n_used ? group->n_slots - group->n_used : 0);
+	const uint fair = US_MAX(group->n_slots / US_MAX(group->n_pools, (uint)1), (uint)1);
+	uint allowed = US_MIN(wanted, pool->n_active_workers + n_free);
+	if (group->starving_ts + 1 > now_ts && allowed > fair) {
+		allowed = US_MAX(fair, pool->n_active_workers); // Освободившееся придерживаем для голодающего
+	}
+	if (allowed < wanted && allowed < fair) {
+		group->starving_ts = now_ts;
+	}
+	group->n_used += allowed - pool->n_active_workers;
+	US_MUTEX_UNLOCK(group->mutex);
+	return allowed;
+}
+
+static bool _group_is_starving(us_workers_pool_s *pool, ldf now_ts) {
+	// Кто-то в группе недобирает свою долю, а мы занимаем больше своей
+	us_workers_group_s *const group = pool->group;
+	if (group == NULL) {
+		return false;
+	}
+	US_MUTEX_LOCK(group->mutex);
+	const uint fair = US_MAX(group->n_slots / US_MAX(group->n_pools, (uint)1), (uint)1);
+	const bool starving = (group->starving_ts + 1 > now_ts && pool->n_active_workers > fair);
+	US_MUTEX_UNLOCK(group->mutex);
+	return starving;
+}
+
+static void _group_release(us_workers_pool_s *pool, uint count) {
+	us_workers_group_s *const group = pool->group;
+	US_MUTEX_LOCK(group->mutex);
+	US_A(group->n_used >= count);
+	group->n_used -= count;
+	US_MUTEX_UNLOCK(group->mutex);
+}
+
+static void _worker_start(us_workers_pool_s *pool, us_worker_s *wr) {
+	US_A(!wr->active);
+
+	wr->job = pool->job_init(pool->job_init_arg);
+	wr->last_job_time = 0;
+	wr->approx_job_time = 0;
+	wr->job_ts = 0;
+	wr->job_finish_ts = 0;
+	wr->job_predicted_time = 0;
+	atomic_store(&wr->has_job, false);
+	atomic_store(&wr->stop, false);
+	wr->active = true;
+
+	US_THREAD_CREATE(wr->tid, _worker_thread, (void*)wr);
+
+	US_MUTEX_LOCK(pool->free_workers_mutex);
+	pool->free_workers += 1;
+	US_MUTEX_UNLOCK(pool->free_workers_mutex);
+	pool->n_active_workers += 1;
+}
+
+static void _worker_stop(us_workers_pool_s *pool, us_worker_s *wr) {
+	US_A(wr->active);
+	US_A(!atomic_load(&wr->has_job));
+
+	US_MUTEX_LOCK(pool->free_workers_mutex);
+	pool->free_workers -= 1;
+	US_MUTEX_UNLOCK(pool->free_workers_mutex);
+
+	atomic_store(&wr->stop, true);
+	US_MUTEX_LOCK(wr->has_job_mutex);
+	atomic_store(&wr->has_job, true); // Final job: die
+	US_MUTEX_UNLOCK(wr->has_job_mutex);
+	US_COND_SIGNAL(wr->has_job_cond);
+	US_THREAD_JOIN(wr->tid);
+
+	pool->job_destroy(wr->job, true);
+	wr->job = NULL;
+	atomic_store(&wr->has_job, false);
+	wr->active = false;
+	pool->n_active_workers -= 1;
+	if (pool->group != NULL) {
+		_group_release(pool, 1);
+	}
 }
 
 static void *_worker_thread(void *v_worker) {
 	us_worker_s *const wr = v_worker;
 
 	US_THREAD_SETTLE("%s", wr->name);
+	us_sched_apply(&us_g_sched.encoder);
 	US_LOG_DEBUG("Hello! I am a worker %s ^_^", wr->name);
 
 	while (!atomic_load(&wr->pool->stop)) {
@@ -169,12 +410,18 @@ static void *_worker_thread(void *v_worker) {
 		US_COND_WAIT_FOR(atomic_load(&wr->has_job), wr->has_job_cond, wr->has_job_mutex);
 		US_MUTEX_UNLOCK(wr->has_job_mutex);
 
+		if (atomic_load(&wr->stop)) {
+			break; // Stopped by the pool autoscaler
+		}
+
 		if (!atomic_load(&wr->pool->stop)) {
 			const ldf job_start_ts = us_get_now_monotonic();
 			wr->job_failed = !wr->pool->run_job(wr);
 			if (!wr->job_failed) {
-				wr->job_start_ts = job_start_ts;
-				wr->last_job_time = us_get_now_monotonic() - wr->job_start_ts;
+				wr->last_job_time = us_get_now_monotonic() - job_start_ts;
+				wr->approx_job_time = (wr->approx_job_time == 0
+					? wr->last_job_time
+					: wr->approx_job_time * 0.8 + wr->last_job_time * 0.2);
 			}
 			atomic_store(&wr->has_job, false);
 		}
@@ -34,15 +34,20 @@ typedef struct us_worker_sx {
 	pthread_t	tid;
 	uint		number;
 	char		*name;
+	bool		active;
+	atomic_bool	stop;
 
 	ldf			last_job_time;
+	ldf			approx_job_time;
 
 	pthread_mutex_t	has_job_mutex;
 	void			*job;
 	atomic_bool		has_job;
 	bool			job_timely;
 	bool			job_failed;
-	ldf				job_start_ts;
+	ldf				job_ts; // Deadline: capture timestamp of the job's frame
+	ldf				job_finish_ts; // Predicted completion
+	ldf				job_predicted_time;
 	pthread_cond_t	has_job_cond;
 
 	struct us_workers_pool_sx	*pool;
@@ -50,21 +55,39 @@ typedef struct us_worker_sx {
 	US_LIST_DECLARE;
 } us_worker_s;
 
+// Общий лимит потоков для нескольких пулов (по одному на каждое устройство)
+typedef struct {
+	pthread_mutex_t	mutex;
+	uint			n_slots;
+	uint			n_used;
+	uint			n_pools;
+	ldf				starving_ts; // A pool below its fair share could not grow
+} us_workers_group_s;
+
 typedef void *(*us_workers_pool_job_init_f)(void *arg);
-typedef void (*us_workers_pool_job_destroy_f)(void *job);
+typedef void (*us_workers_pool_job_destroy_f)(void *job, bool shrinking); // Shrinking: stopped by autoscale, not with the pool
 typedef bool (*us_workers_pool_run_job_f)(us_worker_s *wr);
 
 typedef struct us_workers_pool_sx {
 	const char		*name;
 
+	us_workers_pool_job_init_f		job_init;
+	void							*job_init_arg;
 	us_workers_pool_job_destroy_f	job_destroy;
 	us_workers_pool_run_job_f		run_job;
 
 	uint			n_workers;
+	uint			n_min_workers;
+	uint			n_active_workers;
+	us_workers_group_s	*group;
 	us_worker_s		*workers;
 	ldf				job_timely_ts;
 
 	ldf				approx_job_time;
+	ldf				approx_job_interval;
+	ldf				last_offered_ts;
+	ldf				last_demand_ts;
+	ldf				enough_workers_ts;
 
 	pthread_mutex_t	free_workers_mutex;
 	uint			free_workers;
@@ -74,10 +97,15 @@ typedef struct us_workers_pool_sx {
 } us_workers_pool_s;
 
 
+us_workers_group_s *us_workers_group_init(uint n_slots);
+void us_workers_group_destroy(us_workers_group_s *group);
+
 us_workers_pool_s *us_workers_pool_init(
 	const char *name,
 	const char *wr_prefix,
 	uint n_workers,
+	uint n_min_workers,
+	us_workers_group_s *group,
 	us_workers_pool_job_init_f job_init,
 	void *job_init_arg,
 	us_workers_pool_job_destroy_f job_destroy,
@@ -86,6 +114,6 @@ us_workers_pool_s *us_workers_pool_init(
 void us_workers_pool_destroy(us_workers_pool_s *pool);
 
 us_worker_s *us_workers_pool_wait(us_workers_pool_s *pool);
+bool us_workers_pool_schedule(us_workers_pool_s *pool, us_worker_s *ready_wr, ldf job_ts);
 void us_workers_pool_assign(us_workers_pool_s *pool, us_worker_s *ready_wr);
-
-ldf us_workers_pool_get_fluency_delay(us_workers_pool_s *pool, const us_worker_s *ready_wr);
+bool us_workers_pool_autoscale(us_workers_pool_s *pool, us_worker_s *ready_wr);